@@ -48,7 +48,14 @@ struct {
 	bool vsync;
 	bool showcursor;
 	bool showfps;
+	bool showstats;                   // Print the demo's rendering statistics once a second
 	int fpscap;
+	bool hugepages;                   // Ask for huge-page backed file mappings
+	bool usecache;                    // Read and write the demo's preprocessing cache
+	const char *map;                  // Map to load (the demo sets the default)
+	int pvsbudget;                    // Megabytes allowed for a precomputed PVS matrix (0 = decode on demand)
+	bool buildvis;                    // Compute the PVS of maps that have no vis data
+	bool pipelinevis;                 // Find each frame's visible surfaces on a thread, a frame ahead of drawing
 	double fov;
 	double znear;
 	double zfar;
@@ -68,7 +75,14 @@ struct {
 	.vsync = true,
 	.showcursor = false,
 	.showfps = false,
+	.showstats = false,
 	.fpscap = 0,
+	.hugepages = false,
+	.usecache = true,
+	.map = NULL,
+	.pvsbudget = 16,
+	.buildvis = false,
+	.pipelinevis = false,
 	.fov = 45.0,
 	.znear = 4.0,
 	.zfar = 4000.0,
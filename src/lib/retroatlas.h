@@ -0,0 +1,151 @@
+//
+// Retro graphics library
+//
+// Author: Johan Gardhage <johan.gardhage@gmail.com>
+//
+
+#ifndef _RETROATLAS_H_
+#define _RETROATLAS_H_
+
+#include <limits.h> // INT_MAX
+#include <stdlib.h> // malloc, free
+
+//
+// A skyline packer for texture atlas pages. The top edge of what is packed so far is
+// kept as a skyline: runs of columns with the same height, left to right. A rectangle
+// goes where its top would be lowest, resting on the highest run under it, and the
+// leftmost such place wins ties. The space that leaves under its overhang is lost,
+// which costs little when rectangles are packed tallest first.
+//
+
+struct RETRO_SkylineRun
+{
+	int x;			// First column of the run
+	int y;			// Height of the skyline over the run
+	int width;		// Columns in the run
+};
+
+struct RETRO_Atlas
+{
+	int width = 0;					// Size of the page in texels
+	int height = 0;
+	RETRO_SkylineRun *runs = NULL;	// The skyline, left to right, covering every column
+	int numRuns = 0;
+};
+
+//
+// Allocate a packer for pages of width x height texels, with an empty page
+//
+inline bool RETRO_AllocAtlas(RETRO_Atlas *atlas, int width, int height)
+{
+	atlas->width = width;
+	atlas->height = height;
+	atlas->runs = (RETRO_SkylineRun *)malloc(width * sizeof(RETRO_SkylineRun));
+	if (!atlas->runs) {
+		return false;
+	}
+	atlas->runs[0] = { 0, 0, width };
+	atlas->numRuns = 1;
+	return true;
+}
+
+//
+// Start a new, empty page
+//
+inline void RETRO_ClearAtlas(RETRO_Atlas *atlas)
+{
+	atlas->runs[0] = { 0, 0, atlas->width };
+	atlas->numRuns = 1;
+}
+
+//
+// Height a rectangle of the given width would rest at when its left edge is on the
+// first column of run, or -1 if it would stick out of the page
+//
+inline int RETRO_AtlasFit(const RETRO_Atlas *atlas, int run, int width, int height)
+{
+	if (atlas->runs[run].x + width > atlas->width) {
+		return -1;
+	}
+	int y = 0;
+	for (int left = width; left > 0; run++) {
+		if (atlas->runs[run].y > y) {
+			y = atlas->runs[run].y;
+		}
+		left -= atlas->runs[run].width;
+	}
+	return y + height <= atlas->height ? y : -1;
+}
+
+//
+// Pack a rectangle of width x height texels into the page. Returns false when the
+// page has no room for it; otherwise x and y are its top-left texel.
+//
+inline bool RETRO_AtlasAlloc(RETRO_Atlas *atlas, int width, int height, int *x, int *y)
+{
+	// Find where the rectangle's top would be lowest
+	int best = -1;
+	int bestY = 0;
+	int bestTop = INT_MAX;
+	for (int i = 0; i < atlas->numRuns; i++) {
+		int fitY = RETRO_AtlasFit(atlas, i, width, height);
+		if (fitY >= 0 && fitY + height < bestTop) {
+			best = i;
+			bestY = fitY;
+			bestTop = fitY + height;
+		}
+	}
+	if (best < 0) {
+		return false;
+	}
+	*x = atlas->runs[best].x;
+	*y = bestY;
+
+	// Raise the skyline over the rectangle: a new run, and what is left of the runs it
+	// covers, cut short or dropped
+	RETRO_SkylineRun *runs = atlas->runs;
+	int right = *x + width;
+	int end = best;
+	while (end < atlas->numRuns && runs[end].x + runs[end].width <= right) {
+		end++;
+	}
+	if (end < atlas->numRuns && runs[end].x < right) {
+		runs[end].width -= right - runs[end].x;
+		runs[end].x = right;
+	}
+	int removed = end - best - 1;
+	if (removed < 0) {
+		for (int i = atlas->numRuns; i > best; i--) {
+			runs[i] = runs[i - 1];
+		}
+	} else if (removed > 0) {
+		for (int i = end; i < atlas->numRuns; i++) {
+			runs[i - removed] = runs[i];
+		}
+	}
+	atlas->numRuns -= removed;
+	runs[best] = { *x, bestTop, width };
+
+	// Merge neighbouring runs of the same height
+	int numRuns = 1;
+	for (int i = 1; i < atlas->numRuns; i++) {
+		if (runs[i].y == runs[numRuns - 1].y) {
+			runs[numRuns - 1].width += runs[i].width;
+		} else {
+			runs[numRuns++] = runs[i];
+		}
+	}
+	atlas->numRuns = numRuns;
+	return true;
+}
+
+//
+// Free the packer
+//
+inline void RETRO_FreeAtlas(RETRO_Atlas *atlas)
+{
+	free(atlas->runs);
+	*atlas = RETRO_Atlas();
+}
+
+#endif
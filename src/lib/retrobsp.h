@@ -7,13 +7,14 @@
 #ifndef _RETROBSP_H_
 #define _RETROBSP_H_
 
-#include <fcntl.h> // open
 #include <stdio.h> // printf
 #include <stdlib.h> // malloc, free
-#include <sys/stat.h> // stat
-#include <unistd.h> // read, close
+#include <string.h> // memcpy
+#include "retrofile.h"
 
 #define BSP_VERSION			29
+#define BSP2_VERSION		(('B') | ('S' << 8) | ('P' << 16) | ('2' << 24))
+#define BSP2RMQ_VERSION		(('2') | ('P' << 8) | ('S' << 16) | ('B' << 24))
 #define HEADER_LUMPS		15
 #define MAX_MAP_HULLS		4
 #define MIPLEVELS			4
@@ -51,7 +52,7 @@ enum
 	PLANE_ANYZ
 };
 
-// Values for dleaf_t.contents and clipnode children: what fills a region of space.
+// Values for leaf contents and clipnode children: what fills a region of space.
 enum
 {
 	CONTENTS_EMPTY = -1,
@@ -88,7 +89,7 @@ struct lump_t
 // BSP file header: version followed by the lump directory.
 struct dheader_t
 {
-	int version;				// BSP version, must be BSP_VERSION (29) for Quake
+	int version;				// BSP_VERSION (29) for Quake, or BSP2_VERSION / BSP2RMQ_VERSION for the extended formats
 	lump_t lumps[HEADER_LUMPS];	// Directory of every lump, indexed by LUMP_*
 };
 
@@ -146,8 +147,16 @@ struct texinfo_t
 	int flags;			// Surface flags (TEX_SPECIAL)
 };
 
-// A face: one drawable convex polygon.
-struct dface_t
+//
+// Quake's own BSP version 29 stores face, edge, node and leaf indices in 16 bits,
+// which large maps overflow. The extended formats widen them to 32 bits: 2PSB
+// (from RMQ) keeps short bounding boxes, and BSP2 also stores the boxes as floats.
+// The loader converts the version 29 and 2PSB lumps to the BSP2 structures, so the
+// renderer reads one representation whatever the file format.
+//
+
+// A face: one drawable convex polygon (version 29).
+struct dsface_t
 {
 	short planenum;						// Plane the face lies on
 	short side;							// 0 if the face faces along the plane normal, 1 if opposed
@@ -158,8 +167,20 @@ struct dface_t
 	int lightofs;						// Byte offset into the lighting lump, or -1 for no lightmap
 };
 
-// An internal BSP node.
-struct dnode_t
+// A face with 32-bit indices (2PSB and BSP2, and the renderer's representation).
+struct dlface_t
+{
+	int planenum;						// Plane the face lies on
+	int side;							// 0 if the face faces along the plane normal, 1 if opposed
+	int firstedge;						// First entry in the surfedge lump
+	int numedges;						// Number of edges (and vertices) in the face
+	int texinfo;						// Index into the texinfo lump
+	unsigned char styles[MAXLIGHTMAPS];	// Light styles affecting the face, 0xFF ends the list
+	int lightofs;						// Byte offset into the lighting lump, or -1 for no lightmap
+};
+
+// An internal BSP node (version 29).
+struct dsnode_t
 {
 	int planenum;				// Splitting plane, index into the plane lump
 	short children[2];			// Front/back child: >= 0 is a node index, < 0 is leaf ~child
@@ -169,6 +190,28 @@ struct dnode_t
 	unsigned short numfaces;	// Number of faces
 };
 
+// An internal BSP node with 32-bit indices and short bounds (2PSB).
+struct dl1node_t
+{
+	int planenum;				// Splitting plane, index into the plane lump
+	int children[2];			// Front/back child: >= 0 is a node index, < 0 is leaf ~child
+	short mins[3];				// Bounding box minimum, for culling
+	short maxs[3];				// Bounding box maximum, for culling
+	unsigned int firstface;		// First face in the face lump
+	unsigned int numfaces;		// Number of faces
+};
+
+// An internal BSP node with 32-bit indices and float bounds (BSP2, and the renderer's representation).
+struct dl2node_t
+{
+	int planenum;				// Splitting plane, index into the plane lump
+	int children[2];			// Front/back child: >= 0 is a node index, < 0 is leaf ~child
+	vec3_t mins;				// Bounding box minimum, for culling
+	vec3_t maxs;				// Bounding box maximum, for culling
+	unsigned int firstface;		// First face in the face lump
+	unsigned int numfaces;		// Number of faces
+};
+
 // A collision-hull node (not used for rendering).
 struct dclipnode_t
 {
@@ -176,14 +219,20 @@ struct dclipnode_t
 	short children[2];	// Front/back child: >= 0 is a node index, < 0 is a CONTENTS_* value
 };
 
-// An edge: a pair of vertex indices.
-struct dedge_t
+// An edge: a pair of vertex indices (version 29).
+struct dsedge_t
 {
 	unsigned short v[2];	// Start and end vertex indices
 };
 
-// A BSP leaf: a convex region of space.
-struct dleaf_t
+// An edge with 32-bit vertex indices (2PSB and BSP2, and the renderer's representation).
+struct dledge_t
+{
+	unsigned int v[2];	// Start and end vertex indices
+};
+
+// A BSP leaf: a convex region of space (version 29).
+struct dsleaf_t
 {
 	int contents;								// CONTENTS_* describing what fills the leaf
 	int visofs;									// Offset into the visibility lump, or -1 for no vis info
@@ -194,89 +243,172 @@ struct dleaf_t
 	unsigned char ambient_level[NUM_AMBIENTS];	// Ambient sound volumes (0 = silent, 0xFF = max)
 };
 
-// A renderer-side vertex: world position plus texture and lightmap coordinates.
-struct primdesc_t
+// A BSP leaf with 32-bit indices and short bounds (2PSB).
+struct dl1leaf_t
+{
+	int contents;								// CONTENTS_* describing what fills the leaf
+	int visofs;									// Offset into the visibility lump, or -1 for no vis info
+	short mins[3];								// Bounding box minimum, for culling
+	short maxs[3];								// Bounding box maximum, for culling
+	unsigned int firstmarksurface;				// First entry in the marksurface lump
+	unsigned int nummarksurfaces;				// Number of marksurfaces (faces) in the leaf
+	unsigned char ambient_level[NUM_AMBIENTS];	// Ambient sound volumes (0 = silent, 0xFF = max)
+};
+
+// A BSP leaf with 32-bit indices and float bounds (BSP2, and the renderer's representation).
+struct dl2leaf_t
+{
+	int contents;								// CONTENTS_* describing what fills the leaf
+	int visofs;									// Offset into the visibility lump, or -1 for no vis info
+	vec3_t mins;								// Bounding box minimum, for culling
+	vec3_t maxs;								// Bounding box maximum, for culling
+	unsigned int firstmarksurface;				// First entry in the marksurface lump
+	unsigned int nummarksurfaces;				// Number of marksurfaces (faces) in the leaf
+	unsigned char ambient_level[NUM_AMBIENTS];	// Ambient sound volumes (0 = silent, 0xFF = max)
+};
+
+// A BSP node repacked for point queries: the splitting plane is stored inline, so a
+// step of the walk reads one 32-byte node instead of a node and a plane in separate
+// lumps. Nodes keep the index order of the node lump.
+struct RETRO_BSPNode
+{
+	vec3_t normal;		// Splitting plane normal
+	float dist;			// Splitting plane distance from the origin
+	int type;			// PLANE_X..PLANE_ANYZ; for PLANE_X..PLANE_Z the normal is that unit axis
+	int children[2];	// Front/back child: >= 0 is a node index, < 0 is leaf ~child
+	int planenum;		// Index of the splitting plane in the plane lump
+};
+
+// The texture and lightmap coordinates of a renderer-side vertex. Vertex positions
+// are kept in a separate vec3_t stream, so passes that only need positions do not
+// pull the coordinates into the cache.
+struct primuv_t
 {
 	vec2_t t;	// Texture coordinate
 	vec2_t l;	// Lightmap coordinate
-	vec3_t v;	// Vertex coordinate
 };
 
 struct RETRO_BSP
 {
-	char *bsp;
-	dheader_t *header;
-	unsigned char *colormap;
+	char *bsp = NULL;					// The BSP file image (points into bspFile)
+	dheader_t header = {};				// Copy of the header, which a BSP inside a pak may hold misaligned
+	unsigned char *colormap = NULL;		// The colormap (points into colormapFile)
 	unsigned int palette[256];
+	RETRO_MappedFile bspFile;			// Read-only mapping of the BSP file
+	RETRO_MappedFile colormapFile;		// Read-only mapping of the colormap file
+	void *lumpCopies[HEADER_LUMPS] = {};	// Heap copies of lumps stored at misaligned offsets or converted to BSP2
+
+	// Lump views: base pointer and element count of every lump the renderer reads,
+	// resolved once at load by RETRO_LoadBSPLumps and checked by RETRO_ValidateBSP
+	char *entities = NULL;
+	int entitiesLength = 0;
+	dplane_t *planes = NULL;
+	int planeCount = 0;
+	unsigned char *textureLump = NULL;
+	int textureLumpLength = 0;
+	vec3_t *vertexes = NULL;
+	int vertexCount = 0;
+	unsigned char *visibility = NULL;
+	int visibilityLength = 0;
+	dl2node_t *nodes = NULL;
+	int nodeCount = 0;
+	texinfo_t *texinfos = NULL;
+	int texinfoCount = 0;
+	dlface_t *faces = NULL;
+	int faceCount = 0;
+	unsigned char *lighting = NULL;
+	int lightingLength = 0;
+	dl2leaf_t *leafs = NULL;
+	int leafCount = 0;
+	unsigned int *marksurfaces = NULL;
+	int marksurfaceCount = 0;
+	dledge_t *edges = NULL;
+	int edgeCount = 0;
+	int *surfedges = NULL;
+	int surfedgeCount = 0;
+	dmodel_t *models = NULL;
+	int modelCount = 0;
+
+	// Node tree repacked for point queries, built by RETRO_BuildBSPTree
+	RETRO_BSPNode *tree = NULL;
+
+	// The lump views point into the file mapping and lump copies this struct owns, so
+	// it is loaded in place and never copied
+	RETRO_BSP() = default;
+	RETRO_BSP(const RETRO_BSP &) = delete;
+	RETRO_BSP &operator=(const RETRO_BSP &) = delete;
 
 	// Get a lump directory entry by LUMP_* index
-	lump_t *getLump(int lump) { return &header->lumps[lump]; }
+	lump_t *getLump(int lump) { return &header.lumps[lump]; }
 
 	// Get the number of edges (and vertices) of a surface
-	int getNumEdges(int surfaceId) { return getSurface(surfaceId)->numedges; }
+	int getNumEdges(int surfaceId) { return faces[surfaceId].numedges; }
 
 	// Get the number of surfaces (faces)
-	int getNumSurfaces() { return getLump(LUMP_FACES)->filelen / sizeof(dface_t); }
+	int getNumSurfaces() { return faceCount; }
 
 	// Get the number of textures
-	int getNumTextures() { return ((dmiptexlump_t *)getMipHeader())->nummiptex; }
+	int getNumTextures() { return textureLumpLength ? ((dmiptexlump_t *)textureLump)->nummiptex : 0; }
 
 	// Get the number of marksurface entries
-	int getNumSurfaceLists() { return getLump(LUMP_MARKSURFACES)->filelen / sizeof(unsigned short); }
+	int getNumSurfaceLists() { return marksurfaceCount; }
 
 	// Get the number of visible leaves
-	int getNumLeaves() { return getModel(0)->visleafs; }
+	int getNumLeaves() { return models[0].visleafs; }
 
 	// Get one vertex
-	vec3_t *getVertex(int id) { return &((vec3_t *)&bsp[getLump(LUMP_VERTEXES)->fileofs])[id]; }
+	vec3_t *getVertex(int id) { return &vertexes[id]; }
 
 	// Get one edge (holds a start and end vertex index)
-	dedge_t *getEdge(int id) { return &((dedge_t *)&bsp[getLump(LUMP_EDGES)->fileofs])[id]; }
+	dledge_t *getEdge(int id) { return &edges[id]; }
 
 	// Get one surfedge entry: a signed edge index, negative when the edge is reversed
-	int getEdgeList(int id) { return ((int *)&bsp[getLump(LUMP_SURFEDGES)->fileofs])[id]; }
+	int getEdgeList(int id) { return surfedges[id]; }
 
 	// Get one plane
-	dplane_t *getPlane(int id) { return &((dplane_t *)&bsp[getLump(LUMP_PLANES)->fileofs])[id]; }
+	dplane_t *getPlane(int id) { return &planes[id]; }
 
 	// Get one surface (face)
-	dface_t *getSurface(int id) { return &((dface_t *)&bsp[getLump(LUMP_FACES)->fileofs])[id]; }
+	dlface_t *getSurface(int id) { return &faces[id]; }
 
 	// Get one marksurface entry: a face index referenced by a leaf
-	unsigned short getSurfaceList(int id) { return ((unsigned short *)&bsp[getLump(LUMP_MARKSURFACES)->fileofs])[id]; }
+	unsigned int getSurfaceList(int id) { return marksurfaces[id]; }
 
 	// Get one model (model 0 is the world and the main render hull)
-	dmodel_t *getModel(int id) { return &((dmodel_t *)&bsp[getLump(LUMP_MODELS)->fileofs])[id]; }
+	dmodel_t *getModel(int id) { return &models[id]; }
 
 	// Get one BSP node
-	dnode_t *getNode(int id) { return &((dnode_t *)&bsp[getLump(LUMP_NODES)->fileofs])[id]; }
+	dl2node_t *getNode(int id) { return &nodes[id]; }
 
 	// Get the root node of the render BSP (model 0)
-	dnode_t *getStartNode() { return getNode(getModel(0)->headnode[0]); }
+	dl2node_t *getStartNode() { return &nodes[models[0].headnode[0]]; }
 
 	// Get one BSP leaf
-	dleaf_t *getLeaf(int id) { return &((dleaf_t *)&bsp[getLump(LUMP_LEAFS)->fileofs])[id]; }
+	dl2leaf_t *getLeaf(int id) { return &leafs[id]; }
 
-	// Get the visibility list (run-length encoded PVS) at a dleaf_t.visofs offset
-	unsigned char *getVisibilityList(int offset) { return (unsigned char *)&bsp[getLump(LUMP_VISIBILITY)->fileofs] + offset; }
+	// Get the visibility list (run-length encoded PVS) at a leaf's visofs offset
+	unsigned char *getVisibilityList(int offset) { return visibility + offset; }
 
 	// Get the texture lump header (dmiptexlump_t)
-	unsigned char *getMipHeader() { return (unsigned char *)&bsp[getLump(LUMP_TEXTURES)->fileofs]; }
+	unsigned char *getMipHeader() { return textureLump; }
 
 	// Get one mip texture (NULL when the slot has no data, i.e. dataofs == -1 for a missing texture)
 	miptex_t *getMipTexture(int id) {
-		int offset = ((dmiptexlump_t *)getMipHeader())->dataofs[id];
-		return offset >= 0 ? (miptex_t *)(getMipHeader() + offset) : NULL;
+		int offset = ((dmiptexlump_t *)textureLump)->dataofs[id];
+		return offset >= 0 ? (miptex_t *)(textureLump + offset) : NULL;
 	}
 
 	// Get the lightmap samples at an offset, or NULL when there is no lightmap
-	unsigned char *getLightmap(int offset) { return offset >= 0 ? (unsigned char *)&bsp[getLump(LUMP_LIGHTING)->fileofs] + offset : NULL; }
+	unsigned char *getLightmap(int offset) { return offset >= 0 ? lighting + offset : NULL; }
+
+	// Get the entity lump: the map's entities as text, not necessarily NUL-terminated
+	char *getEntities() { return entities; }
 
 	// Get the colormap (shading table loaded separately from the BSP)
 	unsigned char *getColormap() { return colormap; }
 
 	// Get the texinfo for a surface
-	texinfo_t *getTextureInfo(int id) { return &((texinfo_t *)&bsp[getLump(LUMP_TEXINFO)->fileofs])[getSurface(id)->texinfo]; }
+	texinfo_t *getTextureInfo(int id) { return &texinfos[faces[id].texinfo]; }
 };
 
 static_assert(sizeof(lump_t) == 8, "lump_t must match Quake BSP");
@@ -285,61 +417,524 @@ static_assert(sizeof(dmodel_t) == 64, "dmodel_t must match Quake BSP");
 static_assert(sizeof(miptex_t) == 40, "miptex_t must match Quake BSP");
 static_assert(sizeof(dvertex_t) == 12, "dvertex_t must match Quake BSP");
 static_assert(sizeof(dplane_t) == 20, "dplane_t must match Quake BSP");
-static_assert(sizeof(dnode_t) == 24, "dnode_t must match Quake BSP");
+static_assert(sizeof(dsnode_t) == 24, "dsnode_t must match Quake BSP");
+static_assert(sizeof(dl1node_t) == 32, "dl1node_t must match 2PSB");
+static_assert(sizeof(dl2node_t) == 44, "dl2node_t must match BSP2");
 static_assert(sizeof(dclipnode_t) == 8, "dclipnode_t must match Quake BSP");
 static_assert(sizeof(texinfo_t) == 40, "texinfo_t must match Quake BSP");
-static_assert(sizeof(dface_t) == 20, "dface_t must match Quake BSP");
-static_assert(sizeof(dedge_t) == 4, "dedge_t must match Quake BSP");
-static_assert(sizeof(dleaf_t) == 28, "dleaf_t must match Quake BSP");
+static_assert(sizeof(dsface_t) == 20, "dsface_t must match Quake BSP");
+static_assert(sizeof(dlface_t) == 28, "dlface_t must match BSP2");
+static_assert(sizeof(dsedge_t) == 4, "dsedge_t must match Quake BSP");
+static_assert(sizeof(dledge_t) == 8, "dledge_t must match BSP2");
+static_assert(sizeof(dsleaf_t) == 28, "dsleaf_t must match Quake BSP");
+static_assert(sizeof(dl1leaf_t) == 32, "dl1leaf_t must match 2PSB");
+static_assert(sizeof(dl2leaf_t) == 44, "dl2leaf_t must match BSP2");
+static_assert(sizeof(RETRO_BSPNode) == 32, "RETRO_BSPNode must fill half a cache line");
+
+//
+// Resolve one lump to a typed view. The lump must lie inside the file and hold a
+// whole number of elements. Quake tools did not always align lumps, so a lump
+// whose address does not suit its element type is copied to aligned memory rather
+// than read through a misaligned pointer.
+//
+inline bool RETRO_LoadBSPLump(RETRO_BSP *bsp, int lump, size_t elementSize, size_t alignment, void **data, int *count)
+{
+	lump_t *l = bsp->getLump(lump);
+	if (l->fileofs < 0 || l->filelen < 0 || (size_t)l->fileofs + (size_t)l->filelen > bsp->bspFile.length) {
+		printf("[ERROR] RETRO_LoadBSPLump() Lump %d lies outside the file!\n", lump);
+		return false;
+	}
+	if (l->filelen % elementSize) {
+		printf("[ERROR] RETRO_LoadBSPLump() Lump %d has a funny size!\n", lump);
+		return false;
+	}
+
+	*data = bsp->bsp + l->fileofs;
+	*count = l->filelen / elementSize;
+	if (l->filelen && ((size_t)*data % alignment)) {
+		bsp->lumpCopies[lump] = malloc(l->filelen);
+		if (!bsp->lumpCopies[lump]) {
+			return false;
+		}
+		memcpy(bsp->lumpCopies[lump], *data, l->filelen);
+		*data = bsp->lumpCopies[lump];
+	}
+	return true;
+}
+
+//
+// Allocate the BSP2 copy of a lump that is converted from another format
+//
+inline void *RETRO_AllocBSPLump(int count, size_t elementSize)
+{
+	return malloc(count ? count * elementSize : 1);
+}
+
+//
+// Make a converted lump the owned copy of its view, releasing the aligned copy of
+// the original, if any, that it was converted from
+//
+inline void RETRO_ReplaceBSPLump(RETRO_BSP *bsp, int lump, void *converted)
+{
+	free(bsp->lumpCopies[lump]);
+	bsp->lumpCopies[lump] = converted;
+}
 
 //
-// Read a whole file into a freshly allocated buffer. Returns the byte count, or 0
-// on any failure (and leaves *bufferptr untouched).
+// Widen a version 29 node child. The child is read unsigned, like the extended
+// version 29 maps that number leaves down from 0xFFFF past 32767 nodes expect.
 //
-inline int RETRO_LoadFile(const char *filename, void **bufferptr)
+inline int RETRO_WidenBSPChild(short child, int nodeCount)
 {
-	struct stat st;
-	void *buffer;
-	int length;
+	int index = (unsigned short)child;
+	return index < nodeCount ? index : index - 65536;
+}
 
-	int f = open(filename, O_RDONLY);
-	if (f == -1) {
-		return 0;
+//
+// Resolve the face lump, widening version 29 faces to dlface_t
+//
+inline bool RETRO_LoadBSPFaces(RETRO_BSP *bsp)
+{
+	if (bsp->header.version != BSP_VERSION) {
+		return RETRO_LoadBSPLump(bsp, LUMP_FACES, sizeof(dlface_t), 4, (void **)&bsp->faces, &bsp->faceCount);
 	}
 
-	if (stat(filename, &st) != 0) {
-		close(f);
-		return 0;
+	dsface_t *in;
+	if (!RETRO_LoadBSPLump(bsp, LUMP_FACES, sizeof(dsface_t), 4, (void **)&in, &bsp->faceCount)) {
+		return false;
+	}
+	dlface_t *out = (dlface_t *)RETRO_AllocBSPLump(bsp->faceCount, sizeof(dlface_t));
+	if (!out) {
+		return false;
+	}
+	for (int i = 0; i < bsp->faceCount; i++) {
+		out[i].planenum = (unsigned short)in[i].planenum;
+		out[i].side = in[i].side;
+		out[i].firstedge = in[i].firstedge;
+		out[i].numedges = in[i].numedges;
+		out[i].texinfo = (unsigned short)in[i].texinfo;
+		memcpy(out[i].styles, in[i].styles, MAXLIGHTMAPS);
+		out[i].lightofs = in[i].lightofs;
+	}
+	RETRO_ReplaceBSPLump(bsp, LUMP_FACES, out);
+	bsp->faces = out;
+	return true;
+}
+
+//
+// Resolve the node lump, widening version 29 and 2PSB nodes to dl2node_t
+//
+inline bool RETRO_LoadBSPNodes(RETRO_BSP *bsp)
+{
+	int version = bsp->header.version;
+	if (version == BSP2_VERSION) {
+		return RETRO_LoadBSPLump(bsp, LUMP_NODES, sizeof(dl2node_t), 4, (void **)&bsp->nodes, &bsp->nodeCount);
+	}
+
+	void *in;
+	size_t inSize = version == BSP_VERSION ? sizeof(dsnode_t) : sizeof(dl1node_t);
+	if (!RETRO_LoadBSPLump(bsp, LUMP_NODES, inSize, 4, &in, &bsp->nodeCount)) {
+		return false;
+	}
+	dl2node_t *out = (dl2node_t *)RETRO_AllocBSPLump(bsp->nodeCount, sizeof(dl2node_t));
+	if (!out) {
+		return false;
 	}
-	length = st.st_size;
-	buffer = malloc(length);
-	if (!buffer) {
-		close(f);
-		return 0;
+	for (int i = 0; i < bsp->nodeCount; i++) {
+		if (version == BSP_VERSION) {
+			dsnode_t *node = (dsnode_t *)in + i;
+			out[i].planenum = node->planenum;
+			out[i].children[0] = RETRO_WidenBSPChild(node->children[0], bsp->nodeCount);
+			out[i].children[1] = RETRO_WidenBSPChild(node->children[1], bsp->nodeCount);
+			for (int j = 0; j < 3; j++) {
+				out[i].mins[j] = node->mins[j];
+				out[i].maxs[j] = node->maxs[j];
+			}
+			out[i].firstface = node->firstface;
+			out[i].numfaces = node->numfaces;
+		} else {
+			dl1node_t *node = (dl1node_t *)in + i;
+			out[i].planenum = node->planenum;
+			out[i].children[0] = node->children[0];
+			out[i].children[1] = node->children[1];
+			for (int j = 0; j < 3; j++) {
+				out[i].mins[j] = node->mins[j];
+				out[i].maxs[j] = node->maxs[j];
+			}
+			out[i].firstface = node->firstface;
+			out[i].numfaces = node->numfaces;
+		}
 	}
-	if (read(f, buffer, length) != length) {
-		free(buffer);
-		close(f);
-		return 0;
+	RETRO_ReplaceBSPLump(bsp, LUMP_NODES, out);
+	bsp->nodes = out;
+	return true;
+}
+
+//
+// Resolve the leaf lump, widening version 29 and 2PSB leaves to dl2leaf_t
+//
+inline bool RETRO_LoadBSPLeafs(RETRO_BSP *bsp)
+{
+	int version = bsp->header.version;
+	if (version == BSP2_VERSION) {
+		return RETRO_LoadBSPLump(bsp, LUMP_LEAFS, sizeof(dl2leaf_t), 4, (void **)&bsp->leafs, &bsp->leafCount);
 	}
-	close(f);
 
-	*bufferptr = buffer;
-	return length;
+	void *in;
+	size_t inSize = version == BSP_VERSION ? sizeof(dsleaf_t) : sizeof(dl1leaf_t);
+	if (!RETRO_LoadBSPLump(bsp, LUMP_LEAFS, inSize, 4, &in, &bsp->leafCount)) {
+		return false;
+	}
+	dl2leaf_t *out = (dl2leaf_t *)RETRO_AllocBSPLump(bsp->leafCount, sizeof(dl2leaf_t));
+	if (!out) {
+		return false;
+	}
+	for (int i = 0; i < bsp->leafCount; i++) {
+		if (version == BSP_VERSION) {
+			dsleaf_t *leaf = (dsleaf_t *)in + i;
+			out[i].contents = leaf->contents;
+			out[i].visofs = leaf->visofs;
+			for (int j = 0; j < 3; j++) {
+				out[i].mins[j] = leaf->mins[j];
+				out[i].maxs[j] = leaf->maxs[j];
+			}
+			out[i].firstmarksurface = leaf->firstmarksurface;
+			out[i].nummarksurfaces = leaf->nummarksurfaces;
+			memcpy(out[i].ambient_level, leaf->ambient_level, NUM_AMBIENTS);
+		} else {
+			dl1leaf_t *leaf = (dl1leaf_t *)in + i;
+			out[i].contents = leaf->contents;
+			out[i].visofs = leaf->visofs;
+			for (int j = 0; j < 3; j++) {
+				out[i].mins[j] = leaf->mins[j];
+				out[i].maxs[j] = leaf->maxs[j];
+			}
+			out[i].firstmarksurface = leaf->firstmarksurface;
+			out[i].nummarksurfaces = leaf->nummarksurfaces;
+			memcpy(out[i].ambient_level, leaf->ambient_level, NUM_AMBIENTS);
+		}
+	}
+	RETRO_ReplaceBSPLump(bsp, LUMP_LEAFS, out);
+	bsp->leafs = out;
+	return true;
 }
 
 //
-// Load the 256-entry RGB palette and pack it into 0x00BBGGRR words
+// Resolve the marksurface lump, widening version 29 face indices to 32 bits
 //
-inline bool RETRO_LoadBSPPalette(RETRO_BSP *bsp, const char *filename)
+inline bool RETRO_LoadBSPMarksurfaces(RETRO_BSP *bsp)
 {
-	unsigned char *tempPal = NULL;
+	if (bsp->header.version != BSP_VERSION) {
+		return RETRO_LoadBSPLump(bsp, LUMP_MARKSURFACES, sizeof(unsigned int), 4, (void **)&bsp->marksurfaces, &bsp->marksurfaceCount);
+	}
 
-	int length = RETRO_LoadFile(filename, (void **)&tempPal);
-	if (length < 256 * 3) {
-		if (tempPal) free(tempPal);
+	unsigned short *in;
+	if (!RETRO_LoadBSPLump(bsp, LUMP_MARKSURFACES, sizeof(unsigned short), 2, (void **)&in, &bsp->marksurfaceCount)) {
+		return false;
+	}
+	unsigned int *out = (unsigned int *)RETRO_AllocBSPLump(bsp->marksurfaceCount, sizeof(unsigned int));
+	if (!out) {
 		return false;
 	}
+	for (int i = 0; i < bsp->marksurfaceCount; i++) {
+		out[i] = in[i];
+	}
+	RETRO_ReplaceBSPLump(bsp, LUMP_MARKSURFACES, out);
+	bsp->marksurfaces = out;
+	return true;
+}
+
+//
+// Resolve the edge lump, widening version 29 vertex indices to 32 bits
+//
+inline bool RETRO_LoadBSPEdges(RETRO_BSP *bsp)
+{
+	if (bsp->header.version != BSP_VERSION) {
+		return RETRO_LoadBSPLump(bsp, LUMP_EDGES, sizeof(dledge_t), 4, (void **)&bsp->edges, &bsp->edgeCount);
+	}
+
+	dsedge_t *in;
+	if (!RETRO_LoadBSPLump(bsp, LUMP_EDGES, sizeof(dsedge_t), 2, (void **)&in, &bsp->edgeCount)) {
+		return false;
+	}
+	dledge_t *out = (dledge_t *)RETRO_AllocBSPLump(bsp->edgeCount, sizeof(dledge_t));
+	if (!out) {
+		return false;
+	}
+	for (int i = 0; i < bsp->edgeCount; i++) {
+		out[i].v[0] = in[i].v[0];
+		out[i].v[1] = in[i].v[1];
+	}
+	RETRO_ReplaceBSPLump(bsp, LUMP_EDGES, out);
+	bsp->edges = out;
+	return true;
+}
+
+//
+// Resolve the views of every lump the renderer reads. Lumps whose layout is the
+// same in every format are used in place; the others go through a loader that
+// converts them to BSP2 when the file is in another format.
+//
+inline bool RETRO_LoadBSPLumps(RETRO_BSP *bsp)
+{
+	return RETRO_LoadBSPLump(bsp, LUMP_ENTITIES, 1, 1, (void **)&bsp->entities, &bsp->entitiesLength) &&
+		RETRO_LoadBSPLump(bsp, LUMP_PLANES, sizeof(dplane_t), 4, (void **)&bsp->planes, &bsp->planeCount) &&
+		RETRO_LoadBSPLump(bsp, LUMP_TEXTURES, 1, 4, (void **)&bsp->textureLump, &bsp->textureLumpLength) &&
+		RETRO_LoadBSPLump(bsp, LUMP_VERTEXES, sizeof(dvertex_t), 4, (void **)&bsp->vertexes, &bsp->vertexCount) &&
+		RETRO_LoadBSPLump(bsp, LUMP_VISIBILITY, 1, 1, (void **)&bsp->visibility, &bsp->visibilityLength) &&
+		RETRO_LoadBSPNodes(bsp) &&
+		RETRO_LoadBSPLump(bsp, LUMP_TEXINFO, sizeof(texinfo_t), 4, (void **)&bsp->texinfos, &bsp->texinfoCount) &&
+		RETRO_LoadBSPFaces(bsp) &&
+		RETRO_LoadBSPLump(bsp, LUMP_LIGHTING, 1, 1, (void **)&bsp->lighting, &bsp->lightingLength) &&
+		RETRO_LoadBSPLeafs(bsp) &&
+		RETRO_LoadBSPMarksurfaces(bsp) &&
+		RETRO_LoadBSPEdges(bsp) &&
+		RETRO_LoadBSPLump(bsp, LUMP_SURFEDGES, sizeof(int), 4, (void **)&bsp->surfedges, &bsp->surfedgeCount) &&
+		RETRO_LoadBSPLump(bsp, LUMP_MODELS, sizeof(dmodel_t), 4, (void **)&bsp->models, &bsp->modelCount);
+}
+
+//
+// Check the texture lump: its directory, and that every miptex and its four mip
+// levels lie inside the lump
+//
+inline bool RETRO_ValidateBSPTextures(RETRO_BSP *bsp)
+{
+	if (bsp->textureLumpLength == 0) {
+		return true;
+	}
+	if (bsp->textureLumpLength < (int)sizeof(int)) {
+		printf("[ERROR] RETRO_ValidateBSP() Texture lump is too small!\n");
+		return false;
+	}
+
+	dmiptexlump_t *mipHeader = (dmiptexlump_t *)bsp->textureLump;
+	if (mipHeader->nummiptex < 0 || mipHeader->nummiptex > (bsp->textureLumpLength - (int)sizeof(int)) / (int)sizeof(int)) {
+		printf("[ERROR] RETRO_ValidateBSP() Texture directory is out of range!\n");
+		return false;
+	}
+
+	for (int i = 0; i < mipHeader->nummiptex; i++) {
+		int offset = mipHeader->dataofs[i];
+		if (offset < 0) {
+			continue;
+		}
+		if (offset % 4 || offset > bsp->textureLumpLength - (int)sizeof(miptex_t)) {
+			printf("[ERROR] RETRO_ValidateBSP() Texture %d is out of range!\n", i);
+			return false;
+		}
+		miptex_t *mipTexture = (miptex_t *)(bsp->textureLump + offset);
+		if (mipTexture->width > 4096 || mipTexture->height > 4096) {
+			printf("[ERROR] RETRO_ValidateBSP() Texture %d is too large!\n", i);
+			return false;
+		}
+		for (int level = 0; level < MIPLEVELS; level++) {
+			// A zero offset marks a texture whose pixels are stored outside the BSP
+			if (mipTexture->offsets[level] == 0) {
+				continue;
+			}
+			size_t size = (size_t)(mipTexture->width >> level) * (mipTexture->height >> level);
+			if ((size_t)offset + mipTexture->offsets[level] + size > (size_t)bsp->textureLumpLength) {
+				printf("[ERROR] RETRO_ValidateBSP() Texture %d mip level %d is out of range!\n", i, level);
+				return false;
+			}
+		}
+	}
+	return true;
+}
+
+//
+// Check every cross-reference between lumps once, so the accessors and the
+// renderer can index the views without bounds checks
+//
+inline bool RETRO_ValidateBSP(RETRO_BSP *bsp)
+{
+	if (!RETRO_ValidateBSPTextures(bsp)) {
+		return false;
+	}
+	int numTextures = bsp->getNumTextures();
+
+	if (bsp->modelCount < 1) {
+		printf("[ERROR] RETRO_ValidateBSP() Map has no world model!\n");
+		return false;
+	}
+	dmodel_t *world = &bsp->models[0];
+	if (world->headnode[0] < 0 || world->headnode[0] >= bsp->nodeCount) {
+		printf("[ERROR] RETRO_ValidateBSP() World head node is out of range!\n");
+		return false;
+	}
+	// Leaf 0 is the shared solid leaf; visible leaves are numbered from 1
+	if (world->visleafs < 0 || world->visleafs >= bsp->leafCount) {
+		printf("[ERROR] RETRO_ValidateBSP() World leaf count is out of range!\n");
+		return false;
+	}
+
+	for (int i = 0; i < bsp->edgeCount; i++) {
+		dledge_t *edge = &bsp->edges[i];
+		if (edge->v[0] >= (unsigned int)bsp->vertexCount || edge->v[1] >= (unsigned int)bsp->vertexCount) {
+			printf("[ERROR] RETRO_ValidateBSP() Edge %d references a missing vertex!\n", i);
+			return false;
+		}
+	}
+
+	for (int i = 0; i < bsp->surfedgeCount; i++) {
+		int edgeId = bsp->surfedges[i];
+		if (edgeId <= -bsp->edgeCount || edgeId >= bsp->edgeCount) {
+			printf("[ERROR] RETRO_ValidateBSP() Surfedge %d references a missing edge!\n", i);
+			return false;
+		}
+	}
+
+	for (int i = 0; i < bsp->texinfoCount; i++) {
+		if (bsp->texinfos[i].miptex < 0 || bsp->texinfos[i].miptex >= numTextures) {
+			printf("[ERROR] RETRO_ValidateBSP() Texinfo %d references a missing texture!\n", i);
+			return false;
+		}
+	}
+
+	for (int i = 0; i < bsp->faceCount; i++) {
+		dlface_t *face = &bsp->faces[i];
+		if (face->planenum < 0 || face->planenum >= bsp->planeCount) {
+			printf("[ERROR] RETRO_ValidateBSP() Face %d references a missing plane!\n", i);
+			return false;
+		}
+		if (face->texinfo < 0 || face->texinfo >= bsp->texinfoCount) {
+			printf("[ERROR] RETRO_ValidateBSP() Face %d references a missing texinfo!\n", i);
+			return false;
+		}
+		if (face->numedges < 3 || face->firstedge < 0 || face->firstedge > bsp->surfedgeCount - face->numedges) {
+			printf("[ERROR] RETRO_ValidateBSP() Face %d edges are out of range!\n", i);
+			return false;
+		}
+		if (face->lightofs >= bsp->lightingLength) {
+			printf("[ERROR] RETRO_ValidateBSP() Face %d lightmap is out of range!\n", i);
+			return false;
+		}
+	}
+
+	for (int i = 0; i < bsp->marksurfaceCount; i++) {
+		if (bsp->marksurfaces[i] >= (unsigned int)bsp->faceCount) {
+			printf("[ERROR] RETRO_ValidateBSP() Marksurface %d references a missing face!\n", i);
+			return false;
+		}
+	}
+
+	for (int i = 0; i < bsp->leafCount; i++) {
+		dl2leaf_t *leaf = &bsp->leafs[i];
+		if (leaf->firstmarksurface > (unsigned int)bsp->marksurfaceCount ||
+				leaf->nummarksurfaces > bsp->marksurfaceCount - leaf->firstmarksurface) {
+			printf("[ERROR] RETRO_ValidateBSP() Leaf %d marksurfaces are out of range!\n", i);
+			return false;
+		}
+		if (leaf->visofs >= bsp->visibilityLength) {
+			printf("[ERROR] RETRO_ValidateBSP() Leaf %d visibility is out of range!\n", i);
+			return false;
+		}
+	}
+
+	for (int i = 0; i < bsp->nodeCount; i++) {
+		dl2node_t *node = &bsp->nodes[i];
+		if (node->planenum < 0 || node->planenum >= bsp->planeCount) {
+			printf("[ERROR] RETRO_ValidateBSP() Node %d references a missing plane!\n", i);
+			return false;
+		}
+		for (int side = 0; side < 2; side++) {
+			int child = node->children[side];
+			if ((child >= 0 && child >= bsp->nodeCount) || (child < 0 && ~child >= bsp->leafCount)) {
+				printf("[ERROR] RETRO_ValidateBSP() Node %d references a missing child!\n", i);
+				return false;
+			}
+		}
+		if (node->firstface > (unsigned int)bsp->faceCount || node->numfaces > bsp->faceCount - node->firstface) {
+			printf("[ERROR] RETRO_ValidateBSP() Node %d faces are out of range!\n", i);
+			return false;
+		}
+	}
+
+	return true;
+}
+
+//
+// Repack the node tree for point queries, with each node's plane stored inline
+//
+inline bool RETRO_BuildBSPTree(RETRO_BSP *bsp)
+{
+	bsp->tree = (RETRO_BSPNode *)aligned_alloc(64, ((bsp->nodeCount * sizeof(RETRO_BSPNode) + 63) & ~(size_t)63));
+	if (!bsp->tree) {
+		return false;
+	}
+	for (int i = 0; i < bsp->nodeCount; i++) {
+		dl2node_t *node = &bsp->nodes[i];
+		dplane_t *plane = &bsp->planes[node->planenum];
+		RETRO_BSPNode *packed = &bsp->tree[i];
+		packed->normal[0] = plane->normal[0];
+		packed->normal[1] = plane->normal[1];
+		packed->normal[2] = plane->normal[2];
+		packed->dist = plane->dist;
+		// Only take the axial fast path when the normal really is the positive unit axis
+		packed->type = plane->type;
+		if (plane->type < PLANE_ANYX && plane->normal[plane->type] != 1.0f) {
+			packed->type = PLANE_ANYX + plane->type;
+		}
+		packed->children[0] = node->children[0];
+		packed->children[1] = node->children[1];
+		packed->planenum = node->planenum;
+	}
+	return true;
+}
+
+//
+// Signed distance from a point to a node's splitting plane; positive in front
+//
+inline float RETRO_BSPNodeDistance(RETRO_BSPNode *node, const float *point)
+{
+	if (node->type < PLANE_ANYX) {
+		return point[node->type] - node->dist;
+	}
+	return node->normal[0] * point[0] + node->normal[1] * point[1] + node->normal[2] * point[2] - node->dist;
+}
+
+//
+// Find the leaf of the render BSP (model 0) that contains a point. Returns the leaf
+// index; points on a splitting plane belong to its back side. The child is picked
+// with a branch rather than by indexing children[] with the compare, so the CPU can
+// predict the side and start loading the next node before the compare resolves.
+//
+inline int RETRO_FindLeaf(RETRO_BSP *bsp, const float *point)
+{
+	int child = bsp->models[0].headnode[0];
+	while (child >= 0) {
+		RETRO_BSPNode *node = &bsp->tree[child];
+		if (RETRO_BSPNodeDistance(node, point) > 0.0f) {
+			child = node->children[0];
+		} else {
+			child = node->children[1];
+		}
+	}
+	return ~child;
+}
+
+//
+// Find the leaves containing a batch of points, writing one leaf index per point.
+// Points that are close together in the batch share the upper levels of their walks,
+// which stay in cache and predict well.
+//
+inline void RETRO_FindLeaves(RETRO_BSP *bsp, const vec3_t *points, int count, int *leaves)
+{
+	for (int i = 0; i < count; i++) {
+		leaves[i] = RETRO_FindLeaf(bsp, points[i]);
+	}
+}
+
+//
+// Load the 256-entry RGB palette and pack it into 0x00BBGGRR words
+//
+inline bool RETRO_LoadBSPPalette(RETRO_BSP *bsp, RETRO_MappedFile *paletteFile)
+{
+	if (!paletteFile->data || paletteFile->length < 256 * 3) {
+		return false;
+	}
+
+	unsigned char *tempPal = (unsigned char *)paletteFile->data;
 
 	for (int i = 0; i < 256; i++) {
 		unsigned int r = tempPal[i * 3 + 0];
@@ -348,20 +943,19 @@ inline bool RETRO_LoadBSPPalette(RETRO_BSP *bsp, const char *filename)
 		bsp->palette[i] = (r) | (g << 8) | (b << 16);
 	}
 
-	free(tempPal);
 	return true;
 }
 
 //
 // Load the colormap: 64 shaded rows of 256 palette indices, used for lightmapping
 //
-inline bool RETRO_LoadBSPColormap(RETRO_BSP *bsp, const char *filename)
+inline bool RETRO_LoadBSPColormap(RETRO_BSP *bsp)
 {
-	int length = RETRO_LoadFile(filename, (void **)&bsp->colormap);
-	if (!length) {
+	if (!bsp->colormapFile.data) {
 		return false;
 	}
-	if (length < 256 * 64) {
+	bsp->colormap = (unsigned char *)bsp->colormapFile.data;
+	if (bsp->colormapFile.length < 256 * 64) {
 		printf("[ERROR] RETRO_LoadBSPColormap() Colormap file is too small!\n");
 		return false;
 	}
@@ -369,67 +963,127 @@ inline bool RETRO_LoadBSPColormap(RETRO_BSP *bsp, const char *filename)
 }
 
 //
-// Load the BSP file into memory and verify its version
+// Verify the version of the BSP file image (Quake's version 29, or the extended
+// BSP2 and 2PSB formats) and resolve its lumps. Each lump gets an access-pattern
+// hint: the lumps that are streamed once while the world is built read ahead,
+// while the tree, plane and visibility lumps that are probed every frame do not.
 //
-inline bool RETRO_LoadBSPMap(RETRO_BSP *bsp, const char *filename)
+inline bool RETRO_LoadBSPMap(RETRO_BSP *bsp)
 {
-	if (!RETRO_LoadFile(filename, (void **)&bsp->bsp)) {
+	static const struct { int lump; int advice; } lumpAdvice[] = {
+		{ LUMP_TEXTURES, MADV_SEQUENTIAL },
+		{ LUMP_LIGHTING, MADV_SEQUENTIAL },
+		{ LUMP_FACES, MADV_SEQUENTIAL },
+		{ LUMP_SURFEDGES, MADV_SEQUENTIAL },
+		{ LUMP_PLANES, MADV_RANDOM },
+		{ LUMP_VERTEXES, MADV_RANDOM },
+		{ LUMP_VISIBILITY, MADV_RANDOM },
+		{ LUMP_NODES, MADV_RANDOM },
+		{ LUMP_LEAFS, MADV_RANDOM },
+		{ LUMP_MARKSURFACES, MADV_RANDOM },
+		{ LUMP_EDGES, MADV_RANDOM },
+	};
+
+	if (!bsp->bspFile.data) {
 		return false;
 	}
+	bsp->bsp = (char *)bsp->bspFile.data;
 
-	bsp->header = (dheader_t *)bsp->bsp;
-	if (bsp->header->version != BSP_VERSION) {
+	if (bsp->bspFile.length < sizeof(dheader_t)) {
+		printf("[ERROR] RETRO_LoadBSPMap() BSP file is too small!\n");
+		return false;
+	}
+	// A BSP stored inside a pak can start at any offset
+	memcpy(&bsp->header, bsp->bsp, sizeof(dheader_t));
+	int version = bsp->header.version;
+	if (version != BSP_VERSION && version != BSP2_VERSION && version != BSP2RMQ_VERSION) {
 		printf("[ERROR] RETRO_LoadBSPMap() BSP file version mismatch!\n");
 		return false;
 	}
 
+	for (unsigned int i = 0; i < sizeof(lumpAdvice) / sizeof(lumpAdvice[0]); i++) {
+		lump_t *lump = bsp->getLump(lumpAdvice[i].lump);
+		if (lump->fileofs >= 0 && lump->filelen > 0) {
+			RETRO_AdviseFile(&bsp->bspFile, lump->fileofs, lump->filelen, lumpAdvice[i].advice);
+		}
+	}
+
+	// Resolve the lump views and reject malformed maps here rather than mid-frame
+	if (!RETRO_LoadBSPLumps(bsp) || !RETRO_ValidateBSP(bsp) || !RETRO_BuildBSPTree(bsp)) {
+		return false;
+	}
+
 	return true;
 }
 
 //
-// Release BSP and colormap allocations
+// Release the BSP and colormap mappings, any aligned or converted lump copies and the
+// repacked node tree
 //
 inline void RETRO_FreeBSP(RETRO_BSP *bsp)
 {
-	if (bsp->bsp) {
-		free(bsp->bsp);
-		bsp->bsp = NULL;
-	}
-	if (bsp->colormap) {
-		free(bsp->colormap);
-		bsp->colormap = NULL;
+	for (int i = 0; i < HEADER_LUMPS; i++) {
+		free(bsp->lumpCopies[i]);
+		bsp->lumpCopies[i] = NULL;
 	}
+	free(bsp->tree);
+	bsp->tree = NULL;
+	RETRO_UnmapFile(&bsp->bspFile);
+	RETRO_UnmapFile(&bsp->colormapFile);
+	bsp->bsp = NULL;
+	bsp->header = dheader_t();
+	bsp->colormap = NULL;
 }
 
 //
-// Load the BSP, palette and colormap that the renderer needs
+// Load the BSP, palette and colormap that the renderer needs from memory: whole
+// mapped files, or spans of a mapped pak. The BSP and colormap are used in place,
+// so the RETRO_BSP accessors point straight into them, and RETRO_FreeBSP releases
+// them. The palette is converted and released here. Returns false, with the BSP
+// freed, on error.
 //
-inline RETRO_BSP RETRO_LoadBSP(const char *bspFilename, const char *paletteFilename, const char *colormapFilename)
+inline bool RETRO_LoadBSP(RETRO_BSP *bsp, RETRO_MappedFile bspFile, RETRO_MappedFile paletteFile, RETRO_MappedFile colormapFile)
 {
-	RETRO_BSP bsp;
-	bsp.bsp = NULL;
-	bsp.header = NULL;
-	bsp.colormap = NULL;
+	bsp->bspFile = bspFile;
+	bsp->colormapFile = colormapFile;
 
-	if (!RETRO_LoadBSPMap(&bsp, bspFilename)) {
+	if (!RETRO_LoadBSPMap(bsp)) {
 		printf("[ERROR] RETRO_LoadBSP() Error loading bsp file\n");
-		RETRO_FreeBSP(&bsp);
-		return bsp;
+		RETRO_UnmapFile(&paletteFile);
+		RETRO_FreeBSP(bsp);
+		return false;
 	}
 
-	if (!RETRO_LoadBSPPalette(&bsp, paletteFilename)) {
+	bool paletteLoaded = RETRO_LoadBSPPalette(bsp, &paletteFile);
+	RETRO_UnmapFile(&paletteFile);
+	if (!paletteLoaded) {
 		printf("[ERROR] RETRO_LoadBSP() Error loading palette\n");
-		RETRO_FreeBSP(&bsp);
-		return bsp;
+		RETRO_FreeBSP(bsp);
+		return false;
 	}
 
-	if (!RETRO_LoadBSPColormap(&bsp, colormapFilename)) {
+	if (!RETRO_LoadBSPColormap(bsp)) {
 		printf("[ERROR] RETRO_LoadBSP() Error loading colormap\n");
-		RETRO_FreeBSP(&bsp);
-		return bsp;
+		RETRO_FreeBSP(bsp);
+		return false;
 	}
 
-	return bsp;
+	return true;
+}
+
+//
+// Load the BSP, palette and colormap from loose files, mapped read-only
+//
+inline bool RETRO_LoadBSP(RETRO_BSP *bsp, const char *bspFilename, const char *paletteFilename, const char *colormapFilename, bool hugePages = false)
+{
+	RETRO_MappedFile bspFile;
+	RETRO_MappedFile paletteFile;
+	RETRO_MappedFile colormapFile;
+
+	RETRO_MapFile(bspFilename, &bspFile, hugePages);
+	RETRO_MapFile(paletteFilename, &paletteFile);
+	RETRO_MapFile(colormapFilename, &colormapFile);
+	return RETRO_LoadBSP(bsp, bspFile, paletteFile, colormapFile);
 }
 
 #endif
@@ -0,0 +1,218 @@
+//
+// Retro graphics library
+//
+// Author: Johan Gardhage <johan.gardhage@gmail.com>
+//
+
+#ifndef _RETROCACHE_H_
+#define _RETROCACHE_H_
+
+#include <stdio.h> // fopen, fwrite, rename
+#include <string.h> // memset, strlen
+#include "retrofile.h"
+
+//
+// A cache file is a header holding a format version and a content key, a directory
+// of sections, and the section data. Every section starts on a RETRO_CACHE_ALIGN
+// boundary, so once the file is mapped each section can be used in place.
+//
+
+#define RETRO_CACHE_MAGIC			(('R') | ('C' << 8) | ('C' << 16) | ('H' << 24))
+#define RETRO_CACHE_ALIGN			64
+#define RETRO_CACHE_MAX_SECTIONS	16
+#define RETRO_HASH_INIT				0xcbf29ce484222325ULL
+
+// Build a section id from four characters
+#define RETRO_CACHE_ID(a, b, c, d)	((unsigned int)(a) | ((unsigned int)(b) << 8) | ((unsigned int)(c) << 16) | ((unsigned int)(d) << 24))
+
+// One directory entry: where a section lives in the file
+struct RETRO_CacheSection
+{
+	unsigned int id;			// RETRO_CACHE_ID of the section
+	unsigned int reserved;
+	unsigned long long offset;	// Offset to the section, in bytes, from the start of the file
+	unsigned long long length;	// Length of the section, in bytes
+};
+
+// Cache file header
+struct RETRO_CacheHeader
+{
+	unsigned int magic;			// RETRO_CACHE_MAGIC
+	unsigned int version;		// Format version of the sections, chosen by the writer
+	unsigned long long key;		// Hash of the data the cache was built from
+	unsigned int numSections;	// Number of used directory entries
+	unsigned int reserved;
+	RETRO_CacheSection sections[RETRO_CACHE_MAX_SECTIONS];
+};
+
+// A cache file being assembled; the section data is only referenced until written
+struct RETRO_CacheWriter
+{
+	RETRO_CacheHeader header;
+	const void *data[RETRO_CACHE_MAX_SECTIONS];
+};
+
+// An open, mapped cache file
+struct RETRO_Cache
+{
+	RETRO_MappedFile file;
+	RETRO_CacheHeader *header = NULL;
+};
+
+//
+// Hash a block of bytes into a running 64-bit FNV-style hash (start from
+// RETRO_HASH_INIT). Whole words are folded in at a time to keep large files cheap;
+// the multiply only carries bits upwards, so the high half of each product is folded
+// back down before the next word.
+//
+inline unsigned long long RETRO_HashBytes(unsigned long long hash, const void *data, size_t length)
+{
+	const unsigned char *bytes = (const unsigned char *)data;
+	while (length >= 8) {
+		unsigned long long word;
+		memcpy(&word, bytes, 8);
+		hash = (hash ^ word) * 0x100000001b3ULL;
+		hash ^= hash >> 32;
+		bytes += 8;
+		length -= 8;
+	}
+	while (length--) {
+		hash = (hash ^ *bytes++) * 0x100000001b3ULL;
+	}
+	return hash;
+}
+
+//
+// Start a new cache file with a format version and content key
+//
+inline void RETRO_BeginCache(RETRO_CacheWriter *writer, unsigned int version, unsigned long long key)
+{
+	memset(writer, 0, sizeof(*writer));
+	writer->header.magic = RETRO_CACHE_MAGIC;
+	writer->header.version = version;
+	writer->header.key = key;
+}
+
+//
+// Add a section to a cache file being assembled. The data must stay valid until
+// RETRO_WriteCache returns.
+//
+inline bool RETRO_AddCacheSection(RETRO_CacheWriter *writer, unsigned int id, const void *data, size_t length)
+{
+	RETRO_CacheHeader *header = &writer->header;
+	if (header->numSections >= RETRO_CACHE_MAX_SECTIONS) {
+		return false;
+	}
+
+	unsigned long long offset = sizeof(RETRO_CacheHeader);
+	if (header->numSections > 0) {
+		RETRO_CacheSection *last = &header->sections[header->numSections - 1];
+		offset = last->offset + last->length;
+	}
+	offset = (offset + RETRO_CACHE_ALIGN - 1) & ~(unsigned long long)(RETRO_CACHE_ALIGN - 1);
+
+	RETRO_CacheSection *section = &header->sections[header->numSections];
+	section->id = id;
+	section->offset = offset;
+	section->length = length;
+	writer->data[header->numSections++] = data;
+	return true;
+}
+
+//
+// Write the assembled cache file. It is written under a temporary name and renamed
+// into place, so a reader never maps a half-written file.
+//
+inline bool RETRO_WriteCache(RETRO_CacheWriter *writer, const char *filename)
+{
+	static const unsigned char padding[RETRO_CACHE_ALIGN] = {};
+	char tempFilename[1024];
+
+	if (strlen(filename) + 5 > sizeof(tempFilename)) {
+		return false;
+	}
+	snprintf(tempFilename, sizeof(tempFilename), "%s.tmp", filename);
+
+	FILE *f = fopen(tempFilename, "wb");
+	if (!f) {
+		return false;
+	}
+
+	bool ok = fwrite(&writer->header, sizeof(RETRO_CacheHeader), 1, f) == 1;
+	unsigned long long position = sizeof(RETRO_CacheHeader);
+	for (unsigned int i = 0; ok && i < writer->header.numSections; i++) {
+		RETRO_CacheSection *section = &writer->header.sections[i];
+		if (section->offset > position) {
+			ok = fwrite(padding, section->offset - position, 1, f) == 1;
+		}
+		if (ok && section->length > 0) {
+			ok = fwrite(writer->data[i], section->length, 1, f) == 1;
+		}
+		position = section->offset + section->length;
+	}
+
+	if (fclose(f) != 0) {
+		ok = false;
+	}
+	if (!ok || rename(tempFilename, filename) != 0) {
+		remove(tempFilename);
+		return false;
+	}
+	return true;
+}
+
+//
+// Map a cache file and accept it only if its magic, format version and content
+// key all match and every section lies inside the file
+//
+inline bool RETRO_OpenCache(const char *filename, unsigned int version, unsigned long long key, RETRO_Cache *cache)
+{
+	if (!RETRO_MapFile(filename, &cache->file)) {
+		return false;
+	}
+
+	RETRO_CacheHeader *header = (RETRO_CacheHeader *)cache->file.data;
+	bool ok = cache->file.length >= sizeof(RETRO_CacheHeader) &&
+		header->magic == RETRO_CACHE_MAGIC &&
+		header->version == version &&
+		header->key == key &&
+		header->numSections <= RETRO_CACHE_MAX_SECTIONS;
+	for (unsigned int i = 0; ok && i < header->numSections; i++) {
+		RETRO_CacheSection *section = &header->sections[i];
+		ok = section->offset <= cache->file.length && section->length <= cache->file.length - section->offset;
+	}
+
+	if (!ok) {
+		RETRO_UnmapFile(&cache->file);
+		return false;
+	}
+	cache->header = header;
+	return true;
+}
+
+//
+// Get a section of an open cache file, or NULL when it has no such section
+//
+inline void *RETRO_GetCacheSection(RETRO_Cache *cache, unsigned int id, size_t *length)
+{
+	for (unsigned int i = 0; i < cache->header->numSections; i++) {
+		RETRO_CacheSection *section = &cache->header->sections[i];
+		if (section->id == id) {
+			*length = section->length;
+			return (char *)cache->file.data + section->offset;
+		}
+	}
+	*length = 0;
+	return NULL;
+}
+
+//
+// Release an open cache file
+//
+inline void RETRO_CloseCache(RETRO_Cache *cache)
+{
+	RETRO_UnmapFile(&cache->file);
+	cache->header = NULL;
+}
+
+#endif
@@ -0,0 +1,102 @@
+//
+// Retro graphics library
+//
+// Author: Johan Gardhage <johan.gardhage@gmail.com>
+//
+
+#ifndef _RETROFILE_H_
+#define _RETROFILE_H_
+
+#include <fcntl.h> // open
+#include <stddef.h> // size_t
+#include <sys/mman.h> // mmap, munmap, madvise
+#include <sys/stat.h> // fstat
+#include <unistd.h> // close, sysconf
+
+// A whole file mapped read-only into memory, or a span of bytes inside another
+// mapping (such as one file of a pak) that it does not own
+struct RETRO_MappedFile
+{
+	void *data = NULL;		// First byte of the file, or NULL when nothing is mapped
+	size_t length = 0;		// Length of the file, in bytes
+	bool mapped = false;	// True if this owns the mapping and must unmap it
+};
+
+//
+// Map a whole file read-only. The pages come straight from the page cache, so no
+// copy is made and processes mapping the same file share its memory. With
+// hugePages set, the kernel is asked to back the mapping with transparent huge
+// pages where the filesystem supports it. Returns false, leaving *file empty, on
+// any failure.
+//
+inline bool RETRO_MapFile(const char *filename, RETRO_MappedFile *file, bool hugePages = false)
+{
+	struct stat st;
+
+	file->data = NULL;
+	file->length = 0;
+
+	int f = open(filename, O_RDONLY);
+	if (f == -1) {
+		return false;
+	}
+	if (fstat(f, &st) != 0 || st.st_size <= 0) {
+		close(f);
+		return false;
+	}
+
+	void *data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, f, 0);
+	// The mapping holds its own reference to the file
+	close(f);
+	if (data == MAP_FAILED) {
+		return false;
+	}
+
+#ifdef MADV_HUGEPAGE
+	if (hugePages) {
+		madvise(data, st.st_size, MADV_HUGEPAGE);
+	}
+#else
+	(void)hugePages;
+#endif
+
+	file->data = data;
+	file->length = st.st_size;
+	file->mapped = true;
+	return true;
+}
+
+//
+// Hint how a byte range of a mapped file will be read (MADV_SEQUENTIAL,
+// MADV_RANDOM, ...). The range is clamped to the file and widened to whole pages.
+//
+inline void RETRO_AdviseFile(RETRO_MappedFile *file, size_t offset, size_t length, int advice)
+{
+	if (!file->data || offset >= file->length) {
+		return;
+	}
+	if (length > file->length - offset) {
+		length = file->length - offset;
+	}
+
+	size_t pageSize = (size_t)sysconf(_SC_PAGESIZE);
+	size_t address = (size_t)file->data + offset;
+	size_t start = address & ~(pageSize - 1);
+	madvise((void *)start, address + length - start, advice);
+}
+
+//
+// Release a mapping made by RETRO_MapFile. A span of another mapping is only
+// forgotten, as its owner unmaps it.
+//
+inline void RETRO_UnmapFile(RETRO_MappedFile *file)
+{
+	if (file->data && file->mapped) {
+		munmap(file->data, file->length);
+	}
+	file->data = NULL;
+	file->length = 0;
+	file->mapped = false;
+}
+
+#endif
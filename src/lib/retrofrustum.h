@@ -0,0 +1,141 @@
+//
+// Retro graphics library
+//
+// Author: Johan Gardhage <johan.gardhage@gmail.com>
+//
+
+#ifndef _RETROFRUSTUM_H_
+#define _RETROFRUSTUM_H_
+
+#include <math.h> // tanf, atanf, sinf, cosf, sqrtf, M_PI
+#if defined(__SSE__)
+#include <xmmintrin.h>
+#endif
+#include "retrocamera.h"
+
+#define RETRO_FRUSTUM_PLANES 4									// Left, right, bottom and top
+#define RETRO_FRUSTUM_ALL ((1 << RETRO_FRUSTUM_PLANES) - 1)	// Clip flags with every plane still to test
+#define RETRO_SPHERE_BATCH 4									// Spheres tested by one RETRO_CullSpheres call
+
+// The side planes of a perspective view. Each plane passes through the eye with its
+// normal facing into the view, so a point p is inside when dot(normal, p) >= dist.
+struct RETRO_Frustum
+{
+	vec3_t normal[RETRO_FRUSTUM_PLANES];
+	float dist[RETRO_FRUSTUM_PLANES];
+};
+
+//
+// Set up the frustum of a camera with a vertical field of view of fovY degrees and a
+// width/height aspect ratio, matching gluPerspective
+//
+inline void RETRO_SetFrustum(RETRO_Frustum *frustum, const RETRO_Camera *camera, float fovY, float aspect)
+{
+	// Eye space axes, as gluLookAt derives them from the forward and up vectors
+	const float *forward = camera->forward;
+	vec3_t right = {
+		forward[1] * camera->up[2] - forward[2] * camera->up[1],
+		forward[2] * camera->up[0] - forward[0] * camera->up[2],
+		forward[0] * camera->up[1] - forward[1] * camera->up[0]
+	};
+	float length = sqrtf(right[0] * right[0] + right[1] * right[1] + right[2] * right[2]);
+	for (int i = 0; i < 3; i++) {
+		right[i] /= length;
+	}
+	vec3_t up = {
+		right[1] * forward[2] - right[2] * forward[1],
+		right[2] * forward[0] - right[0] * forward[2],
+		right[0] * forward[1] - right[1] * forward[0]
+	};
+
+	// Turn the forward vector outward by half the field of view to get each plane's
+	// edge; the normal is the side axis turned inward by the same angle
+	float halfY = fovY * 0.5f * (float)M_PI / 180.0f;
+	float halfX = atanf(tanf(halfY) * aspect);
+	for (int i = 0; i < 3; i++) {
+		frustum->normal[0][i] = right[i] * cosf(halfX) + forward[i] * sinf(halfX);
+		frustum->normal[1][i] = -right[i] * cosf(halfX) + forward[i] * sinf(halfX);
+		frustum->normal[2][i] = up[i] * cosf(halfY) + forward[i] * sinf(halfY);
+		frustum->normal[3][i] = -up[i] * cosf(halfY) + forward[i] * sinf(halfY);
+	}
+	for (int p = 0; p < RETRO_FRUSTUM_PLANES; p++) {
+		const float *n = frustum->normal[p];
+		frustum->dist[p] = n[0] * camera->origin[0] + n[1] * camera->origin[1] + n[2] * camera->origin[2];
+	}
+}
+
+//
+// Test an axis-aligned box against the planes set in clipFlags. Returns true when the
+// box is wholly outside one of them. Planes the box is wholly inside are cleared from
+// clipFlags, so boxes nested in it need not test them again.
+//
+inline bool RETRO_CullBox(const RETRO_Frustum *frustum, const vec3_t mins, const vec3_t maxs, int *clipFlags)
+{
+	for (int p = 0; p < RETRO_FRUSTUM_PLANES; p++) {
+		if (!(*clipFlags & (1 << p))) {
+			continue;
+		}
+
+		// The corners farthest along and against the normal
+		const float *n = frustum->normal[p];
+		float nearest = 0.0f;
+		float farthest = 0.0f;
+		for (int i = 0; i < 3; i++) {
+			if (n[i] >= 0.0f) {
+				farthest += n[i] * maxs[i];
+				nearest += n[i] * mins[i];
+			} else {
+				farthest += n[i] * mins[i];
+				nearest += n[i] * maxs[i];
+			}
+		}
+		if (farthest < frustum->dist[p]) {
+			return true;
+		}
+		if (nearest >= frustum->dist[p]) {
+			*clipFlags &= ~(1 << p);
+		}
+	}
+	return false;
+}
+
+//
+// Test a batch of RETRO_SPHERE_BATCH spheres, given as arrays of centre coordinates
+// and radii, against the planes set in clipFlags. Returns a mask with bit i set when
+// sphere i is at least partly inside all of them. The arrays are read a whole batch
+// at a time, so they must stay readable past a partial batch at their end.
+//
+inline int RETRO_CullSpheres(const RETRO_Frustum *frustum, const float *x, const float *y, const float *z, const float *radius, int clipFlags)
+{
+#if defined(__SSE__)
+	__m128 vx = _mm_loadu_ps(x);
+	__m128 vy = _mm_loadu_ps(y);
+	__m128 vz = _mm_loadu_ps(z);
+	__m128 vr = _mm_loadu_ps(radius);
+	int inside = (1 << RETRO_SPHERE_BATCH) - 1;
+	for (int p = 0; p < RETRO_FRUSTUM_PLANES; p++) {
+		if (!(clipFlags & (1 << p))) {
+			continue;
+		}
+		const float *n = frustum->normal[p];
+		__m128 d = _mm_add_ps(_mm_add_ps(_mm_mul_ps(vx, _mm_set1_ps(n[0])), _mm_mul_ps(vy, _mm_set1_ps(n[1]))),
+				_mm_mul_ps(vz, _mm_set1_ps(n[2])));
+		d = _mm_add_ps(_mm_sub_ps(d, _mm_set1_ps(frustum->dist[p])), vr);
+		inside &= ~_mm_movemask_ps(_mm_cmplt_ps(d, _mm_setzero_ps()));
+	}
+	return inside;
+#else
+	int inside = 0;
+	for (int i = 0; i < RETRO_SPHERE_BATCH; i++) {
+		bool outside = false;
+		for (int p = 0; p < RETRO_FRUSTUM_PLANES && !outside; p++) {
+			const float *n = frustum->normal[p];
+			outside = (clipFlags & (1 << p)) && n[0] * x[i] + n[1] * y[i] + n[2] * z[i] - frustum->dist[p] + radius[i] < 0.0f;
+		}
+		inside |= !outside << i;
+	}
+	return inside;
+#endif
+}
+
+#endif
@@ -14,8 +14,10 @@
 #include <GL/gl.h>
 #include <GL/glu.h>
 #endif
+#include <stddef.h> // ptrdiff_t
 #include <stdio.h> // printf
 #include <stdlib.h> // exit
+#include <string.h> // strstr
 
 // Global OpenGL context
 SDL_GLContext glContext = NULL;
@@ -36,6 +38,61 @@ SDL_GLContext glContext = NULL;
 #ifndef GL_RGB_SCALE
 #define GL_RGB_SCALE 0x8573
 #endif
+#ifndef GL_TEXTURE2
+#define GL_TEXTURE2 0x84C2
+#endif
+#ifndef GL_MAX_TEXTURE_UNITS
+#define GL_MAX_TEXTURE_UNITS 0x84E2
+#endif
+#ifndef GL_COMBINE_RGB
+#define GL_COMBINE_RGB 0x8571
+#endif
+#ifndef GL_COMBINE_ALPHA
+#define GL_COMBINE_ALPHA 0x8572
+#endif
+#ifndef GL_INTERPOLATE
+#define GL_INTERPOLATE 0x8575
+#endif
+#ifndef GL_PREVIOUS
+#define GL_PREVIOUS 0x8578
+#endif
+#ifndef GL_SOURCE0_RGB
+#define GL_SOURCE0_RGB 0x8580
+#endif
+#ifndef GL_SOURCE1_RGB
+#define GL_SOURCE1_RGB 0x8581
+#endif
+#ifndef GL_SOURCE2_RGB
+#define GL_SOURCE2_RGB 0x8582
+#endif
+#ifndef GL_SOURCE0_ALPHA
+#define GL_SOURCE0_ALPHA 0x8588
+#endif
+#ifndef GL_OPERAND2_RGB
+#define GL_OPERAND2_RGB 0x8592
+#endif
+
+// GL 1.5 buffer object tokens
+#ifndef GL_ARRAY_BUFFER
+#define GL_ARRAY_BUFFER 0x8892
+#endif
+#ifndef GL_ELEMENT_ARRAY_BUFFER
+#define GL_ELEMENT_ARRAY_BUFFER 0x8893
+#endif
+#ifndef GL_STATIC_DRAW
+#define GL_STATIC_DRAW 0x88E4
+#endif
+#ifndef GL_STREAM_DRAW
+#define GL_STREAM_DRAW 0x88E0
+#endif
+#ifndef GL_WRITE_ONLY
+#define GL_WRITE_ONLY 0x88B9
+#endif
+
+// GL 2.1 pixel buffer object token
+#ifndef GL_PIXEL_UNPACK_BUFFER
+#define GL_PIXEL_UNPACK_BUFFER 0x88EC
+#endif
 
 // ARB multitexture entry points, resolved at runtime in RETROGL_Initialize. Older GL
 // headers (notably on Linux) do not declare these, so they are loaded via
@@ -45,6 +102,248 @@ typedef void (*PFN_glMultiTexCoord2f)(GLenum target, GLfloat s, GLfloat t);
 PFN_glActiveTexture glActiveTextureFn = NULL;
 PFN_glMultiTexCoord2f glMultiTexCoord2fFn = NULL;
 
+// Vertex array and buffer object entry points (GL 1.3 to 1.5, or their ARB and EXT
+// extensions), resolved the same way. They are left NULL where the driver has neither.
+typedef void (*PFN_glClientActiveTexture)(GLenum texture);
+typedef void (*PFN_glMultiDrawElements)(GLenum mode, const GLsizei *count, GLenum type, const void *const *indices, GLsizei drawcount);
+typedef void (*PFN_glGenBuffers)(GLsizei n, GLuint *buffers);
+typedef void (*PFN_glDeleteBuffers)(GLsizei n, const GLuint *buffers);
+typedef void (*PFN_glBindBuffer)(GLenum target, GLuint buffer);
+typedef void (*PFN_glBufferData)(GLenum target, ptrdiff_t size, const void *data, GLenum usage);
+typedef void (*PFN_glBufferSubData)(GLenum target, ptrdiff_t offset, ptrdiff_t size, const void *data);
+typedef void *(*PFN_glMapBuffer)(GLenum target, GLenum access);
+typedef GLboolean (*PFN_glUnmapBuffer)(GLenum target);
+PFN_glClientActiveTexture glClientActiveTextureFn = NULL;
+PFN_glMultiDrawElements glMultiDrawElementsFn = NULL;
+PFN_glGenBuffers glGenBuffersFn = NULL;
+PFN_glDeleteBuffers glDeleteBuffersFn = NULL;
+PFN_glBindBuffer glBindBufferFn = NULL;
+PFN_glBufferData glBufferDataFn = NULL;
+PFN_glBufferSubData glBufferSubDataFn = NULL;
+PFN_glMapBuffer glMapBufferFn = NULL;
+PFN_glUnmapBuffer glUnmapBufferFn = NULL;
+
+// Texture units whose bindings and GL_TEXTURE_2D enable are shadowed
+#define RETROGL_STATE_UNITS 4
+
+// Shadow of the GL state the renderer changes every frame, so the RETROGL_ state
+// functions below can skip calls that would not change anything. The shadow is only
+// right while all changes to this state go through them.
+struct RETROGL_State
+{
+	GLenum activeTexture = GL_TEXTURE0;				// Active texture unit
+	GLuint textures[RETROGL_STATE_UNITS] = {};		// 2D texture bound to each unit
+	bool texture2D[RETROGL_STATE_UNITS] = {};		// GL_TEXTURE_2D enabled on each unit
+	bool depthTest = false;							// Enabled capabilities
+	bool cullFace = false;
+	bool blend = false;
+	bool alphaTest = false;
+	GLenum blendSrc = GL_ONE;						// Blend function
+	GLenum blendDst = GL_ZERO;
+	GLboolean depthMask = GL_TRUE;					// Depth buffer writes
+	unsigned int issued = 0;						// State calls passed on to the driver
+	unsigned int skipped = 0;						// State calls skipped as redundant
+};
+RETROGL_State glState;
+
+//
+// Resolve a GL entry point by its core name, or failing that by its extension name
+//
+SDL_FunctionPointer RETROGL_GetProcAddress(const char *name, const char *extensionName)
+{
+	SDL_FunctionPointer proc = SDL_GL_GetProcAddress(name);
+	if (!proc && extensionName) {
+		proc = SDL_GL_GetProcAddress(extensionName);
+	}
+	return proc;
+}
+
+//
+// True if the buffer object entry points needed to draw from static vertex and index
+// buffers were all resolved
+//
+bool RETROGL_HasBufferObjects(void)
+{
+	return glClientActiveTextureFn && glGenBuffersFn && glDeleteBuffersFn && glBindBufferFn &&
+			glBufferDataFn && glBufferSubDataFn;
+}
+
+//
+// True if texture uploads can be staged through a mapped pixel buffer object. Any
+// GL 2.1 driver has them; older ones may have ARB_pixel_buffer_object.
+//
+bool RETROGL_HasPixelBuffers(void)
+{
+	if (!RETROGL_HasBufferObjects() || !glMapBufferFn || !glUnmapBufferFn) {
+		return false;
+	}
+	const char *version = (const char *)glGetString(GL_VERSION);
+	const char *extensions = (const char *)glGetString(GL_EXTENSIONS);
+	return (version && (version[0] > '2' || (version[0] == '2' && version[2] >= '1'))) ||
+			(extensions && strstr(extensions, "GL_ARB_pixel_buffer_object"));
+}
+
+//
+// Make the active texture unit current, unless it already is
+//
+void RETROGL_ActiveTexture(GLenum unit)
+{
+	if (glState.activeTexture == unit) {
+		glState.skipped++;
+		return;
+	}
+	glActiveTextureFn(unit);
+	glState.activeTexture = unit;
+	glState.issued++;
+}
+
+//
+// Bind a 2D texture to the active texture unit, unless it is bound there already
+//
+void RETROGL_BindTexture(GLuint texture)
+{
+	int unit = glState.activeTexture - GL_TEXTURE0;
+	if (unit < RETROGL_STATE_UNITS && glState.textures[unit] == texture) {
+		glState.skipped++;
+		return;
+	}
+	glBindTexture(GL_TEXTURE_2D, texture);
+	if (unit < RETROGL_STATE_UNITS) {
+		glState.textures[unit] = texture;
+	}
+	glState.issued++;
+}
+
+//
+// Bind a 2D texture to a texture unit, which is left active
+//
+void RETROGL_BindTextureUnit(GLenum unit, GLuint texture)
+{
+	RETROGL_ActiveTexture(unit);
+	RETROGL_BindTexture(texture);
+}
+
+//
+// Shadow of a capability, or NULL for the ones that are not shadowed.
+// GL_TEXTURE_2D is shadowed per texture unit.
+//
+bool *RETROGL_CapabilityState(GLenum cap)
+{
+	switch (cap) {
+	case GL_TEXTURE_2D: {
+		int unit = glState.activeTexture - GL_TEXTURE0;
+		return unit < RETROGL_STATE_UNITS ? &glState.texture2D[unit] : NULL;
+	}
+	case GL_DEPTH_TEST:
+		return &glState.depthTest;
+	case GL_CULL_FACE:
+		return &glState.cullFace;
+	case GL_BLEND:
+		return &glState.blend;
+	case GL_ALPHA_TEST:
+		return &glState.alphaTest;
+	default:
+		return NULL;
+	}
+}
+
+//
+// Enable or disable a capability, unless it already is
+//
+void RETROGL_SetCapability(GLenum cap, bool enabled)
+{
+	bool *state = RETROGL_CapabilityState(cap);
+	if (state && *state == enabled) {
+		glState.skipped++;
+		return;
+	}
+	if (enabled) {
+		glEnable(cap);
+	} else {
+		glDisable(cap);
+	}
+	if (state) {
+		*state = enabled;
+	}
+	glState.issued++;
+}
+
+void RETROGL_Enable(GLenum cap)
+{
+	RETROGL_SetCapability(cap, true);
+}
+
+void RETROGL_Disable(GLenum cap)
+{
+	RETROGL_SetCapability(cap, false);
+}
+
+//
+// Set the blend function, unless it already is
+//
+void RETROGL_BlendFunc(GLenum src, GLenum dst)
+{
+	if (glState.blendSrc == src && glState.blendDst == dst) {
+		glState.skipped++;
+		return;
+	}
+	glBlendFunc(src, dst);
+	glState.blendSrc = src;
+	glState.blendDst = dst;
+	glState.issued++;
+}
+
+//
+// Enable or disable depth buffer writes, unless they already are
+//
+void RETROGL_DepthMask(GLboolean enabled)
+{
+	if (glState.depthMask == enabled) {
+		glState.skipped++;
+		return;
+	}
+	glDepthMask(enabled);
+	glState.depthMask = enabled;
+	glState.issued++;
+}
+
+//
+// Put the shadowed state into a known state by setting all of it on the driver:
+// texturing on unit 0 only, no textures bound, depth test and face culling on,
+// blending and alpha test off
+//
+void RETROGL_ResetState(void)
+{
+	int units = glActiveTextureFn ? RETROGL_STATE_UNITS : 1;
+	GLint maxUnits = 1;
+	glGetIntegerv(GL_MAX_TEXTURE_UNITS, &maxUnits);
+	if (units > maxUnits) {
+		units = maxUnits;
+	}
+	for (int unit = units - 1; unit >= 0; unit--) {
+		if (glActiveTextureFn) {
+			glActiveTextureFn(GL_TEXTURE0 + unit);
+		}
+		glBindTexture(GL_TEXTURE_2D, 0);
+		if (unit == 0) {
+			glEnable(GL_TEXTURE_2D);
+		} else {
+			glDisable(GL_TEXTURE_2D);
+		}
+	}
+	glEnable(GL_DEPTH_TEST);
+	glEnable(GL_CULL_FACE);
+	glDisable(GL_BLEND);
+	glDisable(GL_ALPHA_TEST);
+	glBlendFunc(GL_ONE, GL_ZERO);
+	glDepthMask(GL_TRUE);
+
+	glState = RETROGL_State();
+	glState.texture2D[0] = true;
+	glState.depthTest = true;
+	glState.cullFace = true;
+}
+
 void RETROGL_SetAttributes(void)
 {
 	SDL_GL_SetAttribute(SDL_GL_DOUBLEBUFFER, 1);
@@ -94,13 +393,21 @@ bool RETROGL_Initialize(SDL_Window *window, bool vsync)
 		glMultiTexCoord2fFn = (PFN_glMultiTexCoord2f)SDL_GL_GetProcAddress("glMultiTexCoord2fARB");
 	}
 
+	// Resolve the vertex array and buffer object entry points used to draw static geometry
+	glClientActiveTextureFn = (PFN_glClientActiveTexture)RETROGL_GetProcAddress("glClientActiveTexture", "glClientActiveTextureARB");
+	glMultiDrawElementsFn = (PFN_glMultiDrawElements)RETROGL_GetProcAddress("glMultiDrawElements", "glMultiDrawElementsEXT");
+	glGenBuffersFn = (PFN_glGenBuffers)RETROGL_GetProcAddress("glGenBuffers", "glGenBuffersARB");
+	glDeleteBuffersFn = (PFN_glDeleteBuffers)RETROGL_GetProcAddress("glDeleteBuffers", "glDeleteBuffersARB");
+	glBindBufferFn = (PFN_glBindBuffer)RETROGL_GetProcAddress("glBindBuffer", "glBindBufferARB");
+	glBufferDataFn = (PFN_glBufferData)RETROGL_GetProcAddress("glBufferData", "glBufferDataARB");
+	glBufferSubDataFn = (PFN_glBufferSubData)RETROGL_GetProcAddress("glBufferSubData", "glBufferSubDataARB");
+	glMapBufferFn = (PFN_glMapBuffer)RETROGL_GetProcAddress("glMapBuffer", "glMapBufferARB");
+	glUnmapBufferFn = (PFN_glUnmapBuffer)RETROGL_GetProcAddress("glUnmapBuffer", "glUnmapBufferARB");
+
 	// Setup OpenGL render state
 	glClearColor(0.0f, 0.0f, 0.0f, 0.0f);	// Black background
 	glDisable(GL_LIGHTING);
-	glDisable(GL_BLEND);
-	glEnable(GL_CULL_FACE);
-	glEnable(GL_DEPTH_TEST);
-	glEnable(GL_TEXTURE_2D);
+	RETROGL_ResetState();
 	glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
 	glDrawBuffer(GL_BACK);
 	glShadeModel(GL_SMOOTH);
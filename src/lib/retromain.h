@@ -27,7 +27,14 @@ void RETRO_ParseArguments(int argc, char *argv[])
 		{"nocursor",   no_argument, 0, 0},
 		{"showfps",    no_argument, 0, 0},
 		{"nofps",      no_argument, 0, 0},
+		{"showstats",  no_argument, 0, 0},
 		{"capfps",     required_argument, 0, 0},
+		{"hugepages",  no_argument, 0, 0},
+		{"nocache",    no_argument, 0, 0},
+		{"map",        required_argument, 0, 0},
+		{"pvsbudget",  required_argument, 0, 0},
+		{"buildvis",   no_argument, 0, 0},
+		{"pipelinevis", no_argument, 0, 0},
 		{0,            0,           0, 0}
 	};
 	bool usage = false;
@@ -46,11 +53,28 @@ void RETRO_ParseArguments(int argc, char *argv[])
 				RETRO.showfps = true;
 			} else if (strcmp("nofps", long_options[option_index].name) == 0) {
 				RETRO.showfps = false;
+			} else if (strcmp("showstats", long_options[option_index].name) == 0) {
+				RETRO.showstats = true;
 			} else if (strcmp("capfps", long_options[option_index].name) == 0) {
 				RETRO.fpscap = atoi(optarg);
 				if (RETRO.fpscap < 0) {
 					RETRO.fpscap = 0;
 				}
+			} else if (strcmp("hugepages", long_options[option_index].name) == 0) {
+				RETRO.hugepages = true;
+			} else if (strcmp("nocache", long_options[option_index].name) == 0) {
+				RETRO.usecache = false;
+			} else if (strcmp("map", long_options[option_index].name) == 0) {
+				RETRO.map = optarg;
+			} else if (strcmp("pvsbudget", long_options[option_index].name) == 0) {
+				RETRO.pvsbudget = atoi(optarg);
+				if (RETRO.pvsbudget < 0) {
+					RETRO.pvsbudget = 0;
+				}
+			} else if (strcmp("buildvis", long_options[option_index].name) == 0) {
+				RETRO.buildvis = true;
+			} else if (strcmp("pipelinevis", long_options[option_index].name) == 0) {
+				RETRO.pipelinevis = true;
 			}
 			break;
 		case 'h':
@@ -98,7 +122,14 @@ void RETRO_ParseArguments(int argc, char *argv[])
 		printf("     --nocursor     Hide mouse cursor\n");
 		printf("     --showfps      Show frame rate in window title\n");
 		printf("     --nofps        Hide frame rate\n");
+		printf("     --showstats    Print rendering statistics once a second\n");
 		printf("     --capfps=VALUE Limit frame rate to the specified VALUE\n");
+		printf("     --hugepages    Back mapped data files with huge pages\n");
+		printf("     --nocache      Do not read or write the preprocessing cache\n");
+		printf("     --map=NAME     Load the map NAME (e.g. e1m1 or maps/e1m1.bsp)\n");
+		printf("     --pvsbudget=MB Precompute every leaf's PVS within MB megabytes (0 = off)\n");
+		printf("     --buildvis     Compute the PVS of maps that have no vis data\n");
+		printf("     --pipelinevis  Find visible surfaces on a thread, a frame ahead of drawing\n");
 		if (RETRO.usagekeys) {
 			printf("\nKeys: %s\n", RETRO.usagekeys);
 		}
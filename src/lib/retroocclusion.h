@@ -0,0 +1,336 @@
+//
+// Retro graphics library
+//
+// Author: Johan Gardhage <johan.gardhage@gmail.com>
+//
+
+#ifndef _RETROOCCLUSION_H_
+#define _RETROOCCLUSION_H_
+
+#include <float.h> // FLT_MAX
+#include <math.h> // tanf, atanf, floorf, fabsf, sqrtf, M_PI
+#include <stdlib.h> // aligned_alloc, free
+#include <string.h> // memset
+#if defined(__SSE__)
+#include <xmmintrin.h>
+#endif
+#include "retrocamera.h"
+#include "retromath.h"
+
+//
+// A coarse software depth buffer for occlusion culling. Occluders are rasterized into
+// it on the CPU, then bounding boxes are tested against it: a box is occluded when
+// every pixel it covers holds an occluder nearer than the box's nearest point.
+//
+// Occluders cover the pixels whose centres they cover, and write the farthest depth
+// they have within each of them. A box is tested over its screen rectangle grown by a
+// pixel, so an occluder edge that passes through a pixel does not hide what lies just
+// beyond it. Depths are stored as inverse eye-space distances (nearer is larger, 0 is
+// empty), which interpolate linearly across the screen. Pixels are stored tile by
+// tile, and every tile keeps the farthest depth of its pixels, so a box behind a whole
+// tile is settled without reading the pixels.
+//
+
+#define RETRO_OCCLUSION_MAX_POINTS 64	// Most points of an occluder polygon, after clipping
+#define RETRO_OCCLUSION_TILE 8	// Tile edge in pixels; a tile is two 4-pixel vectors per row
+
+struct RETRO_OcclusionBuffer
+{
+	int width = 0;				// Size in pixels, whole tiles
+	int height = 0;
+	int tilesX = 0;				// Size in tiles
+	int tilesY = 0;
+	float *depth = NULL;		// Inverse depth of every pixel, a tile's rows at a time
+	float *tileDepth = NULL;	// Per tile, the smallest inverse depth of its pixels
+
+	// The view occluders and boxes are projected with
+	vec3_t origin;				// Eye position
+	vec3_t forward;				// Eye space axes
+	vec3_t right;
+	vec3_t up;
+	float scaleX;				// Pixels per unit of x/z and y/z
+	float scaleY;
+	float znear;				// Points nearer than this are not projected
+};
+
+//
+// Allocate a buffer of at least width x height pixels
+//
+inline bool RETRO_AllocOcclusionBuffer(RETRO_OcclusionBuffer *buffer, int width, int height)
+{
+	buffer->tilesX = (width + RETRO_OCCLUSION_TILE - 1) / RETRO_OCCLUSION_TILE;
+	buffer->tilesY = (height + RETRO_OCCLUSION_TILE - 1) / RETRO_OCCLUSION_TILE;
+	buffer->width = buffer->tilesX * RETRO_OCCLUSION_TILE;
+	buffer->height = buffer->tilesY * RETRO_OCCLUSION_TILE;
+	int numTiles = buffer->tilesX * buffer->tilesY;
+	buffer->depth = (float *)aligned_alloc(16, numTiles * RETRO_OCCLUSION_TILE * RETRO_OCCLUSION_TILE * sizeof(float));
+	buffer->tileDepth = (float *)malloc(numTiles * sizeof(float));
+	return buffer->depth && buffer->tileDepth;
+}
+
+//
+// Empty the buffer and set up the view of a camera with a vertical field of view of
+// fovY degrees and a width/height aspect ratio, matching gluPerspective
+//
+inline void RETRO_ClearOcclusionBuffer(RETRO_OcclusionBuffer *buffer, const RETRO_Camera *camera, float fovY, float aspect, float znear)
+{
+	int numTiles = buffer->tilesX * buffer->tilesY;
+	memset(buffer->depth, 0, numTiles * RETRO_OCCLUSION_TILE * RETRO_OCCLUSION_TILE * sizeof(float));
+	memset(buffer->tileDepth, 0, numTiles * sizeof(float));
+
+	// Eye space axes, as gluLookAt derives them from the forward and up vectors
+	for (int i = 0; i < 3; i++) {
+		buffer->origin[i] = camera->origin[i];
+		buffer->forward[i] = camera->forward[i];
+	}
+	Cross(buffer->forward, camera->up, buffer->right);
+	Normalize(buffer->right);
+	Cross(buffer->right, buffer->forward, buffer->up);
+
+	float tanY = tanf(fovY * 0.5f * (float)M_PI / 180.0f);
+	buffer->scaleX = buffer->width * 0.5f / (tanY * aspect);
+	buffer->scaleY = buffer->height * 0.5f / tanY;
+	buffer->znear = znear;
+}
+
+//
+// Project a point to pixel coordinates and inverse depth. Returns false when the
+// point is nearer than the near distance or behind the eye.
+//
+inline bool RETRO_ProjectOcclusionPoint(const RETRO_OcclusionBuffer *buffer, const float *point, float *projected)
+{
+	vec3_t delta = { point[0] - buffer->origin[0], point[1] - buffer->origin[1], point[2] - buffer->origin[2] };
+	float z = DotProduct(delta, buffer->forward);
+	if (z < buffer->znear) {
+		return false;
+	}
+	float inverseZ = 1.0f / z;
+	projected[0] = buffer->width * 0.5f + buffer->scaleX * DotProduct(delta, buffer->right) * inverseZ;
+	projected[1] = buffer->height * 0.5f - buffer->scaleY * DotProduct(delta, buffer->up) * inverseZ;
+	projected[2] = inverseZ;
+	return true;
+}
+
+//
+// Rasterize a triangle of projected vertices into the buffer
+//
+inline void RETRO_DrawOccluderTriangle(RETRO_OcclusionBuffer *buffer, const float *v0, const float *v1, const float *v2)
+{
+	// Wind the triangle so the edge functions are positive inside
+	float area = EdgeFunction(v0[0], v0[1], v1[0], v1[1], v2[0], v2[1]);
+	if (area < 0.0f) {
+		const float *swap = v1;
+		v1 = v2;
+		v2 = swap;
+		area = -area;
+	}
+	if (area < 1.0f) {
+		return;
+	}
+
+	// Edge i, opposite vertex i, as a*x + b*y + c
+	const float *v[3] = { v0, v1, v2 };
+	float a[3], b[3], c[3];
+	for (int i = 0; i < 3; i++) {
+		const float *p = v[(i + 1) % 3];
+		const float *q = v[(i + 2) % 3];
+		a[i] = q[1] - p[1];
+		b[i] = p[0] - q[0];
+		c[i] = EdgeFunction(p[0], p[1], q[0], q[1], 0.0f, 0.0f);
+	}
+
+	// Inverse depth as a plane over the screen; the farthest point of a pixel is half
+	// a step across it from its centre
+	float depthA = (a[0] * v0[2] + a[1] * v1[2] + a[2] * v2[2]) / area;
+	float depthB = (b[0] * v0[2] + b[1] * v1[2] + b[2] * v2[2]) / area;
+	float depthC = (c[0] * v0[2] + c[1] * v1[2] + c[2] * v2[2]) / area - 0.5f * (fabsf(depthA) + fabsf(depthB));
+
+	// Pixels of the triangle's bounding rectangle, clamped to the buffer
+	float minX = fminf(v0[0], fminf(v1[0], v2[0]));
+	float maxX = fmaxf(v0[0], fmaxf(v1[0], v2[0]));
+	float minY = fminf(v0[1], fminf(v1[1], v2[1]));
+	float maxY = fmaxf(v0[1], fmaxf(v1[1], v2[1]));
+	int x0 = minX < 0.0f ? 0 : (int)minX;
+	int y0 = minY < 0.0f ? 0 : (int)minY;
+	int x1 = maxX >= buffer->width ? buffer->width - 1 : (int)maxX;
+	int y1 = maxY >= buffer->height ? buffer->height - 1 : (int)maxY;
+	if (x0 > x1 || y0 > y1) {
+		return;
+	}
+
+	for (int tileY = y0 / RETRO_OCCLUSION_TILE; tileY <= y1 / RETRO_OCCLUSION_TILE; tileY++) {
+		for (int tileX = x0 / RETRO_OCCLUSION_TILE; tileX <= x1 / RETRO_OCCLUSION_TILE; tileX++) {
+			float *tile = &buffer->depth[(tileY * buffer->tilesX + tileX) * RETRO_OCCLUSION_TILE * RETRO_OCCLUSION_TILE];
+			for (int row = 0; row < RETRO_OCCLUSION_TILE; row++) {
+				float y = tileY * RETRO_OCCLUSION_TILE + row + 0.5f;
+				for (int column = 0; column < RETRO_OCCLUSION_TILE; column += 4) {
+					float x = tileX * RETRO_OCCLUSION_TILE + column + 0.5f;
+					float *pixels = &tile[row * RETRO_OCCLUSION_TILE + column];
+#if defined(__SSE__)
+					__m128 vx = _mm_add_ps(_mm_set1_ps(x), _mm_set_ps(3.0f, 2.0f, 1.0f, 0.0f));
+					__m128 depth = _mm_add_ps(_mm_mul_ps(_mm_set1_ps(depthA), vx), _mm_set1_ps(depthB * y + depthC));
+					__m128 mask = _mm_cmpgt_ps(depth, _mm_setzero_ps());
+					for (int i = 0; i < 3; i++) {
+						__m128 edge = _mm_add_ps(_mm_mul_ps(_mm_set1_ps(a[i]), vx), _mm_set1_ps(b[i] * y + c[i]));
+						mask = _mm_and_ps(mask, _mm_cmpge_ps(edge, _mm_setzero_ps()));
+					}
+					__m128 old = _mm_load_ps(pixels);
+					__m128 nearer = _mm_max_ps(old, depth);
+					_mm_store_ps(pixels, _mm_or_ps(_mm_and_ps(mask, nearer), _mm_andnot_ps(mask, old)));
+#else
+					for (int i = 0; i < 4; i++, x += 1.0f) {
+						float depth = depthA * x + depthB * y + depthC;
+						if (depth > 0.0f && depth > pixels[i] &&
+								a[0] * x + b[0] * y + c[0] >= 0.0f &&
+								a[1] * x + b[1] * y + c[1] >= 0.0f &&
+								a[2] * x + b[2] * y + c[2] >= 0.0f) {
+							pixels[i] = depth;
+						}
+					}
+#endif
+				}
+			}
+		}
+	}
+}
+
+//
+// Rasterize a convex polygon into the buffer as a triangle fan, clipped to the part
+// beyond the near distance. Returns false when none of it is drawn.
+//
+inline bool RETRO_DrawOccluder(RETRO_OcclusionBuffer *buffer, const vec3_t *points, int numPoints)
+{
+	if (numPoints < 3 || numPoints >= RETRO_OCCLUSION_MAX_POINTS) {
+		return false;
+	}
+
+	// Clip the polygon to the near plane, keeping the points at or beyond it
+	vec3_t clipped[RETRO_OCCLUSION_MAX_POINTS];
+	int numClipped = 0;
+	for (int i = 0; i < numPoints; i++) {
+		const float *p = points[i];
+		const float *q = points[(i + 1) % numPoints];
+		vec3_t deltaP = { p[0] - buffer->origin[0], p[1] - buffer->origin[1], p[2] - buffer->origin[2] };
+		vec3_t deltaQ = { q[0] - buffer->origin[0], q[1] - buffer->origin[1], q[2] - buffer->origin[2] };
+		float distP = DotProduct(deltaP, buffer->forward) - buffer->znear;
+		float distQ = DotProduct(deltaQ, buffer->forward) - buffer->znear;
+		if (distP >= 0.0f) {
+			clipped[numClipped][0] = p[0];
+			clipped[numClipped][1] = p[1];
+			clipped[numClipped][2] = p[2];
+			numClipped++;
+		}
+		if ((distP >= 0.0f) != (distQ >= 0.0f)) {
+			// Place the crossing a hair beyond the plane, so it projects
+			float t = distP / (distP - distQ);
+			for (int axis = 0; axis < 3; axis++) {
+				clipped[numClipped][axis] = p[axis] + t * (q[axis] - p[axis]) + buffer->forward[axis] * 0.001f;
+			}
+			numClipped++;
+		}
+	}
+	if (numClipped < 3) {
+		return false;
+	}
+
+	float first[3], previous[3], current[3];
+	RETRO_ProjectOcclusionPoint(buffer, clipped[0], first);
+	RETRO_ProjectOcclusionPoint(buffer, clipped[1], previous);
+	for (int i = 2; i < numClipped; i++) {
+		RETRO_ProjectOcclusionPoint(buffer, clipped[i], current);
+		RETRO_DrawOccluderTriangle(buffer, first, previous, current);
+		previous[0] = current[0];
+		previous[1] = current[1];
+		previous[2] = current[2];
+	}
+	return true;
+}
+
+//
+// Update the farthest depth of every tile, once the occluders are drawn
+//
+inline void RETRO_UpdateOcclusionTiles(RETRO_OcclusionBuffer *buffer)
+{
+	int numTiles = buffer->tilesX * buffer->tilesY;
+	for (int t = 0; t < numTiles; t++) {
+		const float *pixels = &buffer->depth[t * RETRO_OCCLUSION_TILE * RETRO_OCCLUSION_TILE];
+		float farthest = pixels[0];
+		for (int i = 1; i < RETRO_OCCLUSION_TILE * RETRO_OCCLUSION_TILE; i++) {
+			farthest = fminf(farthest, pixels[i]);
+		}
+		buffer->tileDepth[t] = farthest;
+	}
+}
+
+//
+// Test whether an axis-aligned box is hidden behind the occluders. A box that reaches
+// nearer than the near distance is never hidden.
+//
+inline bool RETRO_OccludedBox(const RETRO_OcclusionBuffer *buffer, const vec3_t mins, const vec3_t maxs)
+{
+	// The screen rectangle of the projected corners, and the nearest corner's depth
+	float minX = FLT_MAX, minY = FLT_MAX, maxX = -FLT_MAX, maxY = -FLT_MAX;
+	float nearest = 0.0f;
+	for (int corner = 0; corner < 8; corner++) {
+		vec3_t point = {
+			(corner & 1) ? maxs[0] : mins[0],
+			(corner & 2) ? maxs[1] : mins[1],
+			(corner & 4) ? maxs[2] : mins[2]
+		};
+		float projected[3];
+		if (!RETRO_ProjectOcclusionPoint(buffer, point, projected)) {
+			return false;
+		}
+		minX = fminf(minX, projected[0]);
+		maxX = fmaxf(maxX, projected[0]);
+		minY = fminf(minY, projected[1]);
+		maxY = fmaxf(maxY, projected[1]);
+		nearest = fmaxf(nearest, projected[2]);
+	}
+	// Grow the rectangle by a pixel on every side
+	int x0 = minX < 1.0f ? 0 : (int)minX - 1;
+	int y0 = minY < 1.0f ? 0 : (int)minY - 1;
+	int x1 = maxX >= buffer->width - 1 ? buffer->width - 1 : (int)maxX + 1;
+	int y1 = maxY >= buffer->height - 1 ? buffer->height - 1 : (int)maxY + 1;
+	if (x0 > x1 || y0 > y1) {
+		return false;
+	}
+
+	// Allow for rounding between the box and an occluder lying on its side
+	nearest *= 1.001f;
+
+	for (int tileY = y0 / RETRO_OCCLUSION_TILE; tileY <= y1 / RETRO_OCCLUSION_TILE; tileY++) {
+		for (int tileX = x0 / RETRO_OCCLUSION_TILE; tileX <= x1 / RETRO_OCCLUSION_TILE; tileX++) {
+			int t = tileY * buffer->tilesX + tileX;
+			if (buffer->tileDepth[t] > nearest) {
+				continue;
+			}
+			const float *tile = &buffer->depth[t * RETRO_OCCLUSION_TILE * RETRO_OCCLUSION_TILE];
+			for (int y = 0; y < RETRO_OCCLUSION_TILE; y++) {
+				int pixelY = tileY * RETRO_OCCLUSION_TILE + y;
+				if (pixelY < y0 || pixelY > y1) {
+					continue;
+				}
+				for (int x = 0; x < RETRO_OCCLUSION_TILE; x++) {
+					int pixelX = tileX * RETRO_OCCLUSION_TILE + x;
+					if (pixelX >= x0 && pixelX <= x1 && tile[y * RETRO_OCCLUSION_TILE + x] <= nearest) {
+						return false;
+					}
+				}
+			}
+		}
+	}
+	return true;
+}
+
+//
+// Release the buffer
+//
+inline void RETRO_FreeOcclusionBuffer(RETRO_OcclusionBuffer *buffer)
+{
+	free(buffer->depth);
+	free(buffer->tileDepth);
+	*buffer = RETRO_OcclusionBuffer();
+}
+
+#endif
@@ -0,0 +1,253 @@
+//
+// Retro graphics library
+//
+// Author: Johan Gardhage <johan.gardhage@gmail.com>
+//
+
+#ifndef _RETROPAK_H_
+#define _RETROPAK_H_
+
+#include <stdio.h> // printf
+#include <stdlib.h> // malloc, free
+#include <string.h> // memcpy
+#include "retrofile.h"
+
+#define PAK_IDENT		(('P') | ('A' << 8) | ('C' << 16) | ('K' << 24))
+#define PAK_NAME_LENGTH	56
+#define MAX_PAKS		8
+
+// Pak file header: identifier followed by the location of the directory
+struct dpackheader_t
+{
+	int ident;	// PAK_IDENT ("PACK")
+	int dirofs;	// Offset to the directory, in bytes, from the start of the file
+	int dirlen;	// Length of the directory, in bytes
+};
+
+// One directory entry: a file stored in the pak
+struct dpackfile_t
+{
+	char name[PAK_NAME_LENGTH];	// Path of the file, e.g. "maps/e1m1.bsp"
+	int filepos;				// Offset to the file data, in bytes, from the start of the pak
+	int filelen;				// Length of the file data, in bytes
+};
+
+static_assert(sizeof(dpackheader_t) == 12, "dpackheader_t must match Quake PAK");
+static_assert(sizeof(dpackfile_t) == 64, "dpackfile_t must match Quake PAK");
+
+// One slot of the hashed directory: a file of one of the open paks
+struct RETRO_PakSlot
+{
+	unsigned int hash;	// Hash of the file name
+	int pak;			// Index of the pak holding the file, or -1 for an empty slot
+	int entry;			// Index of the file in that pak's directory
+};
+
+// A set of mapped paks sharing one hashed directory. Paks opened later override
+// files of the same name in paks opened earlier, as pak1.pak overrides pak0.pak.
+struct RETRO_Paks
+{
+	RETRO_MappedFile files[MAX_PAKS];	// Read-only mapping of each pak
+	dpackfile_t *entries[MAX_PAKS];		// Directory of each pak
+	void *alignedEntries[MAX_PAKS];		// Aligned heap copy of a directory stored at a misaligned offset
+	int numEntries[MAX_PAKS];			// Number of files in each pak
+	int numPaks = 0;
+	RETRO_PakSlot *slots = NULL;		// Open-addressed hash table over every pak's files
+	unsigned int slotMask = 0;			// Number of slots minus one (a power of two minus one)
+	int numSlotsUsed = 0;
+};
+
+//
+// Hash a pak file name, ignoring case and stopping at the name field's end
+//
+inline unsigned int RETRO_HashPakName(const char *name)
+{
+	unsigned int hash = 2166136261u;
+	for (int i = 0; i < PAK_NAME_LENGTH && name[i]; i++) {
+		char c = name[i];
+		if (c >= 'A' && c <= 'Z') c += 'a' - 'A';
+		hash = (hash ^ (unsigned char)c) * 16777619u;
+	}
+	return hash;
+}
+
+//
+// Compare two pak file names, ignoring case and stopping at the name field's end
+//
+inline bool RETRO_SamePakName(const char *a, const char *b)
+{
+	for (int i = 0; i < PAK_NAME_LENGTH; i++) {
+		char ca = a[i];
+		char cb = b[i];
+		if (ca >= 'A' && ca <= 'Z') ca += 'a' - 'A';
+		if (cb >= 'A' && cb <= 'Z') cb += 'a' - 'A';
+		if (ca != cb) {
+			return false;
+		}
+		if (ca == '\0') {
+			return true;
+		}
+	}
+	return true;
+}
+
+//
+// Find the slot holding a file name, or the empty slot where it belongs
+//
+inline RETRO_PakSlot *RETRO_FindPakSlot(RETRO_Paks *paks, const char *name, unsigned int hash)
+{
+	for (unsigned int i = hash & paks->slotMask; ; i = (i + 1) & paks->slotMask) {
+		RETRO_PakSlot *slot = &paks->slots[i];
+		if (slot->pak < 0) {
+			return slot;
+		}
+		if (slot->hash == hash && RETRO_SamePakName(paks->entries[slot->pak][slot->entry].name, name)) {
+			return slot;
+		}
+	}
+}
+
+//
+// Make room for at least count more files in the hashed directory, keeping it at
+// most half full so lookups stay at one or two probes
+//
+inline bool RETRO_GrowPakSlots(RETRO_Paks *paks, int count)
+{
+	unsigned int needed = (unsigned int)(paks->numSlotsUsed + count) * 2;
+	if (paks->slots && needed <= paks->slotMask + 1) {
+		return true;
+	}
+
+	unsigned int size = 64;
+	while (size < needed) {
+		size *= 2;
+	}
+	RETRO_PakSlot *oldSlots = paks->slots;
+	unsigned int oldSize = oldSlots ? paks->slotMask + 1 : 0;
+
+	paks->slots = (RETRO_PakSlot *)malloc(size * sizeof(RETRO_PakSlot));
+	if (!paks->slots) {
+		paks->slots = oldSlots;
+		return false;
+	}
+	paks->slotMask = size - 1;
+	for (unsigned int i = 0; i < size; i++) {
+		paks->slots[i].pak = -1;
+	}
+	for (unsigned int i = 0; i < oldSize; i++) {
+		if (oldSlots[i].pak >= 0) {
+			*RETRO_FindPakSlot(paks, paks->entries[oldSlots[i].pak][oldSlots[i].entry].name, oldSlots[i].hash) = oldSlots[i];
+		}
+	}
+	free(oldSlots);
+	return true;
+}
+
+//
+// Map a pak and add its files to the hashed directory. Returns false when the pak
+// cannot be opened or is malformed; the paks already open stay usable.
+//
+inline bool RETRO_OpenPak(RETRO_Paks *paks, const char *filename, bool hugePages = false)
+{
+	if (paks->numPaks >= MAX_PAKS) {
+		return false;
+	}
+
+	RETRO_MappedFile *file = &paks->files[paks->numPaks];
+	if (!RETRO_MapFile(filename, file, hugePages)) {
+		return false;
+	}
+
+	dpackheader_t *header = (dpackheader_t *)file->data;
+	if (file->length < sizeof(dpackheader_t) || header->ident != PAK_IDENT ||
+			header->dirofs < 0 || header->dirlen < 0 || header->dirlen % sizeof(dpackfile_t) ||
+			(size_t)header->dirofs + header->dirlen > file->length) {
+		printf("[ERROR] RETRO_OpenPak() %s is not a valid pak file!\n", filename);
+		RETRO_UnmapFile(file);
+		return false;
+	}
+
+	int numEntries = header->dirlen / sizeof(dpackfile_t);
+	dpackfile_t *entries = (dpackfile_t *)((char *)file->data + header->dirofs);
+	void *alignedEntries = NULL;
+	if (header->dirofs % 4) {
+		alignedEntries = malloc(header->dirlen);
+		if (!alignedEntries) {
+			RETRO_UnmapFile(file);
+			return false;
+		}
+		memcpy(alignedEntries, entries, header->dirlen);
+		entries = (dpackfile_t *)alignedEntries;
+	}
+
+	bool valid = true;
+	for (int i = 0; i < numEntries && valid; i++) {
+		valid = entries[i].filepos >= 0 && entries[i].filelen >= 0 &&
+			(size_t)entries[i].filepos + entries[i].filelen <= file->length;
+	}
+	if (!valid) {
+		printf("[ERROR] RETRO_OpenPak() %s has a file outside the pak!\n", filename);
+	}
+	if (!valid || !RETRO_GrowPakSlots(paks, numEntries)) {
+		free(alignedEntries);
+		RETRO_UnmapFile(file);
+		return false;
+	}
+
+	int pak = paks->numPaks++;
+	paks->entries[pak] = entries;
+	paks->alignedEntries[pak] = alignedEntries;
+	paks->numEntries[pak] = numEntries;
+	for (int i = 0; i < numEntries; i++) {
+		unsigned int hash = RETRO_HashPakName(entries[i].name);
+		RETRO_PakSlot *slot = RETRO_FindPakSlot(paks, entries[i].name, hash);
+		if (slot->pak < 0) {
+			paks->numSlotsUsed++;
+		}
+		slot->hash = hash;
+		slot->pak = pak;
+		slot->entry = i;
+	}
+	return true;
+}
+
+//
+// Look up a file in the open paks. On success the span points straight into the
+// pak mapping: nothing is copied, and the span stays valid until the paks close.
+//
+inline bool RETRO_FindPakFile(RETRO_Paks *paks, const char *name, RETRO_MappedFile *span)
+{
+	if (!paks->slots) {
+		return false;
+	}
+
+	RETRO_PakSlot *slot = RETRO_FindPakSlot(paks, name, RETRO_HashPakName(name));
+	if (slot->pak < 0) {
+		return false;
+	}
+
+	dpackfile_t *entry = &paks->entries[slot->pak][slot->entry];
+	span->data = (char *)paks->files[slot->pak].data + entry->filepos;
+	span->length = entry->filelen;
+	span->mapped = false;
+	return true;
+}
+
+//
+// Release every open pak and the hashed directory
+//
+inline void RETRO_ClosePaks(RETRO_Paks *paks)
+{
+	for (int i = 0; i < paks->numPaks; i++) {
+		free(paks->alignedEntries[i]);
+		paks->alignedEntries[i] = NULL;
+		RETRO_UnmapFile(&paks->files[i]);
+	}
+	free(paks->slots);
+	paks->slots = NULL;
+	paks->slotMask = 0;
+	paks->numSlotsUsed = 0;
+	paks->numPaks = 0;
+}
+
+#endif
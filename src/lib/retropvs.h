@@ -0,0 +1,237 @@
+//
+// Retro graphics library
+//
+// Author: Johan Gardhage <johan.gardhage@gmail.com>
+//
+
+#ifndef _RETROPVS_H_
+#define _RETROPVS_H_
+
+#include <stdio.h> // printf
+#include <stdlib.h> // aligned_alloc, free
+#include <string.h> // memset
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+#include "retrobsp.h"
+
+//
+// Potentially visible sets as leaf bitsets: bit i of a set is leaf i. Leaf 0, the
+// shared solid leaf, is never visible. Sets are arrays of 64-bit words padded to
+// whole 32-byte blocks, so the set operations run a vector at a time.
+//
+
+typedef unsigned long long RETRO_PVSWord;
+
+#define RETRO_PVS_BLOCK_WORDS 4	// Words per 32-byte block
+
+// Every leaf's PVS decompressed into one aligned bit matrix, with a row per leaf
+struct RETRO_PVSMatrix
+{
+	RETRO_PVSWord *rows = NULL;	// numRows rows of rowWords words, 32-byte aligned
+	int numRows = 0;			// Number of rows: every leaf of the map
+	int rowWords = 0;			// Words per row, a multiple of RETRO_PVS_BLOCK_WORDS
+};
+
+//
+// Number of words in a leaf set of the map
+//
+inline int RETRO_PVSWords(RETRO_BSP *bsp)
+{
+	int blocks = (bsp->leafCount + 64 * RETRO_PVS_BLOCK_WORDS - 1) / (64 * RETRO_PVS_BLOCK_WORDS);
+	return blocks * RETRO_PVS_BLOCK_WORDS;
+}
+
+//
+// Decode the run-length encoded PVS of a leaf into a leaf set of the map. A leaf
+// without visibility information sees every leaf.
+//
+inline void RETRO_DecodePVS(RETRO_BSP *bsp, int leaf, RETRO_PVSWord *set)
+{
+	// Leaves are numbered 1..numLeaves; bit (i-1) of the PVS maps to leaf i.
+	int numLeaves = bsp->getNumLeaves();
+	dl2leaf_t *pLeaf = bsp->getLeaf(leaf);
+
+	memset(set, 0, RETRO_PVSWords(bsp) * sizeof(RETRO_PVSWord));
+	if (pLeaf->visofs < 0) {
+		for (int i = 1; i <= numLeaves; i++) {
+			set[i >> 6] |= 1ULL << (i & 63);
+		}
+		return;
+	}
+
+	// A zero byte means "skip the next (8 * following byte) leaves"; any other byte
+	// holds 8 visibility bits, least-significant bit first. A row running off the end
+	// of the lump in a malformed map is cut short there.
+	unsigned char *visibilityList = bsp->getVisibilityList(pLeaf->visofs);
+	unsigned char *visibilityEnd = bsp->getVisibilityList(bsp->visibilityLength);
+	for (int i = 1; i <= numLeaves && visibilityList < visibilityEnd; ) {
+		if (*visibilityList == 0) {
+			if (visibilityList + 1 >= visibilityEnd) {
+				break;
+			}
+			i += 8 * visibilityList[1];
+			visibilityList += 2;
+		} else {
+			for (int bit = 1; bit < 256 && i <= numLeaves; bit <<= 1, i++) {
+				if (*visibilityList & bit) {
+					set[i >> 6] |= 1ULL << (i & 63);
+				}
+			}
+			visibilityList++;
+		}
+	}
+}
+
+//
+// True if the run-length encoded PVS row of a map with numLeaves leaves, starting
+// length bytes before the end of its data, decodes without running off the end
+//
+inline bool RETRO_PVSRowFits(const unsigned char *row, size_t length, int numLeaves)
+{
+	size_t pos = 0;
+	for (int i = 1; i <= numLeaves; ) {
+		if (pos >= length) {
+			return false;
+		}
+		if (row[pos] == 0) {
+			if (pos + 1 >= length) {
+				return false;
+			}
+			i += 8 * row[pos + 1];
+			pos += 2;
+		} else {
+			i += 8;
+			pos++;
+		}
+	}
+	return true;
+}
+
+//
+// Allocate an aligned leaf set of the map
+//
+inline RETRO_PVSWord *RETRO_AllocPVS(RETRO_BSP *bsp)
+{
+	return (RETRO_PVSWord *)aligned_alloc(32, RETRO_PVSWords(bsp) * sizeof(RETRO_PVSWord));
+}
+
+//
+// Decompress the PVS of every leaf into a matrix. Returns false, leaving the matrix
+// empty, when it would take more than budget bytes or cannot be allocated; the
+// caller then decodes leaves on demand with RETRO_DecodePVS.
+//
+inline bool RETRO_BuildPVSMatrix(RETRO_PVSMatrix *pvs, RETRO_BSP *bsp, size_t budget)
+{
+	int rowWords = RETRO_PVSWords(bsp);
+	size_t size = (size_t)bsp->leafCount * rowWords * sizeof(RETRO_PVSWord);
+	if (size == 0 || size > budget) {
+		return false;
+	}
+
+	pvs->rows = (RETRO_PVSWord *)aligned_alloc(32, size);
+	if (!pvs->rows) {
+		return false;
+	}
+	pvs->numRows = bsp->leafCount;
+	pvs->rowWords = rowWords;
+	for (int leaf = 0; leaf < pvs->numRows; leaf++) {
+		RETRO_DecodePVS(bsp, leaf, &pvs->rows[(size_t)leaf * rowWords]);
+	}
+	return true;
+}
+
+//
+// Get the PVS row of a leaf
+//
+inline RETRO_PVSWord *RETRO_GetPVSRow(RETRO_PVSMatrix *pvs, int leaf)
+{
+	return &pvs->rows[(size_t)leaf * pvs->rowWords];
+}
+
+//
+// Test whether a leaf is in a set
+//
+inline bool RETRO_TestPVS(const RETRO_PVSWord *set, int leaf)
+{
+	return (set[leaf >> 6] >> (leaf & 63)) & 1;
+}
+
+//
+// Union of the rows of several leaves: the "fat" PVS of a group of viewpoints
+//
+inline void RETRO_UnionPVS(RETRO_PVSMatrix *pvs, const int *leaves, int count, RETRO_PVSWord *set)
+{
+	memset(set, 0, pvs->rowWords * sizeof(RETRO_PVSWord));
+	for (int i = 0; i < count; i++) {
+		const RETRO_PVSWord *row = RETRO_GetPVSRow(pvs, leaves[i]);
+#if defined(__AVX2__)
+		for (int word = 0; word < pvs->rowWords; word += 4) {
+			__m256i a = _mm256_load_si256((const __m256i *)&set[word]);
+			__m256i b = _mm256_load_si256((const __m256i *)&row[word]);
+			_mm256_store_si256((__m256i *)&set[word], _mm256_or_si256(a, b));
+		}
+#elif defined(__SSE2__)
+		for (int word = 0; word < pvs->rowWords; word += 2) {
+			__m128i a = _mm_load_si128((const __m128i *)&set[word]);
+			__m128i b = _mm_load_si128((const __m128i *)&row[word]);
+			_mm_store_si128((__m128i *)&set[word], _mm_or_si128(a, b));
+		}
+#else
+		for (int word = 0; word < pvs->rowWords; word++) {
+			set[word] |= row[word];
+		}
+#endif
+	}
+}
+
+//
+// Intersection of two sets of numWords words: the leaves both viewpoints can see
+//
+inline void RETRO_IntersectPVS(const RETRO_PVSWord *a, const RETRO_PVSWord *b, RETRO_PVSWord *set, int numWords)
+{
+#if defined(__AVX2__)
+	for (int word = 0; word < numWords; word += 4) {
+		__m256i va = _mm256_load_si256((const __m256i *)&a[word]);
+		__m256i vb = _mm256_load_si256((const __m256i *)&b[word]);
+		_mm256_store_si256((__m256i *)&set[word], _mm256_and_si256(va, vb));
+	}
+#elif defined(__SSE2__)
+	for (int word = 0; word < numWords; word += 2) {
+		__m128i va = _mm_load_si128((const __m128i *)&a[word]);
+		__m128i vb = _mm_load_si128((const __m128i *)&b[word]);
+		_mm_store_si128((__m128i *)&set[word], _mm_and_si128(va, vb));
+	}
+#else
+	for (int word = 0; word < numWords; word++) {
+		set[word] = a[word] & b[word];
+	}
+#endif
+}
+
+//
+// Number of leaves in a set of numWords words
+//
+inline int RETRO_CountPVS(const RETRO_PVSWord *set, int numWords)
+{
+	int count = 0;
+	for (int word = 0; word < numWords; word++) {
+		count += __builtin_popcountll(set[word]);
+	}
+	return count;
+}
+
+//
+// Release the matrix
+//
+inline void RETRO_FreePVSMatrix(RETRO_PVSMatrix *pvs)
+{
+	free(pvs->rows);
+	pvs->rows = NULL;
+	pvs->numRows = 0;
+	pvs->rowWords = 0;
+}
+
+#endif
@@ -0,0 +1,182 @@
+//
+// Retro graphics library
+//
+// Author: Johan Gardhage <johan.gardhage@gmail.com>
+//
+
+#ifndef _RETROTHREAD_H_
+#define _RETROTHREAD_H_
+
+#include <SDL3/SDL.h>
+#include <stdio.h> // printf
+
+#define RETRO_MAX_THREADS 64
+
+//
+// A pool of worker threads that run the iterations of parallel loops. Any thread may
+// start a loop, several loops may run at once, and the thread that starts a loop
+// works on it too, so a loop finishes even when every worker is busy elsewhere.
+//
+
+// One parallel loop; lives on the stack of the thread running RETRO_ParallelFor
+struct RETRO_ParallelJob
+{
+	void (*function)(void *data, int index);	// Loop body, called once per index
+	void *data;									// Passed to every call of the body
+	int count;									// Number of iterations
+	SDL_AtomicInt nextIndex;					// Next iteration to hand out
+	int numWorkers;								// Workers inside the loop (guarded by the pool mutex)
+	RETRO_ParallelJob *next;					// Next loop in the pool's list
+};
+
+struct RETRO_ThreadPool
+{
+	SDL_Thread *threads[RETRO_MAX_THREADS];
+	int numThreads = 0;
+	SDL_Mutex *mutex = NULL;
+	SDL_Condition *workAvailable = NULL;	// Signalled when a loop is started or the pool stops
+	SDL_Condition *workerLeft = NULL;		// Signalled when a worker leaves a loop
+	RETRO_ParallelJob *jobs = NULL;			// Loops that may still have iterations to hand out
+	bool quit = false;
+};
+
+//
+// Run iterations of a loop until none are left to hand out
+//
+inline void RETRO_RunParallelJob(RETRO_ParallelJob *job)
+{
+	int index;
+	while ((index = SDL_AddAtomicInt(&job->nextIndex, 1)) < job->count) {
+		job->function(job->data, index);
+	}
+}
+
+//
+// Worker thread: join whichever loop still has iterations to hand out
+//
+inline int SDLCALL RETRO_ThreadPoolWorker(void *data)
+{
+	RETRO_ThreadPool *pool = (RETRO_ThreadPool *)data;
+
+	SDL_LockMutex(pool->mutex);
+	while (!pool->quit) {
+		RETRO_ParallelJob *job = pool->jobs;
+		while (job && SDL_GetAtomicInt(&job->nextIndex) >= job->count) {
+			job = job->next;
+		}
+		if (!job) {
+			SDL_WaitCondition(pool->workAvailable, pool->mutex);
+			continue;
+		}
+
+		job->numWorkers++;
+		SDL_UnlockMutex(pool->mutex);
+		RETRO_RunParallelJob(job);
+		SDL_LockMutex(pool->mutex);
+		job->numWorkers--;
+		SDL_BroadcastCondition(pool->workerLeft);
+	}
+	SDL_UnlockMutex(pool->mutex);
+	return 0;
+}
+
+//
+// Start a pool of numThreads worker threads. With no workers, or when the threads
+// cannot be created, parallel loops run on the calling thread.
+//
+inline void RETRO_StartThreadPool(RETRO_ThreadPool *pool, int numThreads)
+{
+	pool->numThreads = 0;
+	pool->jobs = NULL;
+	pool->quit = false;
+	if (numThreads <= 0) {
+		return;
+	}
+	if (numThreads > RETRO_MAX_THREADS) {
+		numThreads = RETRO_MAX_THREADS;
+	}
+
+	pool->mutex = SDL_CreateMutex();
+	pool->workAvailable = SDL_CreateCondition();
+	pool->workerLeft = SDL_CreateCondition();
+	if (!pool->mutex || !pool->workAvailable || !pool->workerLeft) {
+		printf("[ERROR] RETRO_StartThreadPool() Unable to create the pool: %s\n", SDL_GetError());
+		return;
+	}
+	for (int i = 0; i < numThreads; i++) {
+		SDL_Thread *thread = SDL_CreateThread(RETRO_ThreadPoolWorker, "RETRO_Worker", pool);
+		if (!thread) {
+			printf("[ERROR] RETRO_StartThreadPool() Unable to create a worker: %s\n", SDL_GetError());
+			break;
+		}
+		pool->threads[pool->numThreads++] = thread;
+	}
+}
+
+//
+// Call function(data, index) for every index in [0, count), spread across the pool
+// and the calling thread. Returns when every call has returned.
+//
+inline void RETRO_ParallelFor(RETRO_ThreadPool *pool, int count, void (*function)(void *data, int index), void *data)
+{
+	if (!pool || pool->numThreads == 0 || count <= 1) {
+		for (int i = 0; i < count; i++) {
+			function(data, i);
+		}
+		return;
+	}
+
+	RETRO_ParallelJob job;
+	job.function = function;
+	job.data = data;
+	job.count = count;
+	SDL_SetAtomicInt(&job.nextIndex, 0);
+	job.numWorkers = 0;
+
+	SDL_LockMutex(pool->mutex);
+	job.next = pool->jobs;
+	pool->jobs = &job;
+	SDL_BroadcastCondition(pool->workAvailable);
+	SDL_UnlockMutex(pool->mutex);
+
+	RETRO_RunParallelJob(&job);
+
+	// Every iteration is handed out; unlink the loop and wait for the workers still
+	// running an iteration of it
+	SDL_LockMutex(pool->mutex);
+	RETRO_ParallelJob **link = &pool->jobs;
+	while (*link != &job) {
+		link = &(*link)->next;
+	}
+	*link = job.next;
+	while (job.numWorkers > 0) {
+		SDL_WaitCondition(pool->workerLeft, pool->mutex);
+	}
+	SDL_UnlockMutex(pool->mutex);
+}
+
+//
+// Stop the worker threads and release the pool
+//
+inline void RETRO_StopThreadPool(RETRO_ThreadPool *pool)
+{
+	if (pool->mutex) {
+		SDL_LockMutex(pool->mutex);
+		pool->quit = true;
+		SDL_BroadcastCondition(pool->workAvailable);
+		SDL_UnlockMutex(pool->mutex);
+	}
+	for (int i = 0; i < pool->numThreads; i++) {
+		SDL_WaitThread(pool->threads[i], NULL);
+	}
+	pool->numThreads = 0;
+
+	if (pool->workerLeft) SDL_DestroyCondition(pool->workerLeft);
+	if (pool->workAvailable) SDL_DestroyCondition(pool->workAvailable);
+	if (pool->mutex) SDL_DestroyMutex(pool->mutex);
+	pool->workerLeft = NULL;
+	pool->workAvailable = NULL;
+	pool->mutex = NULL;
+}
+
+#endif
@@ -0,0 +1,591 @@
+//
+// Retro graphics library
+//
+// Author: Johan Gardhage <johan.gardhage@gmail.com>
+//
+
+#ifndef _RETROVIS_H_
+#define _RETROVIS_H_
+
+#include <math.h> // fabs, sqrt
+#include <stdio.h> // printf
+#include <stdlib.h> // malloc, realloc, free
+#include <string.h> // memset, memcpy
+#include <SDL3/SDL.h>
+#include "retrobsp.h"
+#include "retropvs.h"
+#include "retrothread.h"
+
+//
+// A PVS compiler for maps built without vis. The portals between neighbouring leaves
+// are rebuilt from the render BSP: each node's plane, cut down to the region of the
+// node, is split by the subtrees on either side into pieces that each join a leaf in
+// front to a leaf behind. Each leaf is then a task for the thread pool: every portal
+// out of it is flooded through the portals that lie partly beyond it and that it lies
+// partly behind, and the leaf sees the leaves its portals reach. This is the "might
+// see" pass of the vis tool without the clipping that narrows it down, so a leaf's
+// set can be larger than a full vis would make it, but never misses a leaf that is
+// visible.
+//
+
+#define RETRO_VIS_MAX_POINTS 64		// Most points on a portal winding
+#define RETRO_VIS_EPSILON 0.1		// Points closer than this to a plane are on it
+
+// A convex polygon on a plane
+struct RETRO_VisWinding
+{
+	int numPoints = 0;
+	vec3_t points[RETRO_VIS_MAX_POINTS];
+};
+
+// A portal seen from one side, leading out of one leaf into another. The two sides of
+// portal i are portals 2i, from the leaf in front of the node plane, and 2i+1.
+struct RETRO_VisPortal
+{
+	vec3_t normal;		// Plane normal, facing into the leaf the portal leads to
+	float dist;			// Plane distance
+	int leaf;			// Leaf the portal leads to
+	int firstPoint;		// First point of the winding in the compiler's point pool
+	int numPoints;		// Number of points in the winding
+};
+
+// State of a PVS compile
+struct RETRO_VisCompiler
+{
+	RETRO_BSP *bsp;
+	int numLeaves;						// Visible leaves of the world, 1..numLeaves
+	int numWords;						// Words in a leaf set
+	RETRO_VisPortal *portals = NULL;
+	int numPortals = 0;
+	int maxPortals = 0;
+	vec3_t *points = NULL;				// Points of every portal winding
+	int numPoints = 0;
+	int maxPoints = 0;
+	vec3_t *boundNormals = NULL;		// Planes enclosing the node being portalized, facing in
+	float *boundDists = NULL;
+	int numBounds = 0;
+	int *leafPortals = NULL;			// Portals out of each leaf, leaf by leaf
+	int *firstLeafPortal = NULL;		// [numLeaves + 2] start of each leaf's portals in leafPortals
+	unsigned char **rows = NULL;		// Compressed PVS of each leaf
+	int *rowLengths = NULL;				// Length of each compressed PVS
+	bool overflow = false;				// A winding ran out of points or memory ran out
+	SDL_AtomicInt failed = {};			// A leaf could not be compiled
+};
+
+//
+// Test whether a leaf can be seen through. Water, slime and lava are, since the
+// renderer draws through them.
+//
+inline bool RETRO_VisLeafIsOpen(RETRO_BSP *bsp, int leaf)
+{
+	int contents = bsp->getLeaf(leaf)->contents;
+	return contents != CONTENTS_SOLID && contents != CONTENTS_SKY;
+}
+
+//
+// Make a square on a plane, large enough to cover a region range units from the origin
+//
+inline void RETRO_BaseVisWinding(const float *normal, float dist, double range, RETRO_VisWinding *w)
+{
+	// Pick the world axis least aligned with the normal as the winding's up direction
+	int axis = 0;
+	double max = -1.0;
+	for (int i = 0; i < 3; i++) {
+		if (fabs(normal[i]) > max) {
+			max = fabs(normal[i]);
+			axis = i;
+		}
+	}
+	double up[3] = { 0.0, 0.0, 0.0 };
+	up[axis == 2 ? 0 : 2] = 1.0;
+	double d = up[0] * normal[0] + up[1] * normal[1] + up[2] * normal[2];
+	double length = 0.0;
+	for (int i = 0; i < 3; i++) {
+		up[i] -= d * normal[i];
+		length += up[i] * up[i];
+	}
+	length = sqrt(length);
+	double right[3];
+	for (int i = 0; i < 3; i++) {
+		up[i] *= range / length;
+	}
+	right[0] = up[1] * normal[2] - up[2] * normal[1];
+	right[1] = up[2] * normal[0] - up[0] * normal[2];
+	right[2] = up[0] * normal[1] - up[1] * normal[0];
+
+	w->numPoints = 4;
+	for (int i = 0; i < 3; i++) {
+		double origin = normal[i] * dist;
+		w->points[0][i] = origin - right[i] + up[i];
+		w->points[1][i] = origin + right[i] + up[i];
+		w->points[2][i] = origin + right[i] - up[i];
+		w->points[3][i] = origin - right[i] - up[i];
+	}
+}
+
+//
+// Keep the part of a winding in front of a plane; points on the plane are kept. Sets
+// overflow when the result has too many points.
+//
+inline void RETRO_ClipVisWinding(const RETRO_VisWinding *in, const float *normal, float dist, RETRO_VisWinding *out, bool *overflow)
+{
+	double dists[RETRO_VIS_MAX_POINTS];
+	int sides[RETRO_VIS_MAX_POINTS];
+	int numFront = 0;
+	int numBack = 0;
+	for (int i = 0; i < in->numPoints; i++) {
+		const float *p = in->points[i];
+		dists[i] = (double)p[0] * normal[0] + (double)p[1] * normal[1] + (double)p[2] * normal[2] - dist;
+		sides[i] = dists[i] > RETRO_VIS_EPSILON ? 1 : dists[i] < -RETRO_VIS_EPSILON ? -1 : 0;
+		numFront += sides[i] > 0;
+		numBack += sides[i] < 0;
+	}
+	if (!numBack) {
+		if (out != in) {
+			*out = *in;
+		}
+		return;
+	}
+	if (!numFront) {
+		out->numPoints = 0;
+		return;
+	}
+
+	RETRO_VisWinding clipped;
+	for (int i = 0; i < in->numPoints; i++) {
+		int next = (i + 1) % in->numPoints;
+		if (sides[i] >= 0) {
+			if (clipped.numPoints == RETRO_VIS_MAX_POINTS) {
+				*overflow = true;
+				break;
+			}
+			memcpy(clipped.points[clipped.numPoints++], in->points[i], sizeof(vec3_t));
+		}
+		if (sides[i] == 0 || sides[next] == 0 || sides[i] == sides[next]) {
+			continue;
+		}
+
+		// The edge crosses the plane; add the crossing, exact on axial planes
+		if (clipped.numPoints == RETRO_VIS_MAX_POINTS) {
+			*overflow = true;
+			break;
+		}
+		double t = dists[i] / (dists[i] - dists[next]);
+		float *mid = clipped.points[clipped.numPoints++];
+		for (int j = 0; j < 3; j++) {
+			if (normal[j] == 1.0f) {
+				mid[j] = dist;
+			} else if (normal[j] == -1.0f) {
+				mid[j] = -dist;
+			} else {
+				mid[j] = in->points[i][j] + t * ((double)in->points[next][j] - in->points[i][j]);
+			}
+		}
+	}
+	*out = clipped;
+}
+
+//
+// Add both sides of a portal on a node plane between a leaf in front and a leaf behind
+//
+inline void RETRO_AddVisPortal(RETRO_VisCompiler *vis, const RETRO_VisWinding *w, const dplane_t *plane, int front, int back)
+{
+	if (vis->numPortals + 2 > vis->maxPortals) {
+		int size = vis->maxPortals ? vis->maxPortals * 2 : 1024;
+		RETRO_VisPortal *portals = (RETRO_VisPortal *)realloc(vis->portals, size * sizeof(RETRO_VisPortal));
+		if (!portals) {
+			vis->overflow = true;
+			return;
+		}
+		vis->portals = portals;
+		vis->maxPortals = size;
+	}
+	if (vis->numPoints + w->numPoints > vis->maxPoints) {
+		int size = vis->maxPoints ? vis->maxPoints * 2 : 8192;
+		while (size < vis->numPoints + w->numPoints) {
+			size *= 2;
+		}
+		vec3_t *points = (vec3_t *)realloc(vis->points, size * sizeof(vec3_t));
+		if (!points) {
+			vis->overflow = true;
+			return;
+		}
+		vis->points = points;
+		vis->maxPoints = size;
+	}
+	memcpy(vis->points[vis->numPoints], w->points, w->numPoints * sizeof(vec3_t));
+
+	// Out of the front leaf the portal faces back, out of the back leaf it faces front
+	for (int side = 0; side < 2; side++) {
+		RETRO_VisPortal *p = &vis->portals[vis->numPortals++];
+		float sign = side ? 1.0f : -1.0f;
+		for (int i = 0; i < 3; i++) {
+			p->normal[i] = sign * plane->normal[i];
+		}
+		p->dist = sign * plane->dist;
+		p->leaf = side ? front : back;
+		p->firstPoint = vis->numPoints;
+		p->numPoints = w->numPoints;
+	}
+	vis->numPoints += w->numPoints;
+}
+
+//
+// Split a piece of a node plane down a subtree. In the front subtree each piece finds
+// the leaf in front of the plane; that piece then goes down the back subtree to find
+// the leaves behind it.
+//
+inline void RETRO_FilterVisWinding(RETRO_VisCompiler *vis, const RETRO_VisWinding *w, const dplane_t *plane, int child, int backChild, int frontLeaf)
+{
+	if (child < 0) {
+		int leaf = ~child;
+		if (leaf > vis->numLeaves || !RETRO_VisLeafIsOpen(vis->bsp, leaf)) {
+			return;
+		}
+		if (frontLeaf < 0) {
+			RETRO_FilterVisWinding(vis, w, plane, backChild, 0, leaf);
+		} else {
+			RETRO_AddVisPortal(vis, w, plane, frontLeaf, leaf);
+		}
+		return;
+	}
+
+	dl2node_t *node = vis->bsp->getNode(child);
+	dplane_t *split = vis->bsp->getPlane(node->planenum);
+
+	// A piece lying on the split goes down the front only
+	bool on = true;
+	for (int i = 0; i < w->numPoints && on; i++) {
+		const float *p = w->points[i];
+		on = fabs((double)p[0] * split->normal[0] + (double)p[1] * split->normal[1] + (double)p[2] * split->normal[2] - split->dist) <= RETRO_VIS_EPSILON;
+	}
+	RETRO_VisWinding part;
+	if (on) {
+		RETRO_FilterVisWinding(vis, w, plane, node->children[0], backChild, frontLeaf);
+		return;
+	}
+	RETRO_ClipVisWinding(w, split->normal, split->dist, &part, &vis->overflow);
+	if (part.numPoints >= 3) {
+		RETRO_FilterVisWinding(vis, &part, plane, node->children[0], backChild, frontLeaf);
+	}
+	vec3_t back = { -split->normal[0], -split->normal[1], -split->normal[2] };
+	RETRO_ClipVisWinding(w, back, -split->dist, &part, &vis->overflow);
+	if (part.numPoints >= 3) {
+		RETRO_FilterVisWinding(vis, &part, plane, node->children[1], backChild, frontLeaf);
+	}
+}
+
+//
+// Build the portals on the plane of a node and of every node below it. The bounds
+// hold the planes of the node's ancestors, facing into its region.
+//
+inline void RETRO_BuildVisPortals(RETRO_VisCompiler *vis, int nodeIndex, double range)
+{
+	dl2node_t *node = vis->bsp->getNode(nodeIndex);
+	dplane_t *plane = vis->bsp->getPlane(node->planenum);
+
+	RETRO_VisWinding w;
+	RETRO_BaseVisWinding(plane->normal, plane->dist, range, &w);
+	for (int i = 0; i < vis->numBounds && w.numPoints >= 3; i++) {
+		RETRO_ClipVisWinding(&w, vis->boundNormals[i], vis->boundDists[i], &w, &vis->overflow);
+	}
+	if (w.numPoints >= 3) {
+		RETRO_FilterVisWinding(vis, &w, plane, node->children[0], node->children[1], -1);
+	}
+
+	for (int side = 0; side < 2; side++) {
+		if (node->children[side] < 0) {
+			continue;
+		}
+		float sign = side ? -1.0f : 1.0f;
+		for (int i = 0; i < 3; i++) {
+			vis->boundNormals[vis->numBounds][i] = sign * plane->normal[i];
+		}
+		vis->boundDists[vis->numBounds++] = sign * plane->dist;
+		RETRO_BuildVisPortals(vis, node->children[side], range);
+		vis->numBounds--;
+	}
+}
+
+//
+// Test whether a portal could be seen through another: some of the other portal must
+// lie beyond this one, and some of this portal behind the other
+//
+inline bool RETRO_VisPortalMightSee(RETRO_VisCompiler *vis, const RETRO_VisPortal *p, const RETRO_VisPortal *other)
+{
+	bool beyond = false;
+	for (int i = 0; i < other->numPoints && !beyond; i++) {
+		const float *v = vis->points[other->firstPoint + i];
+		beyond = v[0] * p->normal[0] + v[1] * p->normal[1] + v[2] * p->normal[2] - p->dist > RETRO_VIS_EPSILON;
+	}
+	if (!beyond) {
+		return false;
+	}
+	for (int i = 0; i < p->numPoints; i++) {
+		const float *v = vis->points[p->firstPoint + i];
+		if (v[0] * other->normal[0] + v[1] * other->normal[1] + v[2] * other->normal[2] - other->dist < -RETRO_VIS_EPSILON) {
+			return true;
+		}
+	}
+	return false;
+}
+
+//
+// Flood from the leaf behind a portal through every portal it might see, adding the
+// leaves reached to set. The stack holds up to numLeaves leaves.
+//
+inline void RETRO_FloodVisPortal(RETRO_VisCompiler *vis, const RETRO_VisPortal *p, RETRO_PVSWord *set, int *stack)
+{
+	int depth = 0;
+	set[p->leaf >> 6] |= 1ULL << (p->leaf & 63);
+	stack[depth++] = p->leaf;
+	while (depth > 0) {
+		int leaf = stack[--depth];
+		for (int i = vis->firstLeafPortal[leaf]; i < vis->firstLeafPortal[leaf + 1]; i++) {
+			RETRO_VisPortal *other = &vis->portals[vis->leafPortals[i]];
+			if (RETRO_TestPVS(set, other->leaf) || !RETRO_VisPortalMightSee(vis, p, other)) {
+				continue;
+			}
+			set[other->leaf >> 6] |= 1ULL << (other->leaf & 63);
+			stack[depth++] = other->leaf;
+		}
+	}
+}
+
+//
+// Run-length encode a leaf set the way the visibility lump stores it: a byte per 8
+// leaves from leaf 1, with each run of zero bytes written as a zero and a count.
+// Returns the length written to out.
+//
+inline int RETRO_CompressVis(const RETRO_PVSWord *set, int numLeaves, unsigned char *out)
+{
+	int numBytes = (numLeaves + 7) >> 3;
+	unsigned char *start = out;
+	for (int i = 0; i < numBytes; ) {
+		unsigned char bits = 0;
+		for (int bit = 0; bit < 8; bit++) {
+			int leaf = i * 8 + bit + 1;
+			if (leaf <= numLeaves && RETRO_TestPVS(set, leaf)) {
+				bits |= 1 << bit;
+			}
+		}
+		if (bits) {
+			*out++ = bits;
+			i++;
+			continue;
+		}
+
+		// Count the zero bytes that follow, up to what a byte can hold
+		int run = 1;
+		for (i++; i < numBytes && run < 255; i++, run++) {
+			bool empty = true;
+			for (int bit = 0; bit < 8 && empty; bit++) {
+				int leaf = i * 8 + bit + 1;
+				empty = leaf > numLeaves || !RETRO_TestPVS(set, leaf);
+			}
+			if (!empty) {
+				break;
+			}
+		}
+		*out++ = 0;
+		*out++ = run;
+	}
+	return out - start;
+}
+
+//
+// Compute and compress the PVS of leaf index + 1: the leaf itself and whatever its
+// portals see. Called by RETRO_ParallelFor, which hands the leaves out one at a time
+// to whichever thread is free, so threads left with cheap leaves take on more.
+//
+inline void RETRO_CompileVisLeaf(void *data, int index)
+{
+	RETRO_VisCompiler *vis = (RETRO_VisCompiler *)data;
+	int leaf = index + 1;
+	size_t setSize = vis->numWords * sizeof(RETRO_PVSWord);
+	RETRO_PVSWord *set = (RETRO_PVSWord *)malloc(setSize);
+	RETRO_PVSWord *seen = (RETRO_PVSWord *)malloc(setSize);
+	int *stack = (int *)malloc((vis->numLeaves + 1) * sizeof(int));
+	unsigned char *row = (unsigned char *)malloc(2 * ((vis->numLeaves + 7) >> 3) + 2);
+	if (!set || !seen || !stack || !row) {
+		free(set);
+		free(seen);
+		free(stack);
+		free(row);
+		SDL_SetAtomicInt(&vis->failed, 1);
+		return;
+	}
+
+	// Each portal floods on its own, since a leaf one portal reaches can still lead
+	// another portal on to leaves the first could not see
+	memset(set, 0, setSize);
+	set[leaf >> 6] |= 1ULL << (leaf & 63);
+	for (int i = vis->firstLeafPortal[leaf]; i < vis->firstLeafPortal[leaf + 1]; i++) {
+		memset(seen, 0, setSize);
+		RETRO_FloodVisPortal(vis, &vis->portals[vis->leafPortals[i]], seen, stack);
+		for (int word = 0; word < vis->numWords; word++) {
+			set[word] |= seen[word];
+		}
+	}
+	vis->rowLengths[leaf] = RETRO_CompressVis(set, vis->numLeaves, row);
+	vis->rows[leaf] = row;
+	free(set);
+	free(seen);
+	free(stack);
+}
+
+//
+// Release the working data of a compile
+//
+inline void RETRO_FreeVisCompiler(RETRO_VisCompiler *vis)
+{
+	free(vis->portals);
+	free(vis->points);
+	free(vis->boundNormals);
+	free(vis->boundDists);
+	free(vis->leafPortals);
+	free(vis->firstLeafPortal);
+	if (vis->rows) {
+		for (int leaf = 0; leaf <= vis->numLeaves; leaf++) {
+			free(vis->rows[leaf]);
+		}
+	}
+	free(vis->rows);
+	free(vis->rowLengths);
+	*vis = RETRO_VisCompiler();
+}
+
+//
+// Compute the PVS of every visible leaf of the world. On success, returns a visibility
+// lump in *data and *length, and each leaf's offset into it in offsets[0..leafCount);
+// leaves outside the world's visible leaves get -1.
+//
+inline bool RETRO_CompileVis(RETRO_BSP *bsp, RETRO_ThreadPool *pool, unsigned char **data, int *length, int *offsets)
+{
+	RETRO_VisCompiler vis;
+	vis.bsp = bsp;
+	vis.numLeaves = bsp->getNumLeaves();
+	vis.numWords = RETRO_PVSWords(bsp);
+
+	// Bound the root by the world's model box, with a margin
+	dmodel_t *world = bsp->getModel(0);
+	double range = 0.0;
+	vis.boundNormals = (vec3_t *)malloc((bsp->nodeCount + 6) * sizeof(vec3_t));
+	vis.boundDists = (float *)malloc((bsp->nodeCount + 6) * sizeof(float));
+	if (!vis.boundNormals || !vis.boundDists) {
+		RETRO_FreeVisCompiler(&vis);
+		return false;
+	}
+	for (int i = 0; i < 3; i++) {
+		range = SDL_max(range, SDL_max(fabs(world->mins[i]), fabs(world->maxs[i])));
+		vec3_t normal = { 0.0f, 0.0f, 0.0f };
+		normal[i] = 1.0f;
+		memcpy(vis.boundNormals[vis.numBounds], normal, sizeof(vec3_t));
+		vis.boundDists[vis.numBounds++] = world->mins[i] - 8.0f;
+		normal[i] = -1.0f;
+		memcpy(vis.boundNormals[vis.numBounds], normal, sizeof(vec3_t));
+		vis.boundDists[vis.numBounds++] = -world->maxs[i] - 8.0f;
+	}
+	RETRO_BuildVisPortals(&vis, world->headnode[0], 2.0 * range + 128.0);
+	if (vis.overflow) {
+		printf("[ERROR] RETRO_CompileVis() Portal winding or memory overflow\n");
+		RETRO_FreeVisCompiler(&vis);
+		return false;
+	}
+
+	// Index the portals leading out of each leaf; portal i leads out of the leaf that
+	// its other side, portal i ^ 1, leads into
+	vis.firstLeafPortal = (int *)calloc(vis.numLeaves + 2, sizeof(int));
+	vis.leafPortals = (int *)malloc((vis.numPortals + 1) * sizeof(int));
+	vis.rows = (unsigned char **)calloc(vis.numLeaves + 1, sizeof(unsigned char *));
+	vis.rowLengths = (int *)calloc(vis.numLeaves + 1, sizeof(int));
+	if (!vis.firstLeafPortal || !vis.leafPortals || !vis.rows || !vis.rowLengths) {
+		RETRO_FreeVisCompiler(&vis);
+		return false;
+	}
+	for (int i = 0; i < vis.numPortals; i++) {
+		vis.firstLeafPortal[vis.portals[i ^ 1].leaf + 1]++;
+	}
+	for (int leaf = 0; leaf <= vis.numLeaves; leaf++) {
+		vis.firstLeafPortal[leaf + 1] += vis.firstLeafPortal[leaf];
+	}
+	for (int i = 0; i < vis.numPortals; i++) {
+		vis.leafPortals[vis.firstLeafPortal[vis.portals[i ^ 1].leaf]++] = i;
+	}
+	for (int leaf = vis.numLeaves; leaf > 0; leaf--) {
+		vis.firstLeafPortal[leaf] = vis.firstLeafPortal[leaf - 1];
+	}
+	vis.firstLeafPortal[0] = 0;
+
+	RETRO_ParallelFor(pool, vis.numLeaves, RETRO_CompileVisLeaf, &vis);
+	if (SDL_GetAtomicInt(&vis.failed)) {
+		RETRO_FreeVisCompiler(&vis);
+		return false;
+	}
+
+	// Pack the rows into one lump, in leaf order
+	int used = 0;
+	for (int leaf = 1; leaf <= vis.numLeaves; leaf++) {
+		used += vis.rowLengths[leaf];
+	}
+	unsigned char *out = (unsigned char *)malloc(used + 1);
+	if (!out) {
+		RETRO_FreeVisCompiler(&vis);
+		return false;
+	}
+	used = 0;
+	for (int leaf = 0; leaf < bsp->leafCount; leaf++) {
+		if (leaf == 0 || leaf > vis.numLeaves) {
+			offsets[leaf] = -1;
+			continue;
+		}
+		offsets[leaf] = used;
+		memcpy(out + used, vis.rows[leaf], vis.rowLengths[leaf]);
+		used += vis.rowLengths[leaf];
+	}
+	RETRO_FreeVisCompiler(&vis);
+
+	*data = out;
+	*length = used;
+	return true;
+}
+
+//
+// Test whether any visible leaf of the world has vis data
+//
+inline bool RETRO_HasVis(RETRO_BSP *bsp)
+{
+	for (int leaf = 1; leaf <= bsp->getNumLeaves(); leaf++) {
+		if (bsp->getLeaf(leaf)->visofs >= 0) {
+			return true;
+		}
+	}
+	return false;
+}
+
+//
+// Make a compiled visibility lump the map's own, taking ownership of data, and point
+// the leaves at it. Leaves still in the mapped file are copied so they can be changed.
+//
+inline bool RETRO_SetBSPVis(RETRO_BSP *bsp, unsigned char *data, int length, const int *offsets)
+{
+	if (bsp->lumpCopies[LUMP_LEAFS] != bsp->leafs) {
+		dl2leaf_t *leafs = (dl2leaf_t *)RETRO_AllocBSPLump(bsp->leafCount, sizeof(dl2leaf_t));
+		if (!leafs) {
+			free(data);
+			return false;
+		}
+		memcpy(leafs, bsp->leafs, bsp->leafCount * sizeof(dl2leaf_t));
+		RETRO_ReplaceBSPLump(bsp, LUMP_LEAFS, leafs);
+		bsp->leafs = leafs;
+	}
+	RETRO_ReplaceBSPLump(bsp, LUMP_VISIBILITY, data);
+	bsp->visibility = data;
+	bsp->visibilityLength = length;
+	for (int leaf = 0; leaf < bsp->leafCount; leaf++) {
+		bsp->leafs[leaf].visofs = offsets[leaf];
+	}
+	return true;
+}
+
+#endif
@@ -7,11 +7,29 @@
 #define RETRO_HEIGHT 200
 #include "lib/retromain.h"
 #include "lib/retrobsp.h"
+#include "lib/retrocache.h"
+#include "lib/retropak.h"
+#include "lib/retropvs.h"
+#include "lib/retrovis.h"
 #include "lib/retromath.h"
 #include "lib/retrocamera.h"
+#include "lib/retrofrustum.h"
+#include "lib/retroocclusion.h"
+#include "lib/retroatlas.h"
+#include "lib/retrothread.h"
 #include <float.h>
+#if defined(__SSE2__) || defined(__AVX2__)
+#include <immintrin.h>
+#endif
 
 #define MOVEMENT_SPEED 5.0
+#define GAME_DIRECTORY "assets"	// Directory holding the paks, loose game files and world caches
+#define VIEW_HEIGHT 22.0f		// Eye height above the player start origin
+#define UPLOAD_BUDGET (2 * 1024 * 1024)	// Bytes of cooked textures and lightmaps uploaded per frame while loading
+#define COOK_TEXTURE_BATCH 16		// Textures cooked in parallel before the loader publishes them
+#define COOK_SURFACE_BATCH 512		// Lightmaps combined in parallel before the loader publishes them
+#define LIGHTMAP_PAGE_SIZE 1024		// Width and height of a lightmap atlas page, in luxels
+#define LIGHTMAP_BORDER 1			// Luxels around each lightmap in its page, copies of its edges
 
 // Liquid surfaces ripple their texture coordinates; sky surfaces use Quake's
 // two-layer sky projection.
@@ -21,6 +39,20 @@
 #define SKY_BACK_SCROLL_SPEED 8.0f	// sky back layer texels per second
 #define SKY_FRONT_SCROLL_SPEED 16.0f	// sky cloud layer texels per second
 
+// The world cache stores the load-time preprocessing results next to the map. Bump
+// the version whenever the cooked layout or the way it is computed changes.
+#define WORLD_CACHE_VERSION 5
+#define WORLD_CACHE_INFO RETRO_CACHE_ID('I', 'N', 'F', 'O')
+#define WORLD_CACHE_TEXTURES RETRO_CACHE_ID('T', 'E', 'X', 'R')
+#define WORLD_CACHE_TEXELS RETRO_CACHE_ID('T', 'E', 'X', 'L')
+#define WORLD_CACHE_SURFACES RETRO_CACHE_ID('S', 'U', 'R', 'F')
+#define WORLD_CACHE_LUXELS RETRO_CACHE_ID('L', 'U', 'X', 'L')
+#define WORLD_CACHE_POSITIONS RETRO_CACHE_ID('V', 'P', 'O', 'S')
+#define WORLD_CACHE_COORDS RETRO_CACHE_ID('V', 'U', 'V', 'S')
+#define VIS_CACHE_VERSION 1
+#define VIS_CACHE_DATA RETRO_CACHE_ID('V', 'I', 'S', 'D')
+#define VIS_CACHE_OFFSETS RETRO_CACHE_ID('V', 'I', 'S', 'O')
+
 // The "+0".."+N" animation sequence of a texture, owned by its "+0" frame
 struct TextureAnim
 {
@@ -43,28 +75,386 @@ struct Texture
 	int skyLayerHeight = 0;				// Sky layer height
 };
 
-// Everything derived from one BSP surface (face): its vertices' lightmap and lighting state
+// Everything derived from one BSP surface (face) that is only read when its dynamic
+// lightmap is rebuilt
 struct Surface
 {
-	unsigned int lightmapObjName = 0;	// OpenGL lightmap texture object name
 	int lightmapWidth = 0;				// Lightmap width
 	int lightmapHeight = 0;				// Lightmap height
-	bool lightmapDynamic = false;		// True if the lightmap has any animating styles
+	int lightmapX = 0;					// Top-left luxel of the lightmap and its border in its atlas page
+	int lightmapY = 0;
 	int lightmapFrame = -1;				// Frame number of last lightmap rebuild
 };
 
+// Values for SurfaceRecord.flags
+enum
+{
+	SURFACE_SKY = 1,		// Sky surface, drawn by the sky background instead
+	SURFACE_TURBULENT = 2,	// Liquid surface, with rippling texture coordinates
+	SURFACE_LUMA = 4,		// The texture, or a frame of its animation, has fullbright pixels
+	SURFACE_DYNAMIC = 8,	// The lightmap has animating styles and is rebuilt as they change
+	SURFACE_ANIMATED = 16,	// The texture is a "+0".."+N" animation, resolved every frame
+	SURFACE_BACKSIDE = 32	// The surface faces away from its plane's normal
+};
+
+// Everything the draw loop reads about one surface, resolved from the BSP at load so
+// a frame touches one small record per visible surface
+struct SurfaceRecord
+{
+	int texture;					// BSP texture index; the "+0" frame of an animated texture
+	int firstVertex;				// First vertex in the vertex pool
+	int numVertices;				// Number of vertices, in triangle fan order
+	int firstIndex;					// First index of its fan's triangles in the index buffer
+	int plane;						// Plane the surface lies on
+	int lightmap;					// Lightmap atlas page it samples
+	int flags;						// SURFACE_* flags
+};
+
+// Bounding spheres of the surfaces, with an array per component so the spheres of a
+// run of surfaces load a batch at a time. The arrays are padded by a batch.
+struct SurfaceSpheres
+{
+	float *x = NULL;		// Centre
+	float *y = NULL;
+	float *z = NULL;
+	float *radius = NULL;	// Distance from the centre to the farthest vertex
+};
+
+//
+// Cooked world data: the results of the load-time preprocessing, laid out so they
+// can be written to the world cache and later mapped and uploaded as-is. Mip chains
+// store every level back to back, largest first, down to 1x1. The layout of every
+// texture and lightmap is planned before any of them is converted, so each one has
+// a fixed home the uploader can read as soon as it is written.
+//
+
+// Values for CookedTexture.flags
+enum
+{
+	COOKED_SKY = 1,			// Sky texture, with two cooked sky layers
+	COOKED_TURBULENT = 2,	// Liquid texture
+	COOKED_LUMA = 4			// Has fullbright pixels, with a cooked luma chain
+};
+
+// Counts shared by the cooked arrays
+struct CookedInfo
+{
+	int numTextures;			// Number of CookedTexture records
+	int numSurfaces;			// Number of CookedSurface records
+	int numVertices;			// Number of vertices in the vertex pool
+	int numLightmapPages;		// Number of lightmap atlas pages
+	int skyTextureIndex;		// BSP texture used for the continuous sky background, or -1
+};
+
+// One cooked texture: where its RGBA mip chains live in the texel data
+struct CookedTexture
+{
+	int flags;					// COOKED_* classification
+	int width;					// Level 0 width
+	int height;					// Level 0 height
+	int numLevels;				// Number of mip levels in the base and luma chains
+	unsigned int pixelOffset;	// Byte offset of the base mip chain
+	unsigned int lumaOffset;	// Byte offset of the luma mip chain (COOKED_LUMA)
+	int skyLayerWidth;			// Sky layer width (COOKED_SKY)
+	int skyLayerHeight;			// Sky layer height (COOKED_SKY)
+	int skyNumLevels;			// Number of mip levels in each sky layer chain
+	unsigned int skyBackOffset;	// Byte offset of the sky back-layer mip chain
+	unsigned int skyFrontOffset;	// Byte offset of the sky cloud-layer mip chain
+	TextureAnim anim;			// "+0".."+N" animation sequence
+};
+
+// One cooked surface: its vertices, lightmap size and combined static lightmap
+struct CookedSurface
+{
+	int firstVertex;			// First vertex in the vertex pool
+	int numVertices;			// Number of vertices, in triangle fan order
+	int lightmapWidth;			// Lightmap width
+	int lightmapHeight;			// Lightmap height
+	int dynamic;				// Nonzero if the lightmap has any animating styles
+	int white;					// Nonzero if the surface samples the white block (sky, liquid, unlit)
+	int lightmapPage;			// Atlas page of the lightmap, or of the white block
+	int lightmapX;				// Top-left luxel of the lightmap and its border in the page
+	int lightmapY;
+	unsigned int luxelOffset;	// Byte offset of the lightmap and its border in the luxel data
+};
+
+// The cooked world, either built from the map or pointing into a mapped cache file
+struct CookedWorld
+{
+	CookedInfo info;
+	CookedTexture *textures = NULL;		// One record per BSP texture
+	CookedSurface *surfaces = NULL;		// One record per surface
+	vec3_t *positions = NULL;			// Vertex pool positions, each surface's vertices back to back
+	primuv_t *coords = NULL;			// Vertex pool texture and lightmap coordinates, parallel to positions
+	unsigned char *texels = NULL;		// RGBA mip chains
+	size_t texelLength = 0;
+	unsigned char *luxels = NULL;		// 8-bit lightmaps
+	size_t luxelLength = 0;
+	RETRO_Cache cache;					// The mapped world cache, when the data points into it
+	unsigned int paletteRGBA[256];		// Palette index to opaque texel, for converting textures
+	unsigned int paletteLuma[256];		// Palette index to fullbright texel, or transparent black
+	unsigned int paletteClouds[256];	// Palette index to sky cloud texel, with index 0 transparent
+};
+
+// Stages of the background world load, in order
+enum
+{
+	LOAD_MAP,		// Loading the map and planning the cooked world
+	LOAD_COOKING,	// Geometry and layout are ready; textures and lightmaps are being cooked
+	LOAD_COOKED,	// Every texture and lightmap is cooked, or mapped from the world cache
+	LOAD_FAILED		// The map could not be loaded
+};
+
+// The background world load. The loader thread owns the map and the cooked world
+// until it publishes LOAD_COOKING; from then on it only writes the texel and luxel
+// data of resources it has not counted as cooked yet.
+struct WorldLoader
+{
+	SDL_Thread *thread = NULL;			// The loader thread, until the load is finished
+	SDL_AtomicInt stage;				// LOAD_* stage the loader thread has reached
+	SDL_AtomicInt numCookedTextures;	// Textures whose mip chains are written, in index order
+	SDL_AtomicInt numCookedSurfaces;	// Surfaces whose lightmaps are written, in index order
+	SDL_AtomicInt cancel;				// Set to stop the loader thread early
+	int numUploadedTextures = 0;		// Textures uploaded by the main thread
+	int numUploadedSurfaces = 0;		// Lightmaps uploaded by the main thread
+	const char *error = "";				// Why the load failed (LOAD_FAILED)
+};
+
+#define OCCLUSION_WIDTH 128		// Size of the occlusion buffer in pixels
+#define OCCLUSION_HEIGHT 80
+#define MAX_OCCLUDERS 64			// Surfaces drawn into the occlusion buffer per frame
+#define VISIBLE_SET_CACHE_SIZE 32	// Leaves whose visible sets are kept; the least recently used is rebuilt first
+#define PARALLEL_WALK_LEAVES 1024	// Visible sets with at least this many leaves are walked across the thread pool
+#define WALK_TASKS_PER_THREAD 8		// Subtrees a parallel walk aims to hand each thread
+#define WALK_TASK_MIN_LEAVES 32		// Smallest subtree, in leaves, a parallel walk splits further
+
+// What can be seen from one leaf, whatever the view direction: the leaves of its PVS,
+// and every node with one of them below it
+struct VisibleSet
+{
+	int leaf = -1;					// Leaf the set was built for, or -1 for a free slot
+	int lastUsed = 0;				// Visible set clock when the set was last used
+	RETRO_PVSWord *leaves = NULL;	// The leaf's PVS: a PVS matrix row, or decodedLeaves
+	RETRO_PVSWord *decodedLeaves = NULL;	// The PVS decoded on demand, without the matrix
+	RETRO_PVSWord *nodes = NULL;	// Nodes on the way from the root to a PVS leaf, as a bitset
+	int numLeaves = 0;				// Number of leaves in the PVS
+};
+
+// The per-frame walk of the node tree: the view it culls against, and the surfaces it
+// finds, front to back
+struct WorldView
+{
+	vec3_t origin;					// Eye position
+	RETRO_Frustum frustum;			// Side planes of the view
+	RETRO_OcclusionBuffer *occlusion;	// Occluders in view, or NULL when there are none
+	VisibleSet *set;				// What the leaf holding the eye can see
+	int visFrame;					// Stamp of the leaves' marked surfaces this frame
+	int *surfaces;					// Surfaces to draw, nearest first
+	int numSurfaces;
+	int numMarkedSurfaces;			// Marksurfaces of the leaves in view, duplicates included
+	int numDuplicates;				// Marksurfaces already marked by another leaf in view
+	int numBackfacing;				// Surfaces of the nodes in view rejected for facing away from the eye
+	int numOutside;					// Marked surfaces rejected for being outside the frustum
+	int numLeaves;					// PVS leaves in view
+	int numCulledNodes;				// Nodes and leaves rejected by the frustum
+	int numOccludedNodes;			// Nodes and leaves hidden behind the occluders
+};
+
+// A run of a draw list's surfaces that share a base texture
+struct DrawRange
+{
+	int texture;	// Base texture index; the "+0" frame of an animated texture
+	int first;		// First surface of the run in the draw list
+	int count;		// Number of surfaces in the run
+};
+
+// The surfaces of a frame grouped by base texture. Runs are in the order of their
+// nearest surface, and surfaces keep their front-to-back order within a run.
+struct DrawList
+{
+	int *surfaces = NULL;			// Surfaces to draw, in base texture runs
+	int numSurfaces = 0;
+	DrawRange *ranges = NULL;		// One run per base texture
+	int numRanges = 0;
+};
+
+// The surfaces of a draw list drawn with one texture bind: every base texture run
+// whose texture currently resolves to the same animation frame. Within a chain, the
+// surfaces are grouped by lightmap, in the order each lightmap is first used.
+struct TextureChain
+{
+	int texture;		// Texture bound for the chain: the resolved animation frame
+	int first;			// First surface of the chain in the chained surfaces
+	int count;			// Number of surfaces in the chain
+	int firstRange;		// First draw list run in the chain; the others follow through nextRange
+	int lastRange;		// Last draw list run in the chain
+};
+
+// The texture chains of the frame being drawn, rebuilt by the main thread every frame
+// once the animation frames are known
+struct TextureChains
+{
+	TextureChain *chains = NULL;	// One per resolved texture, in the order of the draw list's runs
+	int numChains = 0;
+	int *surfaces = NULL;			// Surfaces of every chain, back to back
+	int *nextRange = NULL;			// Per draw list run, the next run in its chain, or -1
+	int *textureChains = NULL;		// Per texture, its chain in the frame being chained, or -1
+	int *lightmapGroups = NULL;		// Per lightmap, its group in the chain being grouped, or -1
+	int *groupLightmaps = NULL;		// Lightmap of each group in the chain being grouped
+	int *groupStarts = NULL;		// Surfaces of each group, then where its next surface goes
+};
+
+// A piece of a frame's walk of the node tree spread across the thread pool. The pieces
+// are in front-to-back order: subtrees walked by tasks, and between them the nodes
+// above the subtrees, whose surfaces are emitted once the subtrees have marked theirs.
+// Each piece bins its surfaces by base texture in its own part of the walk's arrays.
+struct WalkItem
+{
+	int child;					// Subtree root (a node, or ~leaf), or the node whose surfaces are emitted
+	int side;					// Side of the node's plane the eye is on, or -1 for a subtree
+	int clipFlags;				// Frustum planes the piece still has to test
+	int first;					// Start of the piece's surfaces and runs in the walk's arrays
+	int numSurfaces;			// Surfaces the piece found
+	int numRanges;				// Base texture runs of its surfaces
+	int numMarkedSurfaces;		// The piece's share of the WorldView counters
+	int numDuplicates;
+	int numBackfacing;
+	int numOutside;
+	int numLeaves;
+	int numCulledNodes;
+	int numOccludedNodes;
+};
+
+// Per-thread binning scratch of a parallel walk
+struct WalkScratch
+{
+	SDL_AtomicInt busy;			// Set while a task bins with it
+	int *textureRanges = NULL;	// Per texture, its run in the piece being binned, or -1
+};
+
+// A frame's walk of the node tree, split into pieces for the thread pool
+struct ParallelWalk
+{
+	WorldView *view = NULL;			// The view walked, shared by every piece
+	WalkItem *items = NULL;			// Pieces of the walk, front to back
+	int numItems = 0;
+	int *tasks = NULL;				// The pieces that are subtrees
+	int numTasks = 0;
+	int *surfaces = NULL;			// Surfaces of every piece, binned by base texture
+	DrawRange *ranges = NULL;		// Runs of every piece; a piece's runs start where its surfaces do
+	WalkScratch *scratch = NULL;	// One per thread that can run a task
+	int numScratch = 0;
+	int taskLeaves = 0;				// Subtrees with at most this many leaves are not split further
+	int *nodeLeafCounts = NULL;		// Per node, the leaves below it
+	int *nodeFaceCounts = NULL;		// Per node, the surfaces of it and the nodes below it
+};
+
+// Counters of the rendering work, summed over the frames since the last report
+struct RenderStats
+{
+	int frames = 0;					// Frames rendered
+	int pvsLeaves = 0;				// Leaves in the PVS of the camera leaf
+	int viewLeaves = 0;				// PVS leaves inside the view frustum
+	int culledNodes = 0;			// Nodes and leaves rejected by the frustum
+	int occluders = 0;				// Surfaces drawn into the occlusion buffer
+	int occludedNodes = 0;			// Nodes and leaves hidden behind the occluders
+	int markedSurfaces = 0;			// Marksurfaces of the leaves in view, duplicates included
+	int duplicateSurfaces = 0;		// Marksurfaces already marked by another leaf in view
+	int backfacingSurfaces = 0;		// Surfaces of the nodes in view facing away from the eye
+	int outsideSurfaces = 0;		// Marked surfaces outside the view frustum
+	int visibleSurfaces = 0;		// Surfaces submitted
+	int drawCalls = 0;				// Draw calls that submitted them
+	int textureBinds = 0;			// Base and luma texture binds of the texture chains
+	int lightmapBinds = 0;			// Lightmap binds of the texture chains
+	int unchainedBinds = 0;			// Binds of a texture and a lightmap for every surface
+	int lightmapUploadBytes = 0;	// Bytes of rebuilt dynamic lightmaps uploaded
+	int stateCalls = 0;				// GL state calls passed on to the driver
+	int redundantStateCalls = 0;	// GL state calls the state cache skipped
+	int pvsDecodes = 0;				// PVS decodes for visible sets built without the PVS matrix
+	int visibleSetHits = 0;			// Frames whose visible set was in the cache
+	int visibleSetMisses = 0;		// Frames whose visible set had to be built
+	unsigned long int lastReport = 0;	// Time of the last report, in milliseconds
+};
+
+// The visibility of one frame: the camera it is drawn from and the surfaces it draws
+struct VisFrame
+{
+	RETRO_Camera camera;			// Camera the frame is drawn from
+	float aspect = 1.0f;			// Width/height aspect ratio of the view
+	DrawList drawList;				// The frame's surfaces, grouped by base texture
+	RenderStats stats;				// Counters of the frame's visibility work
+};
+
+// A thread that finds the visible surfaces of each frame while the main thread draws
+// the frame before it (--pipelinevis). Frame n is built in the frame slot n & 1; the
+// counters hand the slots back and forth, and the semaphores only put the threads to
+// sleep while there is nothing to do.
+struct VisPipeline
+{
+	SDL_Thread *thread = NULL;
+	SDL_Semaphore *start = NULL;	// Signalled when a frame is submitted, or to stop the thread
+	SDL_Semaphore *done = NULL;		// Signalled when a frame is published
+	SDL_AtomicInt submitted;		// Last frame whose camera was handed to the thread
+	SDL_AtomicInt published;		// Last frame whose draw list is complete
+	SDL_AtomicInt quit;				// Set to stop the thread
+	int numFrames = 0;				// Frames submitted by the main thread
+};
+
+// One lightmap atlas page. Pages holding dynamic lightmaps keep a copy of their
+// luxels, where the lightmaps are rebuilt, and the rectangle that has changed since
+// the page was last uploaded.
+struct LightmapPage
+{
+	unsigned int objName = 0;		// OpenGL texture object name
+	unsigned char *luxels = NULL;	// Copy of the page's luxels, if it has dynamic lightmaps
+	int dirtyX0 = 0;				// Rectangle rebuilt since the last upload, empty when dirtyX0 >= dirtyX1
+	int dirtyY0 = 0;
+	int dirtyX1 = 0;
+	int dirtyY1 = 0;
+};
+
 struct World
 {
 	RETRO_BSP map;							// The loaded map (BSP, palette and colormap), owned by value
-
-	primdesc_t *surfacePrimitives = NULL;	// Array of surface primitives, contains vertex, texture and lightmap information for every surface
+	CookedWorld cooked;						// Load-time preprocessing results, built or mapped from the cache
+	WorldLoader loader;						// Background load of the map and cooked world
+
+	vec3_t *vertexPositions = NULL;			// Vertex pool positions; a surface's vertices start at its firstVertex
+	primuv_t *vertexCoords = NULL;			// Vertex pool texture and lightmap coordinates, parallel to the positions
+	unsigned int vertexBuffer = 0;			// OpenGL buffer of the vertex pool, or 0 to draw in immediate mode
+	unsigned int indexBuffer = 0;			// OpenGL buffer of every surface's fan as triangles
+	GLsizei *batchCounts = NULL;			// Index count of each surface in the batch being drawn
+	const void **batchOffsets = NULL;		// Index buffer offset of each surface in the batch being drawn
 	Texture *textures = NULL;				// Array of per-BSP-texture OpenGL state, one per BSP texture
-	Surface *surfaces = NULL;				// Array of per-surface OpenGL state, one per surface
+	SurfaceRecord *surfaceRecords = NULL;	// Array of per-surface render records, one per surface
+	SurfaceSpheres surfaceSpheres;			// Bounding spheres of the surfaces, for culling
+	Surface *surfaces = NULL;				// Array of per-surface lightmap state, one per surface
 	int *visibleSurfaces = NULL;			// Array of visible surfaces, contains an index to the surfaces
+	RETRO_PVSMatrix pvs;					// Every leaf's PVS, when it fits the --pvsbudget
+	int numVisibleLeafWords = 0;			// Number of words in a PVS bitset
+	int numVisibleNodeWords = 0;			// Number of words in a node bitset
+	int *leafParents = NULL;				// Per leaf, the node above it, or -1
+	int *nodeParents = NULL;				// Per node, the node above it, or -1 for a model's root
+	int *surfaceVisFrame = NULL;			// Per surface, the last visFrame a leaf in view marked it in
+	int visFrame = 0;						// Stamp of the frame being walked
+	int *textureRanges = NULL;				// Per texture, its run in the draw list being built, or -1
+	VisFrame frames[2];						// The frame being drawn and, when pipelined, the one being found
+	VisPipeline pipeline;					// Vis thread of --pipelinevis
+	TextureChains chains;					// The frame being drawn, chained by resolved texture
+	ParallelWalk walk;						// Walk of the node tree across the thread pool, for big visible sets
+	RETRO_OcclusionBuffer occlusion;		// The occluders of a frame: the largest nearby surfaces of the last one
+	VisibleSet visibleSets[VISIBLE_SET_CACHE_SIZE];	// Cached visible sets of recently visited leaves
+	int *leafVisibleSets = NULL;			// Per leaf, its slot in visibleSets, or -1
+	int visibleSetClock = 0;				// Incremented whenever a visible set is used
+	RenderStats stats;						// Rendering counters for --showstats
+	unsigned int placeholderTexture = 0;	// OpenGL texture drawn until a surface's texture is uploaded
+	LightmapPage *lightmaps = NULL;			// Lightmap atlas pages
+	int numLightmaps = 0;					// Number of lightmap atlas pages
+	unsigned int lightmapUploadBuffer = 0;	// OpenGL pixel buffer the dirty lightmap rectangles are staged in, or 0
+	bool lumaUnit = false;					// True if luma textures are combined on texture unit 2 in the same pass
 	int lightStyleFrame = -1;				// Current frame index of the 10Hz light animations
 	int lightStyles[64];					// Current values of the 64 light styles
 	double lightStyleTime = 0.0;			// Time accumulator for light styles
-	int numMaxEdgesPerSurface = 0;			// Max edges per surface
 	int numTextures = 0;					// Number of OpenGL texture objects
 	int skyTextureIndex = -1;				// BSP texture used for the continuous sky background
 	double textureTime = 0.0;				// Accumulated time driving texture animation
@@ -72,10 +462,178 @@ struct World
 
 World world;
 RETRO_Camera camera;
+RETRO_Paks paks;
+RETRO_ThreadPool pool;
+
+//
+// Build the palette lookup tables the texture conversion reads
+//
+static void BuildPaletteTables(World *world)
+{
+	CookedWorld *cooked = &world->cooked;
+	for (int i = 0; i < 256; i++) {
+		unsigned int rgb = world->map.palette[i] & 0x00ffffff;
+		cooked->paletteRGBA[i] = rgb | 0xFF000000;
+		cooked->paletteLuma[i] = (i >= 224) ? rgb | 0xFF000000 : 0x00000000;
+		cooked->paletteClouds[i] = (i != 0) ? rgb | 0xFF000000 : rgb;
+	}
+}
+
+//
+// Convert a row of 8-bit palette indices to 32-bit texels through a 256-entry table.
+// With AVX2, eight texels are looked up at a time with a gather.
+//
+static void ConvertPaletteRow(const unsigned char *src, unsigned int *dst, int count, const unsigned int *table)
+{
+	int i = 0;
+#ifdef __AVX2__
+	for (; i + 8 <= count; i += 8) {
+		__m256i indices = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *)(src + i)));
+		_mm256_storeu_si256((__m256i *)(dst + i), _mm256_i32gather_epi32((const int *)table, indices, 4));
+	}
+#endif
+	for (; i < count; i++) {
+		dst[i] = table[src[i]];
+	}
+}
+
+//
+// True if any of the palette indices is a fullbright color (224-255). With SSE2,
+// sixteen indices are tested at a time.
+//
+static bool HasFullbrights(const unsigned char *src, int count)
+{
+	int i = 0;
+#ifdef __SSE2__
+	const __m128i threshold = _mm_set1_epi8((char)224);
+	for (; i + 16 <= count; i += 16) {
+		__m128i indices = _mm_loadu_si128((const __m128i *)(src + i));
+		if (_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_max_epu8(indices, threshold), indices))) {
+			return true;
+		}
+	}
+#endif
+	for (; i < count; i++) {
+		if (src[i] >= 224) {
+			return true;
+		}
+	}
+	return false;
+}
+
+//
+// Reserve length bytes at the end of a cooked data layout and return their offset
+//
+static size_t CookReserve(size_t *total, size_t length)
+{
+	size_t offset = *total;
+	*total += length;
+	return offset;
+}
+
+//
+// Number of levels in a mip chain that halves down to 1x1
+//
+static int MipLevelCount(int width, int height)
+{
+	int levels = 1;
+	while (width > 1 || height > 1) {
+		width = width > 1 ? width / 2 : 1;
+		height = height > 1 ? height / 2 : 1;
+		levels++;
+	}
+	return levels;
+}
+
+//
+// Size in bytes of a whole RGBA mip chain
+//
+static size_t MipChainSize(int width, int height)
+{
+	size_t size = 0;
+	for (int level = MipLevelCount(width, height); level > 0; level--) {
+		size += (size_t)width * height * 4;
+		width = width > 1 ? width / 2 : 1;
+		height = height > 1 ? height / 2 : 1;
+	}
+	return size;
+}
+
+//
+// Fill the levels after level 0 of an RGBA mip chain, each one a 2x2 box filter of
+// the level above it
+//
+static void BuildMipChain(unsigned int *chain, int width, int height)
+{
+	unsigned char *src = (unsigned char *)chain;
+	for (int level = MipLevelCount(width, height); level > 1; level--) {
+		int mipWidth = width > 1 ? width / 2 : 1;
+		int mipHeight = height > 1 ? height / 2 : 1;
+		unsigned char *dst = src + width * height * 4;
+
+		for (int y = 0; y < mipHeight; y++) {
+			int y0 = y * 2;
+			int y1 = (y0 + 1 < height) ? y0 + 1 : y0;
+			for (int x = 0; x < mipWidth; x++) {
+				int x0 = x * 2;
+				int x1 = (x0 + 1 < width) ? x0 + 1 : x0;
+				for (int c = 0; c < 4; c++) {
+					int sum = src[(x0 + y0 * width) * 4 + c] + src[(x1 + y0 * width) * 4 + c] +
+						src[(x0 + y1 * width) * 4 + c] + src[(x1 + y1 * width) * 4 + c];
+					dst[(x + y * mipWidth) * 4 + c] = (unsigned char)((sum + 2) / 4);
+				}
+			}
+		}
+
+		src = dst;
+		width = mipWidth;
+		height = mipHeight;
+	}
+}
+
+//
+// Fill an RGBA mip chain from the mip levels stored with a BSP texture, converting
+// every stored level through a palette table and box filtering only the levels below
+// the smallest stored one (1/8 size). The chain covers the columns x0..x0+width-1 of
+// the texture, as sky layers are halves of it. When that region does not halve
+// evenly down to 1/8 size, every level is filtered from level 0 instead.
+//
+static void ConvertMipChain(miptex_t *mipTexture, int x0, int width, int height, const unsigned int *table, unsigned int *chain)
+{
+	int numStored = (x0 % 8 == 0 && width % 8 == 0 && height % 8 == 0) ? MIPLEVELS : 1;
+	for (int level = 1; level < numStored; level++) {
+		if (mipTexture->offsets[level] == 0) {
+			numStored = 1;
+		}
+	}
+
+	unsigned int *levelTexels = chain;
+	for (int level = 0; level < numStored; level++) {
+		if (level > 0) {
+			levelTexels += (size_t)(width >> (level - 1)) * (height >> (level - 1));
+		}
+		int stride = mipTexture->width >> level;
+		const unsigned char *src = (unsigned char *)mipTexture + mipTexture->offsets[level] + (x0 >> level);
+		for (int y = 0; y < (height >> level); y++) {
+			ConvertPaletteRow(src + y * stride, levelTexels + y * (width >> level), width >> level, table);
+		}
+	}
+
+	// The chain from the last stored level down is itself a whole chain
+	BuildMipChain(levelTexels, width >> (numStored - 1), height >> (numStored - 1));
+}
 
-static unsigned int PaletteRGBA(World *world, unsigned char color, unsigned char alpha = 255)
+//
+// Upload an RGBA mip chain to the bound texture object, one level at a time
+//
+static void UploadMipChain(const unsigned char *chain, int width, int height, int numLevels)
 {
-	return (world->map.palette[color] & 0x00ffffff) | ((unsigned int)alpha << 24);
+	for (int level = 0; level < numLevels; level++) {
+		glTexImage2D(GL_TEXTURE_2D, level, GL_RGBA, width, height, 0, GL_RGBA, GL_UNSIGNED_BYTE, chain);
+		chain += (size_t)width * height * 4;
+		width = width > 1 ? width / 2 : 1;
+		height = height > 1 ? height / 2 : 1;
+	}
 }
 
 //
@@ -103,135 +661,179 @@ bool IsTurbulentTextureName(const char *name)
 	return name && name[0] == '*';
 }
 
-void UploadSkyLayer(unsigned int textureObj, int width, int height, unsigned int *texture)
-{
-	glBindTexture(GL_TEXTURE_2D, textureObj);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
-	gluBuild2DMipmaps(GL_TEXTURE_2D, 4, width, height, GL_RGBA, GL_UNSIGNED_BYTE, texture);
-}
-
 //
-// Quake sky textures are usually 256x128: the left half is an alpha-tested cloud
-// layer and the right half is the solid back layer.
+// Lay out the cooked textures: classify every BSP texture and reserve room in the
+// texel data for its mip chains. Quake sky textures are usually 256x128: the left
+// half is an alpha-tested cloud layer and the right half is the solid back layer.
 //
-void UploadSkyTextures(World *world, int textureIndex, miptex_t *mipTexture)
+bool PlanTextures(World *world)
 {
-	Texture *texture = &world->textures[textureIndex];
+	CookedWorld *cooked = &world->cooked;
+	cooked->info.numTextures = world->map.getNumTextures();
+	cooked->info.skyTextureIndex = -1;
+	cooked->textures = new CookedTexture [cooked->info.numTextures]();
+	cooked->texelLength = 0;
 
-	int width = mipTexture->width;
-	int height = mipTexture->height;
-	int layerWidth = (width >= 2) ? width / 2 : width;
-	bool hasCloudLayer = (layerWidth * 2 <= width);
-	int backOffset = hasCloudLayer ? layerWidth : 0;
+	for (int i = 0; i < cooked->info.numTextures; i++) {
+		CookedTexture *texture = &cooked->textures[i];
+
+		// Point to the stored mipmaps
+		miptex_t *mipTexture = world->map.getMipTexture(i);
 
-	texture->skyLayerWidth = layerWidth;
-	texture->skyLayerHeight = height;
+		// NULL textures exist, give them a fallback texel.
+		if (!mipTexture || !mipTexture->name[0] || mipTexture->offsets[0] == 0) {
+			texture->width = 1;
+			texture->height = 1;
+			texture->numLevels = 1;
+			texture->pixelOffset = CookReserve(&cooked->texelLength, 4);
+			continue;
+		}
 
-	unsigned int *backLayer = new unsigned int [layerWidth * height];
-	unsigned int *frontLayer = new unsigned int [layerWidth * height];
-	unsigned char *rawTexture = (unsigned char *)mipTexture + mipTexture->offsets[0];
+		int width = mipTexture->width;
+		int height = mipTexture->height;
+		size_t chainSize = MipChainSize(width, height);
+		texture->width = width;
+		texture->height = height;
+		texture->numLevels = MipLevelCount(width, height);
+		texture->pixelOffset = CookReserve(&cooked->texelLength, chainSize);
+		if (IsSkyTextureName(mipTexture->name)) {
+			texture->flags |= COOKED_SKY;
+		}
+		if (IsTurbulentTextureName(mipTexture->name)) {
+			texture->flags |= COOKED_TURBULENT;
+		}
 
-	for (int y = 0; y < height; y++) {
-		for (int x = 0; x < layerWidth; x++) {
-			unsigned char backColor = rawTexture[(x + backOffset) + y * width];
-			backLayer[x + y * layerWidth] = PaletteRGBA(world, backColor);
+		// Fullbright colors (palette entries 224-255) get a luma chain
+		unsigned char *rawTexture = (unsigned char *)mipTexture + mipTexture->offsets[0];
+		if (HasFullbrights(rawTexture, width * height)) {
+			texture->flags |= COOKED_LUMA;
+			texture->lumaOffset = CookReserve(&cooked->texelLength, chainSize);
+		}
 
-			unsigned char frontColor = hasCloudLayer ? rawTexture[x + y * width] : 0;
-			unsigned char alpha = (hasCloudLayer && frontColor != 0) ? 255 : 0;
-			frontLayer[x + y * layerWidth] = PaletteRGBA(world, frontColor, alpha);
+		if (texture->flags & COOKED_SKY) {
+			int layerWidth = (width >= 2) ? width / 2 : width;
+			size_t layerChainSize = MipChainSize(layerWidth, height);
+			texture->skyLayerWidth = layerWidth;
+			texture->skyLayerHeight = height;
+			texture->skyNumLevels = MipLevelCount(layerWidth, height);
+			texture->skyBackOffset = CookReserve(&cooked->texelLength, layerChainSize);
+			texture->skyFrontOffset = CookReserve(&cooked->texelLength, layerChainSize);
+			if (cooked->info.skyTextureIndex < 0) {
+				cooked->info.skyTextureIndex = i;
+			}
 		}
 	}
 
-	UploadSkyLayer(texture->skyBackObjName, layerWidth, height, backLayer);
-	UploadSkyLayer(texture->skyFrontObjName, layerWidth, height, frontLayer);
+	return true;
+}
+
+//
+// Split a sky texture into its back and cloud layer mip chains
+//
+void ConvertSkyTexture(World *world, int textureIndex, miptex_t *mipTexture)
+{
+	CookedWorld *cooked = &world->cooked;
+	CookedTexture *texture = &cooked->textures[textureIndex];
+
+	int layerWidth = texture->skyLayerWidth;
+	int height = texture->skyLayerHeight;
+	unsigned int *backLayer = (unsigned int *)(cooked->texels + texture->skyBackOffset);
+	unsigned int *frontLayer = (unsigned int *)(cooked->texels + texture->skyFrontOffset);
+
+	// A texture too narrow to split is all back layer, under a transparent cloud layer
+	if (layerWidth * 2 > (int)mipTexture->width) {
+		ConvertMipChain(mipTexture, 0, layerWidth, height, cooked->paletteRGBA, backLayer);
+		size_t numTexels = MipChainSize(layerWidth, height) / 4;
+		for (size_t i = 0; i < numTexels; i++) {
+			frontLayer[i] = cooked->paletteClouds[0];
+		}
+		return;
+	}
 
-	delete[] backLayer;
-	delete[] frontLayer;
+	ConvertMipChain(mipTexture, layerWidth, layerWidth, height, cooked->paletteRGBA, backLayer);
+	ConvertMipChain(mipTexture, 0, layerWidth, height, cooked->paletteClouds, frontLayer);
 }
 
 //
-// Create one OpenGL texture object per BSP texture and upload mipmapped RGBA data
+// Convert one BSP texture into its planned RGBA mip chains: the base texture, its
+// luma overlay when it has fullbright pixels, and the two layers of sky textures
 //
-bool UploadTextures(World *world)
+void ConvertTexture(World *world, int textureIndex)
 {
-	world->numTextures = world->map.getNumTextures();
-	world->textures = new Texture [world->numTextures];
+	CookedWorld *cooked = &world->cooked;
+	CookedTexture *texture = &cooked->textures[textureIndex];
+	unsigned int *pixels = (unsigned int *)(cooked->texels + texture->pixelOffset);
 
-	for (int i = 0; i < world->numTextures; i++) {
-		Texture *texture = &world->textures[i];
+	// Point to the stored mipmaps
+	miptex_t *mipTexture = world->map.getMipTexture(textureIndex);
 
-		unsigned int names[4];
-		glGenTextures(4, names);
-		texture->objName = names[0];
-		texture->lumaObjName = names[1];
-		texture->skyBackObjName = names[2];
-		texture->skyFrontObjName = names[3];
+	// NULL textures exist, give them a fallback texel.
+	if (!mipTexture || !mipTexture->name[0] || mipTexture->offsets[0] == 0) {
+		*pixels = 0xFF000000;
+		return;
+	}
 
-		glBindTexture(GL_TEXTURE_2D, texture->objName);
+	ConvertMipChain(mipTexture, 0, texture->width, texture->height, cooked->paletteRGBA, pixels);
+	if (texture->flags & COOKED_LUMA) {
+		unsigned int *lumaPixels = (unsigned int *)(cooked->texels + texture->lumaOffset);
+		ConvertMipChain(mipTexture, 0, texture->width, texture->height, cooked->paletteLuma, lumaPixels);
+	}
 
-		// Point to the stored mipmaps
-		miptex_t *mipTexture = world->map.getMipTexture(i);
+	if (texture->flags & COOKED_SKY) {
+		ConvertSkyTexture(world, textureIndex, mipTexture);
+	}
+}
 
-		// NULL textures exist, fill their object with a fallback texel.
-		if (!mipTexture || !mipTexture->name[0] || mipTexture->offsets[0] == 0) {
-			unsigned int filler = 0xFF000000;
-			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
-			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
-			gluBuild2DMipmaps(GL_TEXTURE_2D, 4, 1, 1, GL_RGBA, GL_UNSIGNED_BYTE, &filler);
-			continue;
-		}
+//
+// Create the OpenGL texture objects of one cooked texture and upload its mip chains.
+// Returns the number of bytes uploaded.
+//
+size_t UploadTexture(World *world, int textureIndex)
+{
+	CookedWorld *cooked = &world->cooked;
+	CookedTexture *cookedTexture = &cooked->textures[textureIndex];
+	Texture *texture = &world->textures[textureIndex];
+	size_t chainSize = MipChainSize(cookedTexture->width, cookedTexture->height);
+	size_t uploaded = chainSize;
 
-		int width = mipTexture->width;
-		int height = mipTexture->height;
-		unsigned int *pixels = new unsigned int [width * height];
-		unsigned int *lumaPixels = new unsigned int [width * height];
-		texture->sky = IsSkyTextureName(mipTexture->name);
-		texture->turbulent = IsTurbulentTextureName(mipTexture->name);
+	unsigned int names[4];
+	glGenTextures(4, names);
+	texture->objName = names[0];
+	texture->lumaObjName = names[1];
+	texture->skyBackObjName = names[2];
+	texture->skyFrontObjName = names[3];
 
-		bool hasLuma = false;
-		// Point to the raw 8-bit texture data (the full-resolution mip level)
-		unsigned char *rawTexture = (unsigned char *)mipTexture + mipTexture->offsets[0];
-		for (int x = 0; x < width; x++) {
-			for (int y = 0; y < height; y++) {
-				unsigned char colorIndex = rawTexture[x + y * width];
-				pixels[x + y * width] = PaletteRGBA(world, colorIndex);
-				if (colorIndex >= 224) {
-					hasLuma = true;
-					lumaPixels[x + y * width] = PaletteRGBA(world, colorIndex, 255);
-				} else {
-					lumaPixels[x + y * width] = 0x00000000;
-				}
-			}
-		}
-		texture->hasLuma = hasLuma;
+	RETROGL_BindTexture(texture->objName);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+	UploadMipChain(cooked->texels + cookedTexture->pixelOffset, cookedTexture->width, cookedTexture->height, cookedTexture->numLevels);
 
-		// Create mipmaps from the created texture
+	if (cookedTexture->flags & COOKED_LUMA) {
+		RETROGL_BindTexture(texture->lumaObjName);
 		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
 		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
-		gluBuild2DMipmaps(GL_TEXTURE_2D, 4, width, height, GL_RGBA, GL_UNSIGNED_BYTE, pixels);
-
-		delete[] pixels;
+		UploadMipChain(cooked->texels + cookedTexture->lumaOffset, cookedTexture->width, cookedTexture->height, cookedTexture->numLevels);
+		texture->hasLuma = true;
+		uploaded += chainSize;
+	}
 
-		if (hasLuma) {
-			glBindTexture(GL_TEXTURE_2D, texture->lumaObjName);
+	if (texture->sky) {
+		texture->skyLayerWidth = cookedTexture->skyLayerWidth;
+		texture->skyLayerHeight = cookedTexture->skyLayerHeight;
+		unsigned int layers[2] = { texture->skyBackObjName, texture->skyFrontObjName };
+		unsigned int offsets[2] = { cookedTexture->skyBackOffset, cookedTexture->skyFrontOffset };
+		for (int layer = 0; layer < 2; layer++) {
+			RETROGL_BindTexture(layers[layer]);
 			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
-			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
-			gluBuild2DMipmaps(GL_TEXTURE_2D, 4, width, height, GL_RGBA, GL_UNSIGNED_BYTE, lumaPixels);
-		}
-		delete[] lumaPixels;
-
-		if (texture->sky) {
-			UploadSkyTextures(world, i, mipTexture);
-			if (world->skyTextureIndex < 0) {
-				world->skyTextureIndex = i;
-			}
+			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
+			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
+			UploadMipChain(cooked->texels + offsets[layer], cookedTexture->skyLayerWidth, cookedTexture->skyLayerHeight, cookedTexture->skyNumLevels);
+			uploaded += MipChainSize(cookedTexture->skyLayerWidth, cookedTexture->skyLayerHeight);
 		}
 	}
 
-	return true;
+	return uploaded;
 }
 
 //
@@ -293,7 +895,47 @@ void UpdateLightStyles(World *world, double deltaTime)
 }
 
 //
-// Rebuild a dynamic lightmap for the specified surface with the current light style values
+// Copy the edge luxels of a lightmap into the border around it, so that filtering at
+// its edges never blends in its neighbours in the atlas page. The luxels are the
+// bordered block, with rows stride bytes apart.
+//
+void FillLightmapBorder(unsigned char *luxels, int width, int height, int stride)
+{
+	int borderedWidth = width + 2 * LIGHTMAP_BORDER;
+	for (int y = LIGHTMAP_BORDER; y < height + LIGHTMAP_BORDER; y++) {
+		unsigned char *row = &luxels[y * stride];
+		for (int x = 0; x < LIGHTMAP_BORDER; x++) {
+			row[x] = row[LIGHTMAP_BORDER];
+			row[borderedWidth - 1 - x] = row[borderedWidth - 1 - LIGHTMAP_BORDER];
+		}
+	}
+	for (int y = 0; y < LIGHTMAP_BORDER; y++) {
+		memcpy(&luxels[y * stride], &luxels[LIGHTMAP_BORDER * stride], borderedWidth);
+		memcpy(&luxels[(height + 2 * LIGHTMAP_BORDER - 1 - y) * stride], &luxels[(height + LIGHTMAP_BORDER - 1) * stride], borderedWidth);
+	}
+}
+
+//
+// Grow the rectangle of a lightmap page that has to be uploaded
+//
+void MarkLightmapDirty(LightmapPage *page, int x, int y, int width, int height)
+{
+	if (page->dirtyX0 >= page->dirtyX1) {
+		page->dirtyX0 = x;
+		page->dirtyY0 = y;
+		page->dirtyX1 = x + width;
+		page->dirtyY1 = y + height;
+		return;
+	}
+	page->dirtyX0 = SDL_min(page->dirtyX0, x);
+	page->dirtyY0 = SDL_min(page->dirtyY0, y);
+	page->dirtyX1 = SDL_max(page->dirtyX1, x + width);
+	page->dirtyY1 = SDL_max(page->dirtyY1, y + height);
+}
+
+//
+// Rebuild a dynamic lightmap for the specified surface with the current light style
+// values, in the copy of its atlas page. FlushLightmaps uploads it.
 //
 void RebuildLightmap(World *world, int surface)
 {
@@ -301,9 +943,7 @@ void RebuildLightmap(World *world, int surface)
 	int width = surf->lightmapWidth;
 	int height = surf->lightmapHeight;
 
-	glBindTexture(GL_TEXTURE_2D, surf->lightmapObjName);
-
-	dface_t *face = world->map.getSurface(surface);
+	dlface_t *face = world->map.getSurface(surface);
 	unsigned char *samples = world->map.getLightmap(face->lightofs);
 
 	if (!samples) {
@@ -311,7 +951,8 @@ void RebuildLightmap(World *world, int surface)
 	}
 
 	int size = width * height;
-	unsigned char *luxels = new unsigned char [size];
+	LightmapPage *page = &world->lightmaps[world->surfaceRecords[surface].lightmap];
+	unsigned char *luxels = &page->luxels[surf->lightmapY * LIGHTMAP_PAGE_SIZE + surf->lightmapX];
 	for (int i = 0; i < size; i++) {
 		float intensity = 0.0f;
 		for (int style = 0; style < MAXLIGHTMAPS && face->styles[style] != 255; style++) {
@@ -323,11 +964,77 @@ void RebuildLightmap(World *world, int surface)
 			intensity += (float)samples[style * size + i] * scale;
 		}
 		int intVal = (int)(intensity + 0.5f);
-		luxels[i] = (intVal > 255) ? 255 : (unsigned char)intVal;
+		luxels[(i / width + LIGHTMAP_BORDER) * LIGHTMAP_PAGE_SIZE + i % width + LIGHTMAP_BORDER] = (intVal > 255) ? 255 : (unsigned char)intVal;
+	}
+	FillLightmapBorder(luxels, width, height, LIGHTMAP_PAGE_SIZE);
+	MarkLightmapDirty(page, surf->lightmapX, surf->lightmapY, width + 2 * LIGHTMAP_BORDER, height + 2 * LIGHTMAP_BORDER);
+}
+
+//
+// Upload the dirty rectangle of every lightmap page, in one pass before the world is
+// drawn. With pixel buffers, the rectangles are staged back to back in a buffer that
+// is orphaned every flush, so the driver can copy them into the pages without
+// waiting for the draws still reading the last ones. Without, they are uploaded
+// straight from the page copies.
+//
+void FlushLightmaps(World *world, RenderStats *stats)
+{
+	size_t size = 0;
+	for (int i = 0; i < world->numLightmaps; i++) {
+		LightmapPage *page = &world->lightmaps[i];
+		if (page->dirtyX0 < page->dirtyX1) {
+			size += (size_t)(page->dirtyX1 - page->dirtyX0) * (page->dirtyY1 - page->dirtyY0);
+		}
+	}
+	if (size == 0) {
+		return;
 	}
 
-	glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, width, height, GL_LUMINANCE, GL_UNSIGNED_BYTE, luxels);
-	delete[] luxels;
+	// Stage the rectangles, a row at a time
+	bool staged = false;
+	if (world->lightmapUploadBuffer) {
+		glBindBufferFn(GL_PIXEL_UNPACK_BUFFER, world->lightmapUploadBuffer);
+		glBufferDataFn(GL_PIXEL_UNPACK_BUFFER, size, NULL, GL_STREAM_DRAW);
+		unsigned char *staging = (unsigned char *)glMapBufferFn(GL_PIXEL_UNPACK_BUFFER, GL_WRITE_ONLY);
+		if (staging) {
+			for (int i = 0; i < world->numLightmaps; i++) {
+				LightmapPage *page = &world->lightmaps[i];
+				int width = page->dirtyX1 - page->dirtyX0;
+				for (int y = page->dirtyY0; y < page->dirtyY1 && width > 0; y++, staging += width) {
+					memcpy(staging, &page->luxels[y * LIGHTMAP_PAGE_SIZE + page->dirtyX0], width);
+				}
+			}
+			staged = glUnmapBufferFn(GL_PIXEL_UNPACK_BUFFER);
+		}
+		if (!staged) {
+			glBindBufferFn(GL_PIXEL_UNPACK_BUFFER, 0);
+		}
+	}
+	if (!staged) {
+		glPixelStorei(GL_UNPACK_ROW_LENGTH, LIGHTMAP_PAGE_SIZE);
+	}
+
+	size_t offset = 0;
+	for (int i = 0; i < world->numLightmaps; i++) {
+		LightmapPage *page = &world->lightmaps[i];
+		if (page->dirtyX0 >= page->dirtyX1) {
+			continue;
+		}
+		int width = page->dirtyX1 - page->dirtyX0;
+		int height = page->dirtyY1 - page->dirtyY0;
+		const void *pixels = staged ? (const void *)offset : &page->luxels[page->dirtyY0 * LIGHTMAP_PAGE_SIZE + page->dirtyX0];
+		RETROGL_BindTexture(page->objName);
+		glTexSubImage2D(GL_TEXTURE_2D, 0, page->dirtyX0, page->dirtyY0, width, height, GL_LUMINANCE, GL_UNSIGNED_BYTE, pixels);
+		offset += (size_t)width * height;
+		page->dirtyX1 = page->dirtyX0;
+	}
+
+	if (staged) {
+		glBindBufferFn(GL_PIXEL_UNPACK_BUFFER, 0);
+	} else {
+		glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
+	}
+	stats->lightmapUploadBytes += (int)size;
 }
 
 //
@@ -369,14 +1076,17 @@ bool IsSameTextureAnimation(const char *a, const char *b)
 //
 bool BuildTextureAnimations(World *world)
 {
-	for (int i = 0; i < world->numTextures; i++) {
-		world->textures[i].anim.total = 0;
+	CookedWorld *cooked = &world->cooked;
+	int numTextures = cooked->info.numTextures;
+
+	for (int i = 0; i < numTextures; i++) {
+		cooked->textures[i].anim.total = 0;
 		for (int frame = 0; frame < 10; frame++) {
-			world->textures[i].anim.frames[frame] = -1;
+			cooked->textures[i].anim.frames[frame] = -1;
 		}
 	}
 
-	for (int i = 0; i < world->numTextures; i++) {
+	for (int i = 0; i < numTextures; i++) {
 		miptex_t *baseTexture = world->map.getMipTexture(i);
 		if (!baseTexture) {
 			continue;
@@ -386,8 +1096,8 @@ bool BuildTextureAnimations(World *world)
 			continue;
 		}
 
-		TextureAnim *anim = &world->textures[i].anim;
-		for (int j = 0; j < world->numTextures; j++) {
+		TextureAnim *anim = &cooked->textures[i].anim;
+		for (int j = 0; j < numTextures; j++) {
 			miptex_t *frameTexture = world->map.getMipTexture(j);
 			if (!frameTexture || !IsSameTextureAnimation(baseTexture->name, frameTexture->name)) {
 				continue;
@@ -428,69 +1138,168 @@ int ResolveTextureAnimation(World *world, int textureIndex)
 }
 
 //
-// Create an OpenGL lightmap texture for a single surface. Sky and liquid surfaces
-// (TEX_SPECIAL), and faces with no stored lighting, get a solid white texel so the
-// modulate pass leaves the base texture at full brightness.
+// Combine the static lightmap of a single surface into its planned home in the luxel
+// data, with its border. White surfaces have nothing to combine: they sample the
+// white block the atlas pages are created with.
 //
-void BuildLightmap(World *world, int surface, int width, int height)
+void CombineLightmap(World *world, int surface)
 {
-	glBindTexture(GL_TEXTURE_2D, world->surfaces[surface].lightmapObjName);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
-
-	dface_t *face = world->map.getSurface(surface);
-	texinfo_t *textureInfo = world->map.getTextureInfo(surface);
-	unsigned char *samples = world->map.getLightmap(face->lightofs);
+	CookedWorld *cooked = &world->cooked;
+	CookedSurface *cookedSurface = &cooked->surfaces[surface];
+	unsigned char *luxels = cooked->luxels + cookedSurface->luxelOffset;
 
-	if ((textureInfo->flags & TEX_SPECIAL) || !samples) {
-		unsigned char white = 255;
-		glTexImage2D(GL_TEXTURE_2D, 0, GL_LUMINANCE, 1, 1, 0, GL_LUMINANCE, GL_UNSIGNED_BYTE, &white);
+	if (cookedSurface->white) {
 		return;
 	}
 
 	// Combine every light style affecting this surface into a single intensity map.
 	// Each active style contributes one width*height block of samples.
-	int size = width * height;
-	unsigned char *luxels = new unsigned char [size];
+	dlface_t *face = world->map.getSurface(surface);
+	unsigned char *samples = world->map.getLightmap(face->lightofs);
+	int width = cookedSurface->lightmapWidth;
+	int size = width * cookedSurface->lightmapHeight;
+	int stride = width + 2 * LIGHTMAP_BORDER;
 	for (int i = 0; i < size; i++) {
 		int intensity = 0;
 		for (int style = 0; style < MAXLIGHTMAPS && face->styles[style] != 255; style++) {
 			intensity += samples[style * size + i];
 		}
-		luxels[i] = (intensity > 255) ? 255 : (unsigned char)intensity;
+		luxels[(i / width + LIGHTMAP_BORDER) * stride + i % width + LIGHTMAP_BORDER] = (intensity > 255) ? 255 : (unsigned char)intensity;
 	}
-
-	glTexImage2D(GL_TEXTURE_2D, 0, GL_LUMINANCE, width, height, 0, GL_LUMINANCE, GL_UNSIGNED_BYTE, luxels);
-	delete[] luxels;
+	FillLightmapBorder(luxels, width, cookedSurface->lightmapHeight, stride);
 }
 
 //
-// Build per-surface primitive vertices, lightmap coordinates and lightmap textures
+// Where a lightmap goes in the packing order: dynamic before static, and tallest first
 //
-bool BuildSurfacePrimitives(World *world)
+static int LightmapPackBucket(const CookedSurface *surface)
 {
-	int numSurfaces = world->map.getNumSurfaces();
-
-	// Allocate memory for the visible surfaces array
-	world->visibleSurfaces = new int [world->map.getNumSurfaceLists()];
+	return (surface->dynamic ? 0 : LIGHTMAP_PAGE_SIZE + 1) + LIGHTMAP_PAGE_SIZE - surface->lightmapHeight;
+}
 
-	// Calculate max number of edges per surface
-	world->numMaxEdgesPerSurface = 0;
-	for (int i = 0; i < numSurfaces; i++) {
-		if (world->numMaxEdgesPerSurface < world->map.getNumEdges(i)) {
-			world->numMaxEdgesPerSurface = world->map.getNumEdges(i);
+//
+// Pack the lightmap of every lit surface, with its border, into the atlas pages, the
+// dynamic ones first so the rectangle they are rebuilt in stays small, and within
+// each kind the tallest first. Then turn the texture-space coordinates stashed in
+// the lightmap slot of their vertices into page coordinates. The white block comes
+// first, so it lands in the corner of page 0, and every white surface samples its
+// middle.
+//
+bool PackLightmaps(World *world, const int *lightmapMins)
+{
+	CookedWorld *cooked = &world->cooked;
+	int numSurfaces = cooked->info.numSurfaces;
+	RETRO_Atlas atlas;
+	if (!RETRO_AllocAtlas(&atlas, LIGHTMAP_PAGE_SIZE, LIGHTMAP_PAGE_SIZE)) {
+		return false;
+	}
+	int whiteX, whiteY;
+	RETRO_AtlasAlloc(&atlas, 1 + 2 * LIGHTMAP_BORDER, 1 + 2 * LIGHTMAP_BORDER, &whiteX, &whiteY);
+
+	// Order the lit surfaces, dynamic first and then by height, tallest first, with a
+	// counting sort
+	int numBuckets = 2 * (LIGHTMAP_PAGE_SIZE + 1);
+	int *bucketStarts = new int [numBuckets]();
+	int *order = new int [numSurfaces];
+	for (int i = 0; i < numSurfaces; i++) {
+		if (!cooked->surfaces[i].white) {
+			bucketStarts[LightmapPackBucket(&cooked->surfaces[i])]++;
+		}
+	}
+	int numOrdered = 0;
+	for (int bucket = 0; bucket < numBuckets; bucket++) {
+		int count = bucketStarts[bucket];
+		bucketStarts[bucket] = numOrdered;
+		numOrdered += count;
+	}
+	for (int i = 0; i < numSurfaces; i++) {
+		if (!cooked->surfaces[i].white) {
+			order[bucketStarts[LightmapPackBucket(&cooked->surfaces[i])]++] = i;
+		}
+	}
+
+	// Fill one page after another; each lightmap fits an empty page
+	int page = 0;
+	for (int i = 0; i < numOrdered; i++) {
+		CookedSurface *surface = &cooked->surfaces[order[i]];
+		int width = surface->lightmapWidth + 2 * LIGHTMAP_BORDER;
+		int height = surface->lightmapHeight + 2 * LIGHTMAP_BORDER;
+		if (!RETRO_AtlasAlloc(&atlas, width, height, &surface->lightmapX, &surface->lightmapY)) {
+			page++;
+			RETRO_ClearAtlas(&atlas);
+			RETRO_AtlasAlloc(&atlas, width, height, &surface->lightmapX, &surface->lightmapY);
 		}
+		surface->lightmapPage = page;
 	}
+	cooked->info.numLightmapPages = page + 1;
+	delete[] bucketStarts;
+	delete[] order;
+	RETRO_FreeAtlas(&atlas);
+
+	// Centre the coordinates on the luxels in the page (the +8 is half of the 16-texel
+	// luxel spacing)
+	float scale = 1.0f / LIGHTMAP_PAGE_SIZE;
+	for (int i = 0; i < numSurfaces; i++) {
+		CookedSurface *surface = &cooked->surfaces[i];
+		primuv_t *coords = &cooked->coords[surface->firstVertex];
+		if (surface->white) {
+			surface->lightmapPage = 0;
+			surface->lightmapX = whiteX;
+			surface->lightmapY = whiteY;
+		}
+		for (int j = 0; j < surface->numVertices; j++, coords++) {
+			if (surface->white) {
+				coords->l[0] = (whiteX + LIGHTMAP_BORDER + 0.5f) * scale;
+				coords->l[1] = (whiteY + LIGHTMAP_BORDER + 0.5f) * scale;
+			} else {
+				coords->l[0] = (surface->lightmapX + LIGHTMAP_BORDER + (coords->l[0] - lightmapMins[2 * i] * 16 + 8) / 16.0f) * scale;
+				coords->l[1] = (surface->lightmapY + LIGHTMAP_BORDER + (coords->l[1] - lightmapMins[2 * i + 1] * 16 + 8) / 16.0f) * scale;
+			}
+		}
+	}
+	return true;
+}
+
+//
+// True if the lighting lump holds a width x height block of samples for every light
+// style of the face, so building its lightmap stays inside the lump
+//
+bool LightmapInLump(RETRO_BSP *map, dlface_t *face, int width, int height)
+{
+	int numStyles = 0;
+	while (numStyles < MAXLIGHTMAPS && face->styles[numStyles] != 255) {
+		numStyles++;
+	}
+	return face->lightofs >= 0 &&
+		(size_t)face->lightofs + (size_t)numStyles * width * height <= (size_t)map->lightingLength;
+}
+
+//
+// Build the vertex pool, with every surface's vertices and their texture and lightmap
+// coordinates packed back to back, reserve room in the luxel data for each surface's
+// static lightmap, and pack the lightmaps into the atlas pages
+//
+bool BuildSurfacePrimitives(World *world)
+{
+	CookedWorld *cooked = &world->cooked;
+	int numSurfaces = world->map.getNumSurfaces();
+	cooked->info.numSurfaces = numSurfaces;
+	cooked->luxelLength = 0;
 
-	// Allocate memory for the surface primitive array and one lightmap texture per surface
-	world->surfacePrimitives = new primdesc_t [numSurfaces * world->numMaxEdgesPerSurface];
-	world->surfaces = new Surface [numSurfaces];
+	// Count the vertices of every surface to size the vertex pool
+	cooked->info.numVertices = 0;
 	for (int i = 0; i < numSurfaces; i++) {
-		glGenTextures(1, &world->surfaces[i].lightmapObjName);
+		cooked->info.numVertices += world->map.getNumEdges(i);
 	}
 
+	// Allocate memory for the vertex pool and the cooked surfaces
+	cooked->positions = new vec3_t [cooked->info.numVertices];
+	cooked->coords = new primuv_t [cooked->info.numVertices];
+	cooked->surfaces = new CookedSurface [numSurfaces]();
+	int *lightmapMins = new int [2 * numSurfaces];
+
+	int firstVertex = 0;
+
 	// Loop through all the surfaces to fetch the vertices and calculate their texture and lightmap coordinates
 	for (int i = 0; i < numSurfaces; i++) {
 		int numEdges = world->map.getNumEdges(i);
@@ -503,35 +1312,39 @@ bool BuildSurfacePrimitives(World *world)
 		float texWidth = (mipTexture && mipTexture->width) ? (float)mipTexture->width : 1.0f;
 		float texHeight = (mipTexture && mipTexture->height) ? (float)mipTexture->height : 1.0f;
 
-		// Point to a surface primitive array
-		primdesc_t *primitives = &world->surfacePrimitives[i * world->numMaxEdgesPerSurface];
+		// Point to the surface's vertices in the pool
+		float *position = cooked->positions[firstVertex];
+		primuv_t *coords = &cooked->coords[firstVertex];
+		cooked->surfaces[i].firstVertex = firstVertex;
+		cooked->surfaces[i].numVertices = numEdges;
+		firstVertex += numEdges;
 
 		// Track the surface's texture-space bounds to size its lightmap
 		float minS = FLT_MAX, minT = FLT_MAX, maxS = -FLT_MAX, maxT = -FLT_MAX;
 
-		for (int j = 0; j < numEdges; j++, primitives++) {
+		for (int j = 0; j < numEdges; j++, position += 3, coords++) {
 			// Get an edge id from the surface. Fetch the correct edge by using the id in the Edge List.
 			// The winding is backwards!
 			int edgeId = world->map.getEdgeList(world->map.getSurface(i)->firstedge + (numEdges - 1 - j));
 			// Positive surfedge -> edge used forwards (start vertex); otherwise reversed (end vertex)
 			int vertexId = ((edgeId >= 0) ? world->map.getEdge(edgeId)->v[0] : world->map.getEdge(-edgeId)->v[1]);
 
-			// Store the vertex in the primitive array
+			// Store the vertex in the vertex pool
 			vec3_t *vertex = world->map.getVertex(vertexId);
-			primitives->v[0] = ((float *)vertex)[0];
-			primitives->v[1] = ((float *)vertex)[1];
-			primitives->v[2] = ((float *)vertex)[2];
+			position[0] = ((float *)vertex)[0];
+			position[1] = ((float *)vertex)[1];
+			position[2] = ((float *)vertex)[2];
 
 			// Project the vertex into texture space
-			float s = DotProduct(textureInfo->vecs[0], primitives->v) + textureInfo->vecs[0][3];
-			float t = DotProduct(textureInfo->vecs[1], primitives->v) + textureInfo->vecs[1][3];
+			float s = DotProduct(textureInfo->vecs[0], position) + textureInfo->vecs[0][3];
+			float t = DotProduct(textureInfo->vecs[1], position) + textureInfo->vecs[1][3];
 
 			// Store the normalized texture coords, and stash the raw texture-space
 			// coords in the lightmap slot until the bounds are known
-			primitives->t[0] = s / texWidth;
-			primitives->t[1] = t / texHeight;
-			primitives->l[0] = s;
-			primitives->l[1] = t;
+			coords->t[0] = s / texWidth;
+			coords->t[1] = t / texHeight;
+			coords->l[0] = s;
+			coords->l[1] = t;
 
 			if (s < minS) minS = s;
 			if (t < minT) minT = t;
@@ -545,300 +1358,2023 @@ bool BuildSurfacePrimitives(World *world)
 		int lightWidth = CeilDiv16(maxS) - lightMinS + 1;
 		int lightHeight = CeilDiv16(maxT) - lightMinT + 1;
 
-		// Convert the stashed texture-space coords into normalized lightmap coords,
-		// centred on the luxel (the +8 is half of the 16-texel luxel spacing)
-		primitives = &world->surfacePrimitives[i * world->numMaxEdgesPerSurface];
-		for (int j = 0; j < numEdges; j++, primitives++) {
-			primitives->l[0] = (primitives->l[0] - lightMinS * 16 + 8) / (lightWidth * 16.0f);
-			primitives->l[1] = (primitives->l[1] - lightMinT * 16 + 8) / (lightHeight * 16.0f);
+		// The stashed texture-space coords become page coords once the lightmap is packed
+		lightmapMins[2 * i] = lightMinS;
+		lightmapMins[2 * i + 1] = lightMinT;
+		cooked->surfaces[i].lightmapWidth = lightWidth;
+		cooked->surfaces[i].lightmapHeight = lightHeight;
+
+		// Sky and liquid surfaces (TEX_SPECIAL), faces with no stored lighting or with
+		// samples running past the lighting lump, and the odd lightmap too big for an
+		// atlas page sample the white block
+		dlface_t *face = world->map.getSurface(i);
+		bool white = (textureInfo->flags & TEX_SPECIAL) || !LightmapInLump(&world->map, face, lightWidth, lightHeight) ||
+			lightWidth + 2 * LIGHTMAP_BORDER > LIGHTMAP_PAGE_SIZE || lightHeight + 2 * LIGHTMAP_BORDER > LIGHTMAP_PAGE_SIZE;
+		cooked->surfaces[i].white = white;
+
+		// White surfaces have no lightmap of their own, regardless of styles, so they
+		// must never be treated as dynamic.
+		bool dynamic = false;
+		if (!white) {
+			for (int style = 0; style < MAXLIGHTMAPS && face->styles[style] != 255; style++) {
+				if (face->styles[style] > 0 && face->styles[style] < 64) {
+					dynamic = true;
+					break;
+				}
+			}
+		}
+		cooked->surfaces[i].dynamic = dynamic;
+		size_t luxelSize = (size_t)(lightWidth + 2 * LIGHTMAP_BORDER) * (lightHeight + 2 * LIGHTMAP_BORDER);
+		cooked->surfaces[i].luxelOffset = CookReserve(&cooked->luxelLength, white ? 0 : luxelSize);
+	}
+
+	bool packed = PackLightmaps(world, lightmapMins);
+	delete[] lightmapMins;
+	return packed;
+}
+
+//
+// Create an OpenGL lightmap texture and upload its luxels
+//
+unsigned int CreateLightmapTexture(int width, int height, const unsigned char *luxels)
+{
+	unsigned int objName;
+	glGenTextures(1, &objName);
+	RETROGL_BindTexture(objName);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+	glTexImage2D(GL_TEXTURE_2D, 0, GL_LUMINANCE, width, height, 0, GL_LUMINANCE, GL_UNSIGNED_BYTE, luxels);
+	return objName;
+}
+
+//
+// Upload the cooked lightmap of one surface, with its border, into its atlas page.
+// White surfaces sample the white block and upload nothing. Returns the number of
+// bytes uploaded.
+//
+size_t UploadSurface(World *world, int surfaceIndex)
+{
+	CookedWorld *cooked = &world->cooked;
+	CookedSurface *cookedSurface = &cooked->surfaces[surfaceIndex];
+	if (cookedSurface->white) {
+		return 0;
+	}
+
+	int width = cookedSurface->lightmapWidth + 2 * LIGHTMAP_BORDER;
+	int height = cookedSurface->lightmapHeight + 2 * LIGHTMAP_BORDER;
+	LightmapPage *page = &world->lightmaps[cookedSurface->lightmapPage];
+	const unsigned char *luxels = cooked->luxels + cookedSurface->luxelOffset;
+	RETROGL_BindTexture(page->objName);
+	glTexSubImage2D(GL_TEXTURE_2D, 0, cookedSurface->lightmapX, cookedSurface->lightmapY, width, height,
+			GL_LUMINANCE, GL_UNSIGNED_BYTE, luxels);
+	if (page->luxels) {
+		for (int y = 0; y < height; y++) {
+			memcpy(&page->luxels[(cookedSurface->lightmapY + y) * LIGHTMAP_PAGE_SIZE + cookedSurface->lightmapX], &luxels[y * width], width);
 		}
+	}
+
+	// A dynamic lightmap is rebuilt over the static one at the next draw
+	world->surfaces[surfaceIndex].lightmapFrame = -1;
+	return (size_t)width * height;
+}
+
+//
+// Create a 1x1 placeholder texture of a single texel
+//
+unsigned int CreatePlaceholderTexture(GLenum format, const void *texel)
+{
+	unsigned int objName;
+	glGenTextures(1, &objName);
+	RETROGL_BindTexture(objName);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+	glTexImage2D(GL_TEXTURE_2D, 0, format, 1, 1, 0, format, GL_UNSIGNED_BYTE, texel);
+	return objName;
+}
+
+//
+// Resolve every surface's texinfo, texture classification, vertex range and plane
+// into its render record
+//
+void BuildSurfaceRecords(World *world)
+{
+	CookedWorld *cooked = &world->cooked;
+
+	world->surfaceRecords = new SurfaceRecord [cooked->info.numSurfaces];
+	SurfaceSpheres *spheres = &world->surfaceSpheres;
+	size_t paddedSurfaces = cooked->info.numSurfaces + RETRO_SPHERE_BATCH;
+	spheres->x = new float [4 * paddedSurfaces]();
+	spheres->y = spheres->x + paddedSurfaces;
+	spheres->z = spheres->y + paddedSurfaces;
+	spheres->radius = spheres->z + paddedSurfaces;
+	for (int i = 0; i < cooked->info.numSurfaces; i++) {
+		CookedSurface *cookedSurface = &cooked->surfaces[i];
+		SurfaceRecord *record = &world->surfaceRecords[i];
+		dlface_t *face = world->map.getSurface(i);
+		int textureIndex = world->map.getTextureInfo(i)->miptex;
+		CookedTexture *cookedTexture = &cooked->textures[textureIndex];
+
+		record->texture = textureIndex;
+		record->firstVertex = cookedSurface->firstVertex;
+		record->numVertices = cookedSurface->numVertices;
+		record->firstIndex = 0;
+		record->plane = face->planenum;
+		record->lightmap = cookedSurface->lightmapPage;
+		record->flags = 0;
+		if (cookedTexture->flags & COOKED_SKY) record->flags |= SURFACE_SKY;
+		if (cookedTexture->flags & COOKED_TURBULENT) record->flags |= SURFACE_TURBULENT;
+		if (cookedTexture->flags & COOKED_LUMA) record->flags |= SURFACE_LUMA;
+		if (cookedSurface->dynamic) record->flags |= SURFACE_DYNAMIC;
+		if (face->side) record->flags |= SURFACE_BACKSIDE;
+
+		// Centre the bounding sphere on the middle of the vertices' bounding box
+		vec3_t *positions = &world->vertexPositions[record->firstVertex];
+		vec3_t mins = { FLT_MAX, FLT_MAX, FLT_MAX };
+		vec3_t maxs = { -FLT_MAX, -FLT_MAX, -FLT_MAX };
+		for (int v = 0; v < record->numVertices; v++) {
+			for (int axis = 0; axis < 3; axis++) {
+				mins[axis] = fminf(mins[axis], positions[v][axis]);
+				maxs[axis] = fmaxf(maxs[axis], positions[v][axis]);
+			}
+		}
+		vec3_t centre = { (mins[0] + maxs[0]) * 0.5f, (mins[1] + maxs[1]) * 0.5f, (mins[2] + maxs[2]) * 0.5f };
+		float radiusSquared = 0.0f;
+		for (int v = 0; v < record->numVertices; v++) {
+			vec3_t delta = { positions[v][0] - centre[0], positions[v][1] - centre[1], positions[v][2] - centre[2] };
+			radiusSquared = fmaxf(radiusSquared, DotProduct(delta, delta));
+		}
+		spheres->x[i] = centre[0];
+		spheres->y[i] = centre[1];
+		spheres->z[i] = centre[2];
+		spheres->radius[i] = sqrtf(radiusSquared);
+
+		// Any frame of an animation may have fullbright pixels
+		TextureAnim *anim = &cookedTexture->anim;
+		if (anim->total > 1) {
+			record->flags |= SURFACE_ANIMATED;
+			for (int frame = 0; frame < anim->total; frame++) {
+				if (anim->frames[frame] >= 0 && (cooked->textures[anim->frames[frame]].flags & COOKED_LUMA)) {
+					record->flags |= SURFACE_LUMA;
+				}
+			}
+		}
+	}
+}
+
+//
+// Upload the vertex pool, positions then coordinates, and every surface's fan split
+// into triangles into static buffers, so that surfaces are drawn from ranges of the
+// index buffer. Without buffer objects the world stays in immediate mode.
+//
+void CreateWorldBuffers(World *world)
+{
+	if (!RETROGL_HasBufferObjects()) {
+		return;
+	}
+	CookedWorld *cooked = &world->cooked;
+
+	// Give every surface its range of the index buffer
+	int numIndices = 0;
+	for (int i = 0; i < cooked->info.numSurfaces; i++) {
+		SurfaceRecord *record = &world->surfaceRecords[i];
+		record->firstIndex = numIndices;
+		numIndices += SDL_max(record->numVertices - 2, 0) * 3;
+	}
+	unsigned int *indices = new unsigned int [SDL_max(numIndices, 1)];
+	for (int i = 0; i < cooked->info.numSurfaces; i++) {
+		SurfaceRecord *record = &world->surfaceRecords[i];
+		unsigned int *triangle = &indices[record->firstIndex];
+		for (int v = 2; v < record->numVertices; v++, triangle += 3) {
+			triangle[0] = record->firstVertex;
+			triangle[1] = record->firstVertex + v - 1;
+			triangle[2] = record->firstVertex + v;
+		}
+	}
+
+	size_t positionsSize = sizeof(vec3_t) * cooked->info.numVertices;
+	size_t coordsSize = sizeof(primuv_t) * cooked->info.numVertices;
+	glGenBuffersFn(1, &world->vertexBuffer);
+	glBindBufferFn(GL_ARRAY_BUFFER, world->vertexBuffer);
+	glBufferDataFn(GL_ARRAY_BUFFER, positionsSize + coordsSize, NULL, GL_STATIC_DRAW);
+	glBufferSubDataFn(GL_ARRAY_BUFFER, 0, positionsSize, world->vertexPositions);
+	glBufferSubDataFn(GL_ARRAY_BUFFER, positionsSize, coordsSize, world->vertexCoords);
+	glBindBufferFn(GL_ARRAY_BUFFER, 0);
+
+	glGenBuffersFn(1, &world->indexBuffer);
+	glBindBufferFn(GL_ELEMENT_ARRAY_BUFFER, world->indexBuffer);
+	glBufferDataFn(GL_ELEMENT_ARRAY_BUFFER, sizeof(unsigned int) * numIndices, indices, GL_STATIC_DRAW);
+	glBindBufferFn(GL_ELEMENT_ARRAY_BUFFER, 0);
+	delete[] indices;
+
+	world->batchCounts = new GLsizei [cooked->info.numSurfaces];
+	world->batchOffsets = new const void * [cooked->info.numSurfaces];
+}
+
+//
+// Set up the per-texture and per-surface render state of the planned world. No
+// texture or lightmap is uploaded here: until UploadTexture and UploadSurface get to
+// them, surfaces are drawn with the placeholder texture and lightmap.
+//
+void CreateWorldObjects(World *world)
+{
+	CookedWorld *cooked = &world->cooked;
+
+	world->numTextures = cooked->info.numTextures;
+	world->skyTextureIndex = cooked->info.skyTextureIndex;
+	world->textures = new Texture [world->numTextures];
+	for (int i = 0; i < world->numTextures; i++) {
+		CookedTexture *cookedTexture = &cooked->textures[i];
+		Texture *texture = &world->textures[i];
+		texture->anim = cookedTexture->anim;
+		texture->sky = (cookedTexture->flags & COOKED_SKY) != 0;
+		texture->turbulent = (cookedTexture->flags & COOKED_TURBULENT) != 0;
+	}
+
+	world->vertexPositions = cooked->positions;
+	world->vertexCoords = cooked->coords;
+
+	// Allocate memory for the visible surfaces array and the draw list
+	world->visibleSurfaces = new int [cooked->info.numSurfaces];
+	for (int i = 0; i < 2; i++) {
+		world->frames[i].drawList.surfaces = new int [cooked->info.numSurfaces];
+		world->frames[i].drawList.ranges = new DrawRange [world->numTextures];
+	}
+	world->textureRanges = new int [world->numTextures];
+	for (int i = 0; i < world->numTextures; i++) {
+		world->textureRanges[i] = -1;
+	}
+	world->surfaceVisFrame = new int [cooked->info.numSurfaces]();
+	world->visFrame = 0;
+	if (!RETRO_AllocOcclusionBuffer(&world->occlusion, OCCLUSION_WIDTH, OCCLUSION_HEIGHT)) {
+		RETRO_FreeOcclusionBuffer(&world->occlusion);
+	}
+
+	// Link every node and leaf to its parent, so the nodes above a leaf can be marked
+	RETRO_BSP *map = &world->map;
+	world->leafParents = new int [map->leafCount];
+	world->nodeParents = new int [map->nodeCount];
+	for (int i = 0; i < map->leafCount; i++) {
+		world->leafParents[i] = -1;
+	}
+	for (int i = 0; i < map->nodeCount; i++) {
+		world->nodeParents[i] = -1;
+	}
+	for (int i = 0; i < map->nodeCount; i++) {
+		for (int side = 0; side < 2; side++) {
+			int child = map->getNode(i)->children[side];
+			if (child >= 0) {
+				world->nodeParents[child] = i;
+			} else {
+				world->leafParents[~child] = i;
+			}
+		}
+	}
+
+	// Size every subtree, so a parallel walk can split the tree into even pieces and
+	// give each the room for its surfaces
+	ParallelWalk *walk = &world->walk;
+	walk->nodeLeafCounts = new int [map->nodeCount]();
+	walk->nodeFaceCounts = new int [map->nodeCount]();
+	for (int i = 1; i < map->leafCount; i++) {
+		for (int node = world->leafParents[i]; node >= 0; node = world->nodeParents[node]) {
+			walk->nodeLeafCounts[node]++;
+		}
+	}
+	for (int i = 0; i < map->nodeCount; i++) {
+		int numFaces = map->getNode(i)->numfaces;
+		for (int node = i; node >= 0; node = world->nodeParents[node]) {
+			walk->nodeFaceCounts[node] += numFaces;
+		}
+	}
+	walk->items = new WalkItem [map->nodeCount + map->leafCount];
+	walk->tasks = new int [map->nodeCount + map->leafCount];
+	walk->surfaces = new int [cooked->info.numSurfaces];
+	walk->ranges = new DrawRange [cooked->info.numSurfaces];
+	walk->numScratch = pool.numThreads + 1;
+	walk->scratch = new WalkScratch [walk->numScratch];
+	for (int i = 0; i < walk->numScratch; i++) {
+		SDL_SetAtomicInt(&walk->scratch[i].busy, 0);
+		walk->scratch[i].textureRanges = new int [world->numTextures];
+		for (int j = 0; j < world->numTextures; j++) {
+			walk->scratch[i].textureRanges[j] = -1;
+		}
+	}
+	walk->taskLeaves = SDL_max(WALK_TASK_MIN_LEAVES, map->getNumLeaves() / (WALK_TASKS_PER_THREAD * walk->numScratch));
+
+	// Allocate the visible set cache, empty
+	world->numVisibleLeafWords = RETRO_PVSWords(map);
+	world->numVisibleNodeWords = (map->nodeCount + 63) / 64;
+	for (int i = 0; i < VISIBLE_SET_CACHE_SIZE; i++) {
+		VisibleSet *set = &world->visibleSets[i];
+		if (!world->pvs.rows) {
+			set->decodedLeaves = RETRO_AllocPVS(map);
+		}
+		set->nodes = new RETRO_PVSWord [world->numVisibleNodeWords];
+	}
+	world->leafVisibleSets = new int [map->leafCount];
+	for (int i = 0; i < map->leafCount; i++) {
+		world->leafVisibleSets[i] = -1;
+	}
+
+	world->surfaces = new Surface [cooked->info.numSurfaces];
+	for (int i = 0; i < cooked->info.numSurfaces; i++) {
+		CookedSurface *cookedSurface = &cooked->surfaces[i];
+		Surface *surface = &world->surfaces[i];
+		surface->lightmapWidth = cookedSurface->lightmapWidth;
+		surface->lightmapHeight = cookedSurface->lightmapHeight;
+		surface->lightmapX = cookedSurface->lightmapX;
+		surface->lightmapY = cookedSurface->lightmapY;
+	}
+	BuildSurfaceRecords(world);
+	CreateWorldBuffers(world);
+
+	// Create the lightmap atlas pages, neutral until the lightmaps are uploaded, with the
+	// white block that sky, liquid and unlit surfaces sample in the corner of page 0.
+	// Pages with dynamic lightmaps keep a copy of their luxels to rebuild them in.
+	world->numLightmaps = cooked->info.numLightmapPages;
+	world->lightmaps = new LightmapPage [world->numLightmaps];
+	for (int i = 0; i < cooked->info.numSurfaces; i++) {
+		LightmapPage *page = &world->lightmaps[cooked->surfaces[i].lightmapPage];
+		if (cooked->surfaces[i].dynamic && !page->luxels) {
+			page->luxels = new unsigned char [LIGHTMAP_PAGE_SIZE * LIGHTMAP_PAGE_SIZE];
+		}
+	}
+	unsigned char *pageLuxels = new unsigned char [LIGHTMAP_PAGE_SIZE * LIGHTMAP_PAGE_SIZE];
+	CookedSurface *white = NULL;
+	for (int i = 0; i < cooked->info.numSurfaces && !white; i++) {
+		white = cooked->surfaces[i].white ? &cooked->surfaces[i] : NULL;
+	}
+	for (int i = 0; i < world->numLightmaps; i++) {
+		LightmapPage *page = &world->lightmaps[i];
+		memset(pageLuxels, 128, LIGHTMAP_PAGE_SIZE * LIGHTMAP_PAGE_SIZE);
+		if (white && white->lightmapPage == i) {
+			for (int y = 0; y < 1 + 2 * LIGHTMAP_BORDER; y++) {
+				memset(&pageLuxels[(white->lightmapY + y) * LIGHTMAP_PAGE_SIZE + white->lightmapX], 255, 1 + 2 * LIGHTMAP_BORDER);
+			}
+		}
+		page->objName = CreateLightmapTexture(LIGHTMAP_PAGE_SIZE, LIGHTMAP_PAGE_SIZE, pageLuxels);
+		if (page->luxels) {
+			memcpy(page->luxels, pageLuxels, LIGHTMAP_PAGE_SIZE * LIGHTMAP_PAGE_SIZE);
+		}
+	}
+	delete[] pageLuxels;
+	if (RETROGL_HasPixelBuffers()) {
+		glGenBuffersFn(1, &world->lightmapUploadBuffer);
+	}
+
+	// Allocate the texture chains, with every texture and lightmap unchained
+	TextureChains *chains = &world->chains;
+	chains->chains = new TextureChain [world->numTextures];
+	chains->surfaces = new int [cooked->info.numSurfaces];
+	chains->nextRange = new int [world->numTextures];
+	chains->textureChains = new int [world->numTextures];
+	for (int i = 0; i < world->numTextures; i++) {
+		chains->textureChains[i] = -1;
+	}
+	chains->lightmapGroups = new int [world->numLightmaps];
+	for (int i = 0; i < world->numLightmaps; i++) {
+		chains->lightmapGroups[i] = -1;
+	}
+	chains->groupLightmaps = new int [world->numLightmaps];
+	chains->groupStarts = new int [world->numLightmaps];
+
+	// A mid grey texture under a lightmap that the overbright combine scales to 1.0
+	unsigned int grey = 0xFF808080;
+	world->placeholderTexture = CreatePlaceholderTexture(GL_RGBA, &grey);
+}
+
+//
+// Name of a cache file kept in the game directory: "maps/name.bsp" -> "assets/name.cache"
+// for the world cache, "assets/name.vis" for the vis cache
+//
+void WorldCacheFilename(const char *mapName, const char *suffix, char *filename, size_t size)
+{
+	const char *separator = strrchr(mapName, '/');
+	snprintf(filename, size, "%s/%s", GAME_DIRECTORY, separator ? separator + 1 : mapName);
+	char *extension = strrchr(filename, '.');
+	if (extension && extension > strrchr(filename, '/')) {
+		*extension = '\0';
+	}
+	size_t length = strlen(filename);
+	snprintf(filename + length, size - length, "%s", suffix);
+}
+
+//
+// Hash everything the cooked world is derived from: the BSP, palette and colormap
+//
+unsigned long long WorldCacheKey(World *world)
+{
+	unsigned long long key = RETRO_HASH_INIT;
+	key = RETRO_HashBytes(key, world->map.bspFile.data, world->map.bspFile.length);
+	key = RETRO_HashBytes(key, world->map.palette, sizeof(world->map.palette));
+	key = RETRO_HashBytes(key, world->map.colormapFile.data, world->map.colormapFile.length);
+	return key;
+}
+
+//
+// Point the cooked world straight into a mapped world cache. Fails when there is no
+// cache, when it was built from different data or an older format, or when its
+// sections do not match the map.
+//
+bool LoadWorldCache(World *world, const char *filename)
+{
+	CookedWorld *cooked = &world->cooked;
+	size_t infoLength, texturesLength, surfacesLength, positionsLength, coordsLength;
+
+	if (!RETRO_OpenCache(filename, WORLD_CACHE_VERSION, WorldCacheKey(world), &cooked->cache)) {
+		return false;
+	}
+
+	CookedInfo *info = (CookedInfo *)RETRO_GetCacheSection(&cooked->cache, WORLD_CACHE_INFO, &infoLength);
+	cooked->textures = (CookedTexture *)RETRO_GetCacheSection(&cooked->cache, WORLD_CACHE_TEXTURES, &texturesLength);
+	cooked->surfaces = (CookedSurface *)RETRO_GetCacheSection(&cooked->cache, WORLD_CACHE_SURFACES, &surfacesLength);
+	cooked->positions = (vec3_t *)RETRO_GetCacheSection(&cooked->cache, WORLD_CACHE_POSITIONS, &positionsLength);
+	cooked->coords = (primuv_t *)RETRO_GetCacheSection(&cooked->cache, WORLD_CACHE_COORDS, &coordsLength);
+	cooked->texels = (unsigned char *)RETRO_GetCacheSection(&cooked->cache, WORLD_CACHE_TEXELS, &cooked->texelLength);
+	cooked->luxels = (unsigned char *)RETRO_GetCacheSection(&cooked->cache, WORLD_CACHE_LUXELS, &cooked->luxelLength);
+
+	bool ok = info && infoLength == sizeof(CookedInfo) &&
+		info->numTextures == world->map.getNumTextures() &&
+		info->numSurfaces == world->map.getNumSurfaces() &&
+		texturesLength == sizeof(CookedTexture) * info->numTextures &&
+		surfacesLength == sizeof(CookedSurface) * info->numSurfaces &&
+		info->numLightmapPages >= 1 && info->numLightmapPages <= info->numSurfaces + 1 &&
+		positionsLength == sizeof(vec3_t) * info->numVertices &&
+		coordsLength == sizeof(primuv_t) * info->numVertices;
+	for (int i = 0; ok && i < info->numSurfaces; i++) {
+		CookedSurface *surface = &cooked->surfaces[i];
+		int width = surface->white ? 1 + 2 * LIGHTMAP_BORDER : surface->lightmapWidth + 2 * LIGHTMAP_BORDER;
+		int height = surface->white ? 1 + 2 * LIGHTMAP_BORDER : surface->lightmapHeight + 2 * LIGHTMAP_BORDER;
+		size_t size = surface->white ? 0 : (size_t)width * height;
+		ok = surface->luxelOffset + size <= cooked->luxelLength &&
+			surface->lightmapPage >= 0 && surface->lightmapPage < info->numLightmapPages &&
+			surface->lightmapX >= 0 && surface->lightmapX <= LIGHTMAP_PAGE_SIZE - width &&
+			surface->lightmapY >= 0 && surface->lightmapY <= LIGHTMAP_PAGE_SIZE - height &&
+			surface->firstVertex >= 0 && surface->numVertices == world->map.getNumEdges(i) &&
+			surface->firstVertex <= info->numVertices - surface->numVertices &&
+			(surface->white || LightmapInLump(&world->map, world->map.getSurface(i), surface->lightmapWidth, surface->lightmapHeight));
+	}
+	for (int i = 0; ok && i < info->numTextures; i++) {
+		CookedTexture *texture = &cooked->textures[i];
+		ok = texture->pixelOffset + MipChainSize(texture->width, texture->height) <= cooked->texelLength;
+		if (ok && (texture->flags & COOKED_LUMA)) {
+			ok = texture->lumaOffset + MipChainSize(texture->width, texture->height) <= cooked->texelLength;
+		}
+		if (ok && (texture->flags & COOKED_SKY)) {
+			size_t skySize = MipChainSize(texture->skyLayerWidth, texture->skyLayerHeight);
+			ok = texture->skyBackOffset + skySize <= cooked->texelLength &&
+				texture->skyFrontOffset + skySize <= cooked->texelLength;
+		}
+		int maxFrames = sizeof(texture->anim.frames) / sizeof(texture->anim.frames[0]);
+		ok = ok && texture->anim.total >= 0 && texture->anim.total <= maxFrames;
+		for (int frame = 0; ok && frame < maxFrames; frame++) {
+			ok = texture->anim.frames[frame] >= -1 && texture->anim.frames[frame] < info->numTextures;
+		}
+	}
+
+	if (!ok) {
+		printf("[ERROR] LoadWorldCache() Ignoring malformed world cache %s\n", filename);
+		RETRO_CloseCache(&cooked->cache);
+		cooked->textures = NULL;
+		cooked->surfaces = NULL;
+		cooked->positions = NULL;
+		cooked->coords = NULL;
+		cooked->texels = NULL;
+		cooked->luxels = NULL;
+		return false;
+	}
+
+	cooked->info = *info;
+	return true;
+}
+
+//
+// Write the cooked world to the world cache, so the next launch can skip cooking
+//
+bool WriteWorldCache(World *world, const char *filename)
+{
+	CookedWorld *cooked = &world->cooked;
+	RETRO_CacheWriter writer;
+
+	RETRO_BeginCache(&writer, WORLD_CACHE_VERSION, WorldCacheKey(world));
+	RETRO_AddCacheSection(&writer, WORLD_CACHE_INFO, &cooked->info, sizeof(CookedInfo));
+	RETRO_AddCacheSection(&writer, WORLD_CACHE_TEXTURES, cooked->textures, sizeof(CookedTexture) * cooked->info.numTextures);
+	RETRO_AddCacheSection(&writer, WORLD_CACHE_SURFACES, cooked->surfaces, sizeof(CookedSurface) * cooked->info.numSurfaces);
+	RETRO_AddCacheSection(&writer, WORLD_CACHE_POSITIONS, cooked->positions, sizeof(vec3_t) * cooked->info.numVertices);
+	RETRO_AddCacheSection(&writer, WORLD_CACHE_COORDS, cooked->coords, sizeof(primuv_t) * cooked->info.numVertices);
+	RETRO_AddCacheSection(&writer, WORLD_CACHE_TEXELS, cooked->texels, cooked->texelLength);
+	RETRO_AddCacheSection(&writer, WORLD_CACHE_LUXELS, cooked->luxels, cooked->luxelLength);
+	return RETRO_WriteCache(&writer, filename);
+}
+
+//
+// Give the map the PVS kept in its vis cache. Fails when there is no cache, or when it
+// was built from a different map or an older format.
+//
+bool LoadVisCache(World *world, const char *filename)
+{
+	RETRO_BSP *map = &world->map;
+	RETRO_Cache cache;
+	size_t dataLength, offsetsLength;
+	unsigned long long key = RETRO_HashBytes(RETRO_HASH_INIT, map->bspFile.data, map->bspFile.length);
+
+	if (!RETRO_OpenCache(filename, VIS_CACHE_VERSION, key, &cache)) {
+		return false;
+	}
+	unsigned char *data = (unsigned char *)RETRO_GetCacheSection(&cache, VIS_CACHE_DATA, &dataLength);
+	int *offsets = (int *)RETRO_GetCacheSection(&cache, VIS_CACHE_OFFSETS, &offsetsLength);
+	// Every row must decode within the cached data, as nothing checks it once the
+	// map has taken it as its visibility lump
+	bool ok = data && offsets && offsetsLength == sizeof(int) * map->leafCount && dataLength <= INT_MAX;
+	for (int leaf = 0; ok && leaf < map->leafCount; leaf++) {
+		ok = offsets[leaf] < 0 || ((size_t)offsets[leaf] < dataLength &&
+			RETRO_PVSRowFits(data + offsets[leaf], dataLength - offsets[leaf], map->getNumLeaves()));
+	}
+	if (!ok) {
+		printf("[ERROR] LoadVisCache() Ignoring malformed vis cache %s\n", filename);
+		RETRO_CloseCache(&cache);
+		return false;
+	}
+
+	// The map owns its visibility lump, so take a copy of the cached one
+	unsigned char *visibility = (unsigned char *)malloc(dataLength + 1);
+	if (visibility) {
+		memcpy(visibility, data, dataLength);
+		ok = RETRO_SetBSPVis(map, visibility, (int)dataLength, offsets);
+	}
+	RETRO_CloseCache(&cache);
+	return visibility && ok;
+}
+
+//
+// Compute the PVS of a map built without vis, or read it from the vis cache where an
+// earlier launch left it
+//
+void BuildVis(World *world)
+{
+	RETRO_BSP *map = &world->map;
+	char cacheFilename[1024];
+	WorldCacheFilename(RETRO.map, ".vis", cacheFilename, sizeof(cacheFilename));
+	if (RETRO.usecache && LoadVisCache(world, cacheFilename)) {
+		return;
+	}
+
+	unsigned char *visibility;
+	int length;
+	int *offsets = (int *)malloc(map->leafCount * sizeof(int));
+	if (!offsets || !RETRO_CompileVis(map, &pool, &visibility, &length, offsets)) {
+		printf("[ERROR] BuildVis() Unable to compute the PVS\n");
+		free(offsets);
+		return;
+	}
+	if (RETRO.usecache) {
+		RETRO_CacheWriter writer;
+		RETRO_BeginCache(&writer, VIS_CACHE_VERSION, RETRO_HashBytes(RETRO_HASH_INIT, map->bspFile.data, map->bspFile.length));
+		RETRO_AddCacheSection(&writer, VIS_CACHE_DATA, visibility, length);
+		RETRO_AddCacheSection(&writer, VIS_CACHE_OFFSETS, offsets, map->leafCount * sizeof(int));
+		if (!RETRO_WriteCache(&writer, cacheFilename)) {
+			printf("[ERROR] BuildVis() Unable to write vis cache %s\n", cacheFilename);
+		}
+	}
+	RETRO_SetBSPVis(map, visibility, length, offsets);
+	free(offsets);
+}
+
+//
+// Plan the load-time preprocessing of the map: build the surface vertices, collect
+// the texture animations, lay out every texture and lightmap, and allocate the texel
+// and luxel data they are converted into by ConvertTexture and CombineLightmap
+//
+bool PlanWorld(World *world)
+{
+	CookedWorld *cooked = &world->cooked;
+
+	if (!PlanTextures(world) || !BuildSurfacePrimitives(world) || !BuildTextureAnimations(world)) {
+		return false;
+	}
+	BuildPaletteTables(world);
+
+	cooked->texels = (unsigned char *)malloc(cooked->texelLength);
+	cooked->luxels = (unsigned char *)malloc(cooked->luxelLength);
+	return (cooked->texels || !cooked->texelLength) && (cooked->luxels || !cooked->luxelLength);
+}
+
+//
+// Release the cooked texel and luxel data once it has been uploaded. The vertex pool
+// stays, as the renderer draws from it.
+//
+void FreeCookedPixels(World *world)
+{
+	CookedWorld *cooked = &world->cooked;
+	if (cooked->cache.header) {
+		return;
+	}
+	free(cooked->texels);
+	free(cooked->luxels);
+	cooked->texels = NULL;
+	cooked->luxels = NULL;
+	cooked->texelLength = 0;
+	cooked->luxelLength = 0;
+}
+
+//
+// Release the cooked world, whether built or mapped from the cache
+//
+void FreeCookedWorld(World *world)
+{
+	CookedWorld *cooked = &world->cooked;
+	if (cooked->cache.header) {
+		RETRO_CloseCache(&cooked->cache);
+	} else {
+		delete[] cooked->textures;
+		delete[] cooked->surfaces;
+		delete[] cooked->positions;
+		delete[] cooked->coords;
+		free(cooked->texels);
+		free(cooked->luxels);
+	}
+	cooked->textures = NULL;
+	cooked->surfaces = NULL;
+	cooked->positions = NULL;
+	cooked->coords = NULL;
+	cooked->texels = NULL;
+	cooked->luxels = NULL;
+	cooked->texelLength = 0;
+	cooked->luxelLength = 0;
+}
+
+void SkyTexCoord(World *world, int textureIndex, const float dir[3], float scroll, float *s, float *t)
+{
+	float skyDir[3] = {
+		dir[0],
+		dir[1],
+		dir[2] * 3.0f
+	};
+	float length = sqrtf(skyDir[0] * skyDir[0] + skyDir[1] * skyDir[1] + skyDir[2] * skyDir[2]);
+	if (length < 0.0001f) {
+		length = 0.0001f;
+	}
+
+	Texture *texture = &world->textures[textureIndex];
+	int width = texture->skyLayerWidth > 0 ? texture->skyLayerWidth : 128;
+	int height = texture->skyLayerHeight > 0 ? texture->skyLayerHeight : 128;
+	float scale = (6.0f * 63.0f) / length;
+	*s = (scroll + skyDir[0] * scale) / (float)width;
+	*t = (scroll + skyDir[1] * scale) / (float)height;
+}
+
+void DrawSkyBackgroundLayer(World *world, RETRO_Camera *camera, int textureIndex, unsigned int textureObj, float scroll)
+{
+	const int slices = 64;
+	const int stacks = 32;
+	const float radius = 2048.0f;
+
+	RETROGL_BindTexture(textureObj);
+
+	for (int stack = 0; stack < stacks; stack++) {
+		float phi0 = (-0.5f + (float)stack / (float)stacks) * (float)M_PI;
+		float phi1 = (-0.5f + (float)(stack + 1) / (float)stacks) * (float)M_PI;
+
+		glBegin(GL_QUAD_STRIP);
+		for (int slice = 0; slice <= slices; slice++) {
+			float theta = ((float)slice / (float)slices) * 2.0f * (float)M_PI;
+			float cosTheta = cosf(theta);
+			float sinTheta = sinf(theta);
+
+			float dir0[3] = { cosf(phi0) * cosTheta, cosf(phi0) * sinTheta, sinf(phi0) };
+			float dir1[3] = { cosf(phi1) * cosTheta, cosf(phi1) * sinTheta, sinf(phi1) };
+			float s, t;
+
+			SkyTexCoord(world, textureIndex, dir1, scroll, &s, &t);
+			glTexCoord2f(s, t);
+			glVertex3f(camera->origin[0] + dir1[0] * radius,
+					camera->origin[1] + dir1[1] * radius,
+					camera->origin[2] + dir1[2] * radius);
+
+			SkyTexCoord(world, textureIndex, dir0, scroll, &s, &t);
+			glTexCoord2f(s, t);
+			glVertex3f(camera->origin[0] + dir0[0] * radius,
+					camera->origin[1] + dir0[1] * radius,
+					camera->origin[2] + dir0[2] * radius);
+		}
+		glEnd();
+	}
+}
+
+void DrawSkyBackground(World *world, RETRO_Camera *camera)
+{
+	int textureIndex = world->skyTextureIndex;
+	if (textureIndex < 0 || textureIndex >= world->numTextures || world->textures[textureIndex].skyBackObjName == 0) {
+		return;
+	}
+
+	RETROGL_ActiveTexture(GL_TEXTURE1);
+	RETROGL_Disable(GL_TEXTURE_2D);
+	RETROGL_ActiveTexture(GL_TEXTURE0);
+	RETROGL_Disable(GL_DEPTH_TEST);
+	RETROGL_DepthMask(GL_FALSE);
+	RETROGL_Disable(GL_CULL_FACE);
+	glColor4f(1.0f, 1.0f, 1.0f, 1.0f);
+
+	RETROGL_Disable(GL_BLEND);
+	DrawSkyBackgroundLayer(world, camera, textureIndex, world->textures[textureIndex].skyBackObjName,
+			(float)(world->textureTime * SKY_BACK_SCROLL_SPEED));
+
+	RETROGL_Enable(GL_BLEND);
+	RETROGL_BlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+	DrawSkyBackgroundLayer(world, camera, textureIndex, world->textures[textureIndex].skyFrontObjName,
+			(float)(world->textureTime * SKY_FRONT_SCROLL_SPEED));
+	RETROGL_Disable(GL_BLEND);
+
+	RETROGL_Enable(GL_CULL_FACE);
+	RETROGL_DepthMask(GL_TRUE);
+	RETROGL_Enable(GL_DEPTH_TEST);
+	RETROGL_ActiveTexture(GL_TEXTURE1);
+	RETROGL_Enable(GL_TEXTURE_2D);
+	RETROGL_ActiveTexture(GL_TEXTURE0);
+}
+
+//
+// Draw the surface
+//
+void DrawSurface(World *world, SurfaceRecord *record)
+{
+	// Get the surface's vertices in the vertex pool
+	vec3_t *positions = &world->vertexPositions[record->firstVertex];
+	primuv_t *coords = &world->vertexCoords[record->firstVertex];
+
+	// Liquid surfaces ripple their texture coordinates.
+	bool turbulent = (record->flags & SURFACE_TURBULENT) != 0;
+	float time = (float)world->textureTime;
+
+	// Loop through all vertices of the primitive and draw a surface. BSP faces are
+	// convex, so a triangle fan from the first vertex fills the whole face.
+	glBegin(GL_TRIANGLE_FAN);
+	for (int i = 0; i < record->numVertices; i++, coords++) {
+		float s = coords->t[0];
+		float t = coords->t[1];
+		if (turbulent) {
+			// Ripple the texture coordinates with a time-varying sine
+			s = coords->t[0] + sinf(coords->t[1] * WARP_SPACE_FREQ + time * WARP_TIME_FREQ) * WARP_AMPLITUDE;
+			t = coords->t[1] + sinf(coords->t[0] * WARP_SPACE_FREQ + time * WARP_TIME_FREQ) * WARP_AMPLITUDE;
+		}
+		glMultiTexCoord2fFn(GL_TEXTURE0, s, t);
+		glMultiTexCoord2fFn(GL_TEXTURE1, coords->l[0], coords->l[1]);
+		if (world->lumaUnit) {
+			glMultiTexCoord2fFn(GL_TEXTURE2, s, t);
+		}
+		glVertex3fv(positions[i]);
+	}
+	glEnd();
+}
+
+//
+// Point the vertex arrays at the world buffers: positions, texture coordinates on
+// unit 0 (and on the luma unit 2) and lightmap coordinates on unit 1
+//
+void BindWorldBuffers(World *world)
+{
+	size_t coordsOffset = sizeof(vec3_t) * world->cooked.info.numVertices;
+	glBindBufferFn(GL_ARRAY_BUFFER, world->vertexBuffer);
+	glBindBufferFn(GL_ELEMENT_ARRAY_BUFFER, world->indexBuffer);
+	glEnableClientState(GL_VERTEX_ARRAY);
+	glVertexPointer(3, GL_FLOAT, sizeof(vec3_t), (const void *)0);
+	glClientActiveTextureFn(GL_TEXTURE0);
+	glEnableClientState(GL_TEXTURE_COORD_ARRAY);
+	glTexCoordPointer(2, GL_FLOAT, sizeof(primuv_t), (const void *)(coordsOffset + offsetof(primuv_t, t)));
+	glClientActiveTextureFn(GL_TEXTURE1);
+	glEnableClientState(GL_TEXTURE_COORD_ARRAY);
+	glTexCoordPointer(2, GL_FLOAT, sizeof(primuv_t), (const void *)(coordsOffset + offsetof(primuv_t, l)));
+	if (world->lumaUnit) {
+		glClientActiveTextureFn(GL_TEXTURE2);
+		glEnableClientState(GL_TEXTURE_COORD_ARRAY);
+		glTexCoordPointer(2, GL_FLOAT, sizeof(primuv_t), (const void *)(coordsOffset + offsetof(primuv_t, t)));
+	}
+	glClientActiveTextureFn(GL_TEXTURE0);
+}
+
+//
+// Disable the vertex arrays and unbind the world buffers again
+//
+void UnbindWorldBuffers(World *world)
+{
+	if (world->lumaUnit) {
+		glClientActiveTextureFn(GL_TEXTURE2);
+		glDisableClientState(GL_TEXTURE_COORD_ARRAY);
+	}
+	glClientActiveTextureFn(GL_TEXTURE1);
+	glDisableClientState(GL_TEXTURE_COORD_ARRAY);
+	glClientActiveTextureFn(GL_TEXTURE0);
+	glDisableClientState(GL_TEXTURE_COORD_ARRAY);
+	glDisableClientState(GL_VERTEX_ARRAY);
+	glBindBufferFn(GL_ELEMENT_ARRAY_BUFFER, 0);
+	glBindBufferFn(GL_ARRAY_BUFFER, 0);
+}
+
+//
+// Draw a batch of surfaces with the textures that are bound. From the world buffers
+// the batch takes a single call; in immediate mode, and for liquids whose texture
+// coordinates ripple every frame, each surface is sent vertex by vertex.
+//
+void DrawSurfaceBatch(World *world, const int *surfaces, int numSurfaces, bool immediate, RenderStats *stats)
+{
+	if (immediate) {
+		for (int i = 0; i < numSurfaces; i++) {
+			DrawSurface(world, &world->surfaceRecords[surfaces[i]]);
+		}
+		stats->drawCalls += numSurfaces;
+		return;
+	}
+
+	// Gather the index ranges of the surfaces' triangles
+	int numBatch = 0;
+	for (int i = 0; i < numSurfaces; i++) {
+		SurfaceRecord *record = &world->surfaceRecords[surfaces[i]];
+		if (record->numVertices < 3) {
+			continue;
+		}
+		world->batchCounts[numBatch] = (record->numVertices - 2) * 3;
+		world->batchOffsets[numBatch] = (const void *)(sizeof(unsigned int) * record->firstIndex);
+		numBatch++;
+	}
+	if (numBatch == 0) {
+		return;
+	}
+
+	if (glMultiDrawElementsFn) {
+		glMultiDrawElementsFn(GL_TRIANGLES, world->batchCounts, GL_UNSIGNED_INT, world->batchOffsets, numBatch);
+		stats->drawCalls++;
+	} else {
+		for (int i = 0; i < numBatch; i++) {
+			glDrawElements(GL_TRIANGLES, world->batchCounts[i], GL_UNSIGNED_INT, world->batchOffsets[i]);
+		}
+		stats->drawCalls += numBatch;
+	}
+}
+
+//
+// The lightmap atlas page a surface is drawn with
+//
+unsigned int SurfaceLightmap(World *world, int surface)
+{
+	return world->lightmaps[world->surfaceRecords[surface].lightmap].objName;
+}
+
+//
+// Chain the base texture runs of a draw list by the texture each currently resolves
+// to, and group the surfaces of every chain by lightmap. Chains keep the order of
+// their first run, and surfaces keep their order within a lightmap group.
+//
+void BuildTextureChains(World *world, const DrawList *list)
+{
+	TextureChains *chains = &world->chains;
+	chains->numChains = 0;
+	for (int r = 0; r < list->numRanges; r++) {
+		const DrawRange *range = &list->ranges[r];
+		int texture = ResolveTextureAnimation(world, range->texture);
+		int c = chains->textureChains[texture];
+		if (c < 0) {
+			c = chains->numChains++;
+			chains->textureChains[texture] = c;
+			chains->chains[c].texture = texture;
+			chains->chains[c].count = 0;
+			chains->chains[c].firstRange = r;
+		} else {
+			chains->nextRange[chains->chains[c].lastRange] = r;
+		}
+		chains->nextRange[r] = -1;
+		chains->chains[c].lastRange = r;
+		chains->chains[c].count += range->count;
+	}
+
+	int first = 0;
+	for (int c = 0; c < chains->numChains; c++) {
+		TextureChain *chain = &chains->chains[c];
+		chains->textureChains[chain->texture] = -1;
+		chain->first = first;
+		first += chain->count;
+
+		// Count the surfaces of each lightmap in the chain, in order of first use
+		int numGroups = 0;
+		for (int r = chain->firstRange; r >= 0; r = chains->nextRange[r]) {
+			const int *surfaces = &list->surfaces[list->ranges[r].first];
+			for (int i = 0; i < list->ranges[r].count; i++) {
+				int lightmap = world->surfaceRecords[surfaces[i]].lightmap;
+				if (chains->lightmapGroups[lightmap] < 0) {
+					chains->lightmapGroups[lightmap] = numGroups;
+					chains->groupLightmaps[numGroups] = lightmap;
+					chains->groupStarts[numGroups] = 0;
+					numGroups++;
+				}
+				chains->groupStarts[chains->lightmapGroups[lightmap]]++;
+			}
+		}
+
+		// Turn the counts into the start of each group, and place the surfaces
+		int start = chain->first;
+		for (int g = 0; g < numGroups; g++) {
+			int count = chains->groupStarts[g];
+			chains->groupStarts[g] = start;
+			start += count;
+		}
+		for (int r = chain->firstRange; r >= 0; r = chains->nextRange[r]) {
+			const int *surfaces = &list->surfaces[list->ranges[r].first];
+			for (int i = 0; i < list->ranges[r].count; i++) {
+				int group = chains->lightmapGroups[world->surfaceRecords[surfaces[i]].lightmap];
+				chains->surfaces[chains->groupStarts[group]++] = surfaces[i];
+			}
+		}
+		for (int g = 0; g < numGroups; g++) {
+			chains->lightmapGroups[chains->groupLightmaps[g]] = -1;
+		}
+	}
+}
+
+//
+// Draw the surfaces of a draw list, one texture chain at a time, and within a chain in
+// batches that share a lightmap
+//
+void DrawSurfaces(World *world, DrawList *list, RenderStats *stats)
+{
+	BuildTextureChains(world, list);
+
+	// Rebuild the dynamic lightmaps in view with the current style values, and upload
+	// them before anything is drawn
+	for (int i = 0; i < list->numSurfaces; i++) {
+		int surfaceIndex = world->chains.surfaces[i];
+		if (world->surfaceRecords[surfaceIndex].flags & SURFACE_DYNAMIC) {
+			Surface *surface = &world->surfaces[surfaceIndex];
+			if (surface->lightmapFrame != world->lightStyleFrame) {
+				RebuildLightmap(world, surfaceIndex);
+				surface->lightmapFrame = world->lightStyleFrame;
+			}
+		}
+	}
+	FlushLightmaps(world, stats);
+
+	bool buffered = world->vertexBuffer != 0;
+	if (buffered) {
+		BindWorldBuffers(world);
+	}
+
+	TextureChains *chains = &world->chains;
+	for (int c = 0; c < chains->numChains; c++) {
+		TextureChain *chain = &chains->chains[c];
+		int *surfaces = &chains->surfaces[chain->first];
+		Texture *texture = &world->textures[chain->texture];
+		bool immediate = !buffered || texture->turbulent;
+		stats->unchainedBinds += 2 * chain->count;
+
+		// Bind the texture to unit 0, or its placeholder while it is still loading
+		RETROGL_BindTextureUnit(GL_TEXTURE0, texture->objName ? texture->objName : world->placeholderTexture);
+		RETROGL_ActiveTexture(GL_TEXTURE1);
+		stats->textureBinds++;
+
+		// Combine the luma texture on unit 2 in the same pass where there is one. Unit 2
+		// is only switched on and off where a chain with luma meets one without.
+		if (world->lumaUnit) {
+			RETROGL_ActiveTexture(GL_TEXTURE2);
+			RETROGL_SetCapability(GL_TEXTURE_2D, texture->hasLuma);
+			if (texture->hasLuma) {
+				RETROGL_BindTexture(texture->lumaObjName);
+				stats->textureBinds++;
+			}
+			RETROGL_ActiveTexture(GL_TEXTURE1);
+		}
+
+		// Bind each lightmap to unit 1 and draw the run of surfaces that use it
+		for (int i = 0; i < chain->count;) {
+			unsigned int lightmap = SurfaceLightmap(world, surfaces[i]);
+			int count = 1;
+			while (i + count < chain->count && SurfaceLightmap(world, surfaces[i + count]) == lightmap) {
+				count++;
+			}
+			RETROGL_BindTexture(lightmap);
+			stats->lightmapBinds++;
+			DrawSurfaceBatch(world, &surfaces[i], count, immediate, stats);
+			i += count;
+		}
+
+		// Without a third unit, draw the chain again with its luma/fullbright pixels
+		if (texture->hasLuma && !world->lumaUnit) {
+			// Disable multitexturing
+			RETROGL_Disable(GL_TEXTURE_2D);
+
+			// Enable alpha test
+			RETROGL_Enable(GL_ALPHA_TEST);
+			glAlphaFunc(GL_GREATER, 0.0f);
+
+			// Bind luma texture to unit 0
+			RETROGL_BindTextureUnit(GL_TEXTURE0, texture->lumaObjName);
+			stats->textureBinds++;
+
+			// Draw the surfaces again
+			DrawSurfaceBatch(world, surfaces, chain->count, immediate, stats);
+
+			// Restore state
+			RETROGL_Disable(GL_ALPHA_TEST);
+			RETROGL_ActiveTexture(GL_TEXTURE1);
+			RETROGL_Enable(GL_TEXTURE_2D);
+		}
+	}
+	if (world->lumaUnit) {
+		RETROGL_ActiveTexture(GL_TEXTURE2);
+		RETROGL_Disable(GL_TEXTURE_2D);
+	}
+	RETROGL_ActiveTexture(GL_TEXTURE0);
+
+	if (buffered) {
+		UnbindWorldBuffers(world);
+	}
+}
+
+//
+// Build the visible set of a leaf: its PVS, and the nodes on the way down to every
+// leaf in it, marked by climbing from each leaf until a marked node is met
+//
+void BuildVisibleSet(World *world, int leafIndex, VisibleSet *set, RenderStats *stats)
+{
+	if (world->pvs.rows) {
+		set->leaves = RETRO_GetPVSRow(&world->pvs, leafIndex);
+	} else {
+		RETRO_DecodePVS(&world->map, leafIndex, set->decodedLeaves);
+		set->leaves = set->decodedLeaves;
+		stats->pvsDecodes++;
+	}
+	set->numLeaves = RETRO_CountPVS(set->leaves, world->numVisibleLeafWords);
+
+	// Node sets use the bit layout of leaf sets
+	memset(set->nodes, 0, world->numVisibleNodeWords * sizeof(RETRO_PVSWord));
+	for (int word = 0; word < world->numVisibleLeafWords; word++) {
+		for (RETRO_PVSWord bits = set->leaves[word]; bits; bits &= bits - 1) {
+			int node = world->leafParents[word * 64 + __builtin_ctzll(bits)];
+			while (node >= 0 && !RETRO_TestPVS(set->nodes, node)) {
+				set->nodes[node >> 6] |= 1ULL << (node & 63);
+				node = world->nodeParents[node];
+			}
+		}
+	}
+	set->leaf = leafIndex;
+}
+
+//
+// Get the visible set of a leaf from the cache, building it in place of the least
+// recently used set when the leaf has none
+//
+VisibleSet *FindVisibleSet(World *world, int leafIndex, RenderStats *stats)
+{
+	int slot = world->leafVisibleSets[leafIndex];
+	if (slot >= 0) {
+		stats->visibleSetHits++;
+	} else {
+		slot = 0;
+		for (int i = 1; i < VISIBLE_SET_CACHE_SIZE; i++) {
+			if (world->visibleSets[i].lastUsed < world->visibleSets[slot].lastUsed) {
+				slot = i;
+			}
+		}
+		VisibleSet *set = &world->visibleSets[slot];
+		if (set->leaf >= 0) {
+			world->leafVisibleSets[set->leaf] = -1;
+		}
+		BuildVisibleSet(world, leafIndex, set, stats);
+		world->leafVisibleSets[leafIndex] = slot;
+		stats->visibleSetMisses++;
+	}
+
+	VisibleSet *set = &world->visibleSets[slot];
+	set->lastUsed = ++world->visibleSetClock;
+	return set;
+}
+
+//
+// Emit the surfaces on the plane of a node that face the eye, were marked by a leaf in
+// view and touch the frustum. Every surface of a node lies on its plane, so the side
+// of the eye tells which of them face it; surfaces facing away are left unmarked until
+// the far side is walked. The node's surfaces are consecutive, so their bounding
+// spheres are tested a batch at a time.
+//
+void EmitNodeSurfaces(World *world, WorldView *view, dl2node_t *node, int side, int clipFlags)
+{
+	int lastSurface = node->firstface + node->numfaces;
+	for (int batch = node->firstface; batch < lastSurface; batch += RETRO_SPHERE_BATCH) {
+		SurfaceSpheres *spheres = &world->surfaceSpheres;
+		int inside = (1 << RETRO_SPHERE_BATCH) - 1;
+		if (clipFlags) {
+			inside = RETRO_CullSpheres(&view->frustum, &spheres->x[batch], &spheres->y[batch], &spheres->z[batch],
+					&spheres->radius[batch], clipFlags);
+		}
+		int batchEnd = batch + RETRO_SPHERE_BATCH < lastSurface ? batch + RETRO_SPHERE_BATCH : lastSurface;
+		for (int surface = batch; surface < batchEnd; surface++) {
+			SurfaceRecord *record = &world->surfaceRecords[surface];
+			// Only surfaces a leaf in view marked are candidates, so the counters
+			// below measure what each test rejects of them
+			if ((record->flags & SURFACE_SKY) || world->surfaceVisFrame[surface] != view->visFrame) {
+				continue;
+			}
+			if (((record->flags & SURFACE_BACKSIDE) != 0) != side) {
+				view->numBackfacing++;
+			} else if (!(inside & (1 << (surface - batch)))) {
+				view->numOutside++;
+			} else {
+				view->surfaces[view->numSurfaces++] = surface;
+			}
+		}
+	}
+}
+
+//
+// Walk the subtree below a node or leaf (~leaf) front to back. Subtrees without PVS
+// leaves or outside the frustum are skipped. A leaf in view marks its surfaces; a
+// node then emits its marked surfaces that face the eye, after everything on the
+// eye's side of its plane and before everything behind it. Sky surfaces are left
+// out, as the sky background shows through them.
+//
+void WalkWorldNode(World *world, WorldView *view, int child, int clipFlags)
+{
+	while (child >= 0) {
+		if (!RETRO_TestPVS(view->set->nodes, child)) {
+			return;
+		}
+		dl2node_t *node = world->map.getNode(child);
+		if (clipFlags && RETRO_CullBox(&view->frustum, node->mins, node->maxs, &clipFlags)) {
+			view->numCulledNodes++;
+			return;
+		}
+		if (view->occlusion && RETRO_OccludedBox(view->occlusion, node->mins, node->maxs)) {
+			view->numOccludedNodes++;
+			return;
+		}
+
+		// Walk the eye's side first
+		RETRO_BSPNode *treeNode = &world->map.tree[child];
+		int side = RETRO_BSPNodeDistance(treeNode, view->origin) < 0.0f;
+		WalkWorldNode(world, view, treeNode->children[side], clipFlags);
+
+		EmitNodeSurfaces(world, view, node, side, clipFlags);
+
+		// Then the far side
+		child = treeNode->children[!side];
+	}
+
+	int leafIndex = ~child;
+	if (!RETRO_TestPVS(view->set->leaves, leafIndex)) {
+		return;
+	}
+	dl2leaf_t *leaf = world->map.getLeaf(leafIndex);
+	if (clipFlags && RETRO_CullBox(&view->frustum, leaf->mins, leaf->maxs, &clipFlags)) {
+		view->numCulledNodes++;
+		return;
+	}
+	if (view->occlusion && RETRO_OccludedBox(view->occlusion, leaf->mins, leaf->maxs)) {
+		view->numOccludedNodes++;
+		return;
+	}
+	view->numLeaves++;
+	view->numMarkedSurfaces += leaf->nummarksurfaces;
+	// Leaves on both sides of a node mark its surfaces, and in a parallel walk they
+	// may be in subtrees walked at the same time; they store the same stamp, and the
+	// one that finds it already there counts a duplicate
+	int lastSurface = leaf->firstmarksurface + leaf->nummarksurfaces;
+	for (int k = leaf->firstmarksurface; k < lastSurface; k++) {
+		int stamp = __atomic_exchange_n(&world->surfaceVisFrame[world->map.getSurfaceList(k)], view->visFrame, __ATOMIC_RELAXED);
+		view->numDuplicates += stamp == view->visFrame;
+	}
+}
+
+//
+// Draw the occluders of a frame into the occlusion buffer: the surfaces of the last
+// frame's draw list that face the eye and cover the most of the view, judged by the
+// size of their bounding spheres against their distance. Returns the number drawn.
+//
+int DrawOccluders(World *world, RETRO_Camera *camera, float aspect, const DrawList *lastList)
+{
+	RETRO_OcclusionBuffer *occlusion = &world->occlusion;
+	RETRO_ClearOcclusionBuffer(occlusion, camera, (float)RETRO.fov, aspect, (float)RETRO.znear);
+
+	// Keep the best scoring surfaces, best first
+	int occluders[MAX_OCCLUDERS];
+	float scores[MAX_OCCLUDERS];
+	int numOccluders = 0;
+	SurfaceSpheres *spheres = &world->surfaceSpheres;
+	for (int i = 0; i < lastList->numSurfaces; i++) {
+		int surface = lastList->surfaces[i];
+		SurfaceRecord *record = &world->surfaceRecords[surface];
+		dplane_t *plane = world->map.getPlane(record->plane);
+		float side = DotProduct(plane->normal, camera->origin) - plane->dist;
+		if ((record->flags & SURFACE_BACKSIDE) ? side >= 0.0f : side <= 0.0f) {
+			continue;
+		}
+
+		vec3_t delta = {
+			spheres->x[surface] - camera->origin[0],
+			spheres->y[surface] - camera->origin[1],
+			spheres->z[surface] - camera->origin[2]
+		};
+		float distanceSquared = DotProduct(delta, delta) + 1.0f;
+		float score = spheres->radius[surface] * spheres->radius[surface] * fabsf(side) / (distanceSquared * sqrtf(distanceSquared));
+		if (numOccluders == MAX_OCCLUDERS && score <= scores[MAX_OCCLUDERS - 1]) {
+			continue;
+		}
+		int slot = numOccluders < MAX_OCCLUDERS ? numOccluders++ : MAX_OCCLUDERS - 1;
+		for (; slot > 0 && scores[slot - 1] < score; slot--) {
+			occluders[slot] = occluders[slot - 1];
+			scores[slot] = scores[slot - 1];
+		}
+		occluders[slot] = surface;
+		scores[slot] = score;
+	}
+
+	int numDrawn = 0;
+	for (int i = 0; i < numOccluders; i++) {
+		SurfaceRecord *record = &world->surfaceRecords[occluders[i]];
+		numDrawn += RETRO_DrawOccluder(occlusion, &world->vertexPositions[record->firstVertex], record->numVertices);
+	}
+	RETRO_UpdateOcclusionTiles(occlusion);
+	return numDrawn;
+}
+
+//
+// Group surfaces by base texture with a counting sort, into binned and one run per
+// texture in ranges. Runs are ordered by their first surface, and surfaces keep their
+// order within a run. textureRanges is per-texture scratch, -1 throughout, and is left
+// that way. Returns the number of runs.
+//
+int BinSurfaces(World *world, const int *surfaces, int numSurfaces, int *textureRanges, int *binned, DrawRange *ranges)
+{
+	int numRanges = 0;
+	for (int i = 0; i < numSurfaces; i++) {
+		int texture = world->surfaceRecords[surfaces[i]].texture;
+		if (textureRanges[texture] < 0) {
+			textureRanges[texture] = numRanges;
+			ranges[numRanges].texture = texture;
+			ranges[numRanges].count = 0;
+			numRanges++;
+		}
+		ranges[textureRanges[texture]].count++;
+	}
+
+	int first = 0;
+	for (int r = 0; r < numRanges; r++) {
+		ranges[r].first = first;
+		first += ranges[r].count;
+		ranges[r].count = 0;
+	}
+	for (int i = 0; i < numSurfaces; i++) {
+		DrawRange *range = &ranges[textureRanges[world->surfaceRecords[surfaces[i]].texture]];
+		binned[range->first + range->count++] = surfaces[i];
+	}
+
+	for (int r = 0; r < numRanges; r++) {
+		textureRanges[ranges[r].texture] = -1;
+	}
+	return numRanges;
+}
+
+//
+// Group the surfaces of a frame by base texture into its draw list
+//
+void BuildDrawList(World *world, const int *surfaces, int numSurfaces, DrawList *list)
+{
+	list->numRanges = BinSurfaces(world, surfaces, numSurfaces, world->textureRanges, list->surfaces, list->ranges);
+	list->numSurfaces = numSurfaces;
+}
 
-		world->surfaces[i].lightmapWidth = lightWidth;
-		world->surfaces[i].lightmapHeight = lightHeight;
+//
+// Add a piece to a parallel walk
+//
+WalkItem *AddWalkItem(ParallelWalk *walk, int child, int side, int clipFlags)
+{
+	WalkItem *item = &walk->items[walk->numItems++];
+	item->child = child;
+	item->side = side;
+	item->clipFlags = clipFlags;
+	if (side < 0) {
+		walk->tasks[walk->numTasks++] = walk->numItems - 1;
+	}
+	return item;
+}
 
-		// Special (sky/liquid) surfaces always get BuildLightmap's 1x1 white texel,
-		// regardless of styles, so they must never be treated as dynamic.
-		dface_t *face = world->map.getSurface(i);
-		bool dynamic = false;
-		if (!(textureInfo->flags & TEX_SPECIAL)) {
-			for (int style = 0; style < MAXLIGHTMAPS && face->styles[style] != 255; style++) {
-				if (face->styles[style] > 0 && face->styles[style] < 64) {
-					dynamic = true;
-					break;
-				}
-			}
+//
+// Split the walk of the subtree below a node or leaf (~leaf) into pieces, front to
+// back. The top of the tree is culled here as WalkWorldNode would; each subtree small
+// enough becomes a task, and each node above them a piece of its own that follows its
+// near side.
+//
+void SplitWorldWalk(World *world, WorldView *view, int child, int clipFlags)
+{
+	ParallelWalk *walk = &world->walk;
+	while (child >= 0 && walk->nodeLeafCounts[child] > walk->taskLeaves) {
+		if (!RETRO_TestPVS(view->set->nodes, child)) {
+			return;
+		}
+		dl2node_t *node = world->map.getNode(child);
+		if (clipFlags && RETRO_CullBox(&view->frustum, node->mins, node->maxs, &clipFlags)) {
+			view->numCulledNodes++;
+			return;
+		}
+		if (view->occlusion && RETRO_OccludedBox(view->occlusion, node->mins, node->maxs)) {
+			view->numOccludedNodes++;
+			return;
 		}
-		world->surfaces[i].lightmapDynamic = dynamic;
 
-		// Create the lightmap texture for this surface
-		BuildLightmap(world, i, lightWidth, lightHeight);
+		RETRO_BSPNode *treeNode = &world->map.tree[child];
+		int side = RETRO_BSPNodeDistance(treeNode, view->origin) < 0.0f;
+		SplitWorldWalk(world, view, treeNode->children[side], clipFlags);
+		AddWalkItem(walk, child, side, clipFlags);
+		child = treeNode->children[!side];
 	}
-
-	return true;
+	AddWalkItem(walk, child, -1, clipFlags);
 }
 
-void SkyTexCoord(World *world, int textureIndex, const float dir[3], float scroll, float *s, float *t)
+//
+// Bin the surfaces a piece found with the scratch of whichever thread gets it first
+//
+void BinWalkItem(World *world, WalkItem *item)
 {
-	float skyDir[3] = {
-		dir[0],
-		dir[1],
-		dir[2] * 3.0f
-	};
-	float length = sqrtf(skyDir[0] * skyDir[0] + skyDir[1] * skyDir[1] + skyDir[2] * skyDir[2]);
-	if (length < 0.0001f) {
-		length = 0.0001f;
+	ParallelWalk *walk = &world->walk;
+	int slot = 0;
+	while (!SDL_CompareAndSwapAtomicInt(&walk->scratch[slot].busy, 0, 1)) {
+		slot = (slot + 1) % walk->numScratch;
 	}
+	item->numRanges = BinSurfaces(world, &world->visibleSurfaces[item->first], item->numSurfaces,
+			walk->scratch[slot].textureRanges, &walk->surfaces[item->first], &walk->ranges[item->first]);
+	SDL_SetAtomicInt(&walk->scratch[slot].busy, 0);
+}
 
-	Texture *texture = &world->textures[textureIndex];
-	int width = texture->skyLayerWidth > 0 ? texture->skyLayerWidth : 128;
-	int height = texture->skyLayerHeight > 0 ? texture->skyLayerHeight : 128;
-	float scale = (6.0f * 63.0f) / length;
-	*s = (scroll + skyDir[0] * scale) / (float)width;
-	*t = (scroll + skyDir[1] * scale) / (float)height;
+//
+// Walk the subtree of a piece, then bin what it found. Called by RETRO_ParallelFor,
+// one subtree per iteration. A leaf marks only surfaces of the nodes above it, so a
+// subtree's surfaces are marked by its own leaves and the pieces need not wait for
+// each other.
+//
+void WalkWorldTask(void *data, int index)
+{
+	World *world = (World *)data;
+	ParallelWalk *walk = &world->walk;
+	WalkItem *item = &walk->items[walk->tasks[index]];
+
+	WorldView view = *walk->view;
+	view.surfaces = &world->visibleSurfaces[item->first];
+	view.numSurfaces = 0;
+	view.numMarkedSurfaces = 0;
+	view.numDuplicates = 0;
+	view.numBackfacing = 0;
+	view.numOutside = 0;
+	view.numLeaves = 0;
+	view.numCulledNodes = 0;
+	view.numOccludedNodes = 0;
+	WalkWorldNode(world, &view, item->child, item->clipFlags);
+
+	item->numSurfaces = view.numSurfaces;
+	item->numMarkedSurfaces = view.numMarkedSurfaces;
+	item->numDuplicates = view.numDuplicates;
+	item->numBackfacing = view.numBackfacing;
+	item->numOutside = view.numOutside;
+	item->numLeaves = view.numLeaves;
+	item->numCulledNodes = view.numCulledNodes;
+	item->numOccludedNodes = view.numOccludedNodes;
+	BinWalkItem(world, item);
 }
 
-void DrawSkyBackgroundLayer(World *world, RETRO_Camera *camera, int textureIndex, unsigned int textureObj, float scroll)
+//
+// Walk the node tree across the thread pool: split it into pieces, walk and bin the
+// subtrees in parallel, emit the surfaces of the nodes above them, then merge the
+// pieces' runs into the draw list. Runs are merged in the order of the pieces, which
+// is the order of the walk, so the draw list is the one WalkWorldNode and
+// BuildDrawList would give.
+//
+void WalkWorldParallel(World *world, WorldView *view, DrawList *list)
 {
-	const int slices = 64;
-	const int stacks = 32;
-	const float radius = 2048.0f;
+	ParallelWalk *walk = &world->walk;
+	walk->view = view;
+	walk->numItems = 0;
+	walk->numTasks = 0;
+	SplitWorldWalk(world, view, (int)(world->map.getStartNode() - world->map.getNode(0)), RETRO_FRUSTUM_ALL);
+
+	// Give each piece room for every surface below it
+	int first = 0;
+	for (int i = 0; i < walk->numItems; i++) {
+		WalkItem *item = &walk->items[i];
+		item->first = first;
+		if (item->side >= 0) {
+			first += world->map.getNode(item->child)->numfaces;
+		} else if (item->child >= 0) {
+			first += walk->nodeFaceCounts[item->child];
+		}
+	}
 
-	glBindTexture(GL_TEXTURE_2D, textureObj);
+	RETRO_ParallelFor(&pool, walk->numTasks, WalkWorldTask, world);
+
+	// The nodes above the subtrees, now that their surfaces are marked
+	for (int i = 0; i < walk->numItems; i++) {
+		WalkItem *item = &walk->items[i];
+		if (item->side >= 0) {
+			WorldView nodeView = *view;
+			nodeView.surfaces = &world->visibleSurfaces[item->first];
+			nodeView.numSurfaces = 0;
+			nodeView.numBackfacing = 0;
+			nodeView.numOutside = 0;
+			EmitNodeSurfaces(world, &nodeView, world->map.getNode(item->child), item->side, item->clipFlags);
+			item->numSurfaces = nodeView.numSurfaces;
+			item->numBackfacing = nodeView.numBackfacing;
+			item->numOutside = nodeView.numOutside;
+			item->numMarkedSurfaces = item->numDuplicates = item->numLeaves = item->numCulledNodes = item->numOccludedNodes = 0;
+			BinWalkItem(world, item);
+		}
+		view->numSurfaces += item->numSurfaces;
+		view->numMarkedSurfaces += item->numMarkedSurfaces;
+		view->numDuplicates += item->numDuplicates;
+		view->numBackfacing += item->numBackfacing;
+		view->numOutside += item->numOutside;
+		view->numLeaves += item->numLeaves;
+		view->numCulledNodes += item->numCulledNodes;
+		view->numOccludedNodes += item->numOccludedNodes;
+	}
 
-	for (int stack = 0; stack < stacks; stack++) {
-		float phi0 = (-0.5f + (float)stack / (float)stacks) * (float)M_PI;
-		float phi1 = (-0.5f + (float)(stack + 1) / (float)stacks) * (float)M_PI;
+	// Size the draw list's runs, in order of their first surface across the pieces,
+	// then copy each piece's runs to the end of theirs
+	int *textureRanges = world->textureRanges;
+	int numRanges = 0;
+	for (int i = 0; i < walk->numItems; i++) {
+		WalkItem *item = &walk->items[i];
+		for (int r = 0; r < item->numRanges; r++) {
+			DrawRange *range = &walk->ranges[item->first + r];
+			if (textureRanges[range->texture] < 0) {
+				textureRanges[range->texture] = numRanges;
+				list->ranges[numRanges].texture = range->texture;
+				list->ranges[numRanges].count = 0;
+				numRanges++;
+			}
+			list->ranges[textureRanges[range->texture]].count += range->count;
+		}
+	}
+	first = 0;
+	for (int r = 0; r < numRanges; r++) {
+		list->ranges[r].first = first;
+		first += list->ranges[r].count;
+		list->ranges[r].count = 0;
+	}
+	for (int i = 0; i < walk->numItems; i++) {
+		WalkItem *item = &walk->items[i];
+		for (int r = 0; r < item->numRanges; r++) {
+			DrawRange *range = &walk->ranges[item->first + r];
+			DrawRange *merged = &list->ranges[textureRanges[range->texture]];
+			memcpy(&list->surfaces[merged->first + merged->count], &walk->surfaces[item->first + range->first], range->count * sizeof(int));
+			merged->count += range->count;
+		}
+	}
+	for (int r = 0; r < numRanges; r++) {
+		textureRanges[list->ranges[r].texture] = -1;
+	}
+	list->numSurfaces = view->numSurfaces;
+	list->numRanges = numRanges;
+}
 
-		glBegin(GL_QUAD_STRIP);
-		for (int slice = 0; slice <= slices; slice++) {
-			float theta = ((float)slice / (float)slices) * 2.0f * (float)M_PI;
-			float cosTheta = cosf(theta);
-			float sinTheta = sinf(theta);
+//
+// Traverse the BSP tree to find the leaf containing the camera
+//
+dl2leaf_t *FindCameraLeaf(World *world, RETRO_Camera *camera)
+{
+	return world->map.getLeaf(RETRO_FindLeaf(&world->map, camera->origin));
+}
 
-			float dir0[3] = { cosf(phi0) * cosTheta, cosf(phi0) * sinTheta, sinf(phi0) };
-			float dir1[3] = { cosf(phi1) * cosTheta, cosf(phi1) * sinTheta, sinf(phi1) };
-			float s, t;
+//
+// Find the surfaces of a frame that are visible from the leaf holding its camera and
+// inside its view, and group them into its draw list. The leaf's visible set is built
+// the first time the camera enters it and reused while it stays in the cache; the walk
+// of the node tree is redone every frame, so only the part of the PVS the camera looks
+// at is drawn. The occluders come from the last frame's draw list, which may be the
+// frame's own list before it is replaced.
+//
+void FindVisibleSurfaces(World *world, VisFrame *frame, const DrawList *lastList)
+{
+	RETRO_Camera *camera = &frame->camera;
+	RenderStats *stats = &frame->stats;
+	*stats = RenderStats();
+
+	WorldView view;
+	view.origin[0] = camera->origin[0];
+	view.origin[1] = camera->origin[1];
+	view.origin[2] = camera->origin[2];
+	RETRO_SetFrustum(&view.frustum, camera, (float)RETRO.fov, frame->aspect);
+	view.set = FindVisibleSet(world, (int)(FindCameraLeaf(world, camera) - world->map.getLeaf(0)), stats);
+	view.visFrame = ++world->visFrame;
+	view.surfaces = world->visibleSurfaces;
+	view.numSurfaces = 0;
+	view.numMarkedSurfaces = 0;
+	view.numDuplicates = 0;
+	view.numBackfacing = 0;
+	view.numOutside = 0;
+	view.numLeaves = 0;
+	view.numCulledNodes = 0;
+	view.numOccludedNodes = 0;
+
+	int numOccluders = 0;
+	view.occlusion = NULL;
+	if (world->occlusion.depth) {
+		numOccluders = DrawOccluders(world, camera, frame->aspect, lastList);
+		if (numOccluders > 0) {
+			view.occlusion = &world->occlusion;
+		}
+	}
 
-			SkyTexCoord(world, textureIndex, dir1, scroll, &s, &t);
-			glTexCoord2f(s, t);
-			glVertex3f(camera->origin[0] + dir1[0] * radius,
-					camera->origin[1] + dir1[1] * radius,
-					camera->origin[2] + dir1[2] * radius);
+	// Big visible sets are walked across the thread pool
+	if (pool.numThreads > 0 && view.set->numLeaves >= PARALLEL_WALK_LEAVES) {
+		WalkWorldParallel(world, &view, &frame->drawList);
+	} else {
+		WalkWorldNode(world, &view, (int)(world->map.getStartNode() - world->map.getNode(0)), RETRO_FRUSTUM_ALL);
+		BuildDrawList(world, view.surfaces, view.numSurfaces, &frame->drawList);
+	}
 
-			SkyTexCoord(world, textureIndex, dir0, scroll, &s, &t);
-			glTexCoord2f(s, t);
-			glVertex3f(camera->origin[0] + dir0[0] * radius,
-					camera->origin[1] + dir0[1] * radius,
-					camera->origin[2] + dir0[2] * radius);
+	stats->frames = 1;
+	stats->pvsLeaves = view.set->numLeaves;
+	stats->viewLeaves = view.numLeaves;
+	stats->culledNodes = view.numCulledNodes;
+	stats->occluders = numOccluders;
+	stats->occludedNodes = view.numOccludedNodes;
+	stats->markedSurfaces = view.numMarkedSurfaces;
+	stats->duplicateSurfaces = view.numDuplicates;
+	stats->backfacingSurfaces = view.numBackfacing;
+	stats->outsideSurfaces = view.numOutside;
+	stats->visibleSurfaces = view.numSurfaces;
+}
+
+//
+// Vis thread: find the visible surfaces of each submitted frame, with the frame before
+// it, which the main thread is drawing meanwhile, as the source of occluders
+//
+int SDLCALL RunVisPipeline(void *data)
+{
+	World *world = (World *)data;
+	VisPipeline *pipeline = &world->pipeline;
+	for (;;) {
+		SDL_WaitSemaphore(pipeline->start);
+		if (SDL_GetAtomicInt(&pipeline->quit)) {
+			return 0;
 		}
-		glEnd();
+		int frame = SDL_GetAtomicInt(&pipeline->submitted);
+		FindVisibleSurfaces(world, &world->frames[frame & 1], &world->frames[(frame - 1) & 1].drawList);
+		SDL_SetAtomicInt(&pipeline->published, frame);
+		SDL_SignalSemaphore(pipeline->done);
 	}
 }
 
-void DrawSkyBackground(World *world, RETRO_Camera *camera)
+//
+// Start the vis thread of --pipelinevis
+//
+void StartVisPipeline(World *world)
 {
-	int textureIndex = world->skyTextureIndex;
-	if (textureIndex < 0 || textureIndex >= world->numTextures || world->textures[textureIndex].skyBackObjName == 0) {
-		return;
+	VisPipeline *pipeline = &world->pipeline;
+	SDL_SetAtomicInt(&pipeline->submitted, 0);
+	SDL_SetAtomicInt(&pipeline->published, 0);
+	SDL_SetAtomicInt(&pipeline->quit, 0);
+	pipeline->numFrames = 0;
+	pipeline->start = SDL_CreateSemaphore(0);
+	pipeline->done = SDL_CreateSemaphore(0);
+	if (!pipeline->start || !pipeline->done) {
+		RETRO_RageQuit("Unable to create the vis thread semaphores: %s\n", SDL_GetError());
+	}
+	pipeline->thread = SDL_CreateThread(RunVisPipeline, "VisPipeline", world);
+	if (!pipeline->thread) {
+		RETRO_RageQuit("Unable to start the vis thread: %s\n", SDL_GetError());
 	}
+}
 
-	glActiveTextureFn(GL_TEXTURE1);
-	glDisable(GL_TEXTURE_2D);
-	glActiveTextureFn(GL_TEXTURE0);
-	glDisable(GL_DEPTH_TEST);
-	glDepthMask(GL_FALSE);
-	glDisable(GL_CULL_FACE);
-	glColor4f(1.0f, 1.0f, 1.0f, 1.0f);
+//
+// Stop the vis thread once it has finished the frame it is on
+//
+void StopVisPipeline(World *world)
+{
+	VisPipeline *pipeline = &world->pipeline;
+	if (pipeline->thread) {
+		SDL_SetAtomicInt(&pipeline->quit, 1);
+		SDL_SignalSemaphore(pipeline->start);
+		SDL_WaitThread(pipeline->thread, NULL);
+		pipeline->thread = NULL;
+	}
+	if (pipeline->start) { SDL_DestroySemaphore(pipeline->start); pipeline->start = NULL; }
+	if (pipeline->done) { SDL_DestroySemaphore(pipeline->done); pipeline->done = NULL; }
+}
 
-	glDisable(GL_BLEND);
-	DrawSkyBackgroundLayer(world, camera, textureIndex, world->textures[textureIndex].skyBackObjName,
-			(float)(world->textureTime * SKY_BACK_SCROLL_SPEED));
+//
+// Hand a frame's camera to the vis thread, and take back the frame before it, found
+// while the last frame was drawn. Returns NULL for the first frame, which has nothing
+// before it to draw.
+//
+VisFrame *ExchangeVisFrame(World *world, RETRO_Camera *camera, float aspect)
+{
+	VisPipeline *pipeline = &world->pipeline;
+	if (!pipeline->thread) {
+		StartVisPipeline(world);
+	}
 
-	glEnable(GL_BLEND);
-	glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
-	DrawSkyBackgroundLayer(world, camera, textureIndex, world->textures[textureIndex].skyFrontObjName,
-			(float)(world->textureTime * SKY_FRONT_SCROLL_SPEED));
-	glDisable(GL_BLEND);
+	// Wait for the frame in flight, whose slot was drawn from last
+	int last = pipeline->numFrames;
+	while (SDL_GetAtomicInt(&pipeline->published) < last) {
+		SDL_WaitSemaphore(pipeline->done);
+	}
 
-	glEnable(GL_CULL_FACE);
-	glDepthMask(GL_TRUE);
-	glEnable(GL_DEPTH_TEST);
-	glActiveTextureFn(GL_TEXTURE1);
-	glEnable(GL_TEXTURE_2D);
-	glActiveTextureFn(GL_TEXTURE0);
+	VisFrame *next = &world->frames[(last + 1) & 1];
+	next->camera = *camera;
+	next->aspect = aspect;
+	pipeline->numFrames = last + 1;
+	SDL_SetAtomicInt(&pipeline->submitted, last + 1);
+	SDL_SignalSemaphore(pipeline->start);
+	return last > 0 ? &world->frames[last & 1] : NULL;
 }
 
 //
-// Draw the surface
+// Add the counters of a frame to the running totals
 //
-void DrawSurface(World *world, int surface)
+void AddRenderStats(RenderStats *stats, const RenderStats *frame)
 {
-	// Get the surface primitive
-	primdesc_t *primitives = &world->surfacePrimitives[world->numMaxEdgesPerSurface * surface];
+	stats->frames += frame->frames;
+	stats->pvsLeaves += frame->pvsLeaves;
+	stats->viewLeaves += frame->viewLeaves;
+	stats->culledNodes += frame->culledNodes;
+	stats->occluders += frame->occluders;
+	stats->occludedNodes += frame->occludedNodes;
+	stats->markedSurfaces += frame->markedSurfaces;
+	stats->duplicateSurfaces += frame->duplicateSurfaces;
+	stats->backfacingSurfaces += frame->backfacingSurfaces;
+	stats->outsideSurfaces += frame->outsideSurfaces;
+	stats->visibleSurfaces += frame->visibleSurfaces;
+	stats->drawCalls += frame->drawCalls;
+	stats->textureBinds += frame->textureBinds;
+	stats->lightmapBinds += frame->lightmapBinds;
+	stats->unchainedBinds += frame->unchainedBinds;
+	stats->lightmapUploadBytes += frame->lightmapUploadBytes;
+	stats->stateCalls += frame->stateCalls;
+	stats->redundantStateCalls += frame->redundantStateCalls;
+	stats->pvsDecodes += frame->pvsDecodes;
+	stats->visibleSetHits += frame->visibleSetHits;
+	stats->visibleSetMisses += frame->visibleSetMisses;
+}
 
-	// Liquid surfaces ripple their texture coordinates.
-	int miptex = world->map.getTextureInfo(surface)->miptex;
-	bool turbulent = world->textures[miptex].turbulent;
-	float time = (float)world->textureTime;
+//
+// Draw a frame from its camera: the sky background, then the surfaces of its draw list
+//
+void DrawFrame(World *world, VisFrame *frame)
+{
+	// Setup a viewing matrix and transformation (the framebuffer clear and the
+	// modelview reset are handled by the RETRO main loop before this is called)
+	RETRO_Camera *camera = &frame->camera;
+	gluLookAt(camera->origin[0], camera->origin[1], camera->origin[2],
+			camera->origin[0] + camera->forward[0],
+			camera->origin[1] + camera->forward[1],
+			camera->origin[2] + camera->forward[2],
+			camera->up[0], camera->up[1], camera->up[2]);
 
-	// Loop through all vertices of the primitive and draw a surface. BSP faces are
-	// convex, so a triangle fan from the first vertex fills the whole face.
-	glBegin(GL_TRIANGLE_FAN);
-	for (int i = 0; i < world->map.getNumEdges(surface); i++, primitives++) {
-		float s = primitives->t[0];
-		float t = primitives->t[1];
-		if (turbulent) {
-			// Ripple the texture coordinates with a time-varying sine
-			s = primitives->t[0] + sinf(primitives->t[1] * WARP_SPACE_FREQ + time * WARP_TIME_FREQ) * WARP_AMPLITUDE;
-			t = primitives->t[1] + sinf(primitives->t[0] * WARP_SPACE_FREQ + time * WARP_TIME_FREQ) * WARP_AMPLITUDE;
-		}
-		glMultiTexCoord2fFn(GL_TEXTURE0, s, t);
-		glMultiTexCoord2fFn(GL_TEXTURE1, primitives->l[0], primitives->l[1]);
-		glVertex3fv(primitives->v);
-	}
-	glEnd();
+	// Draw one continuous sky behind the world; BSP sky faces are skipped so they
+	// reveal this background instead of carrying their own texture projection.
+	unsigned int issued = glState.issued;
+	unsigned int skipped = glState.skipped;
+	DrawSkyBackground(world, camera);
+
+	DrawSurfaces(world, &frame->drawList, &world->stats);
+	world->stats.stateCalls += glState.issued - issued;
+	world->stats.redundantStateCalls += glState.skipped - skipped;
+	AddRenderStats(&world->stats, &frame->stats);
 }
 
 //
-// Draw the visible surfaces
+// Print the rendering counters once a second, averaged per frame, except the visible
+// set hits and misses and the PVS decodes, which are totals over the report's frames
 //
-void DrawSurfaces(World *world, int *visibleSurfaces, int numVisibleSurfaces)
+void ReportRenderStats(World *world)
 {
-	// Loop through all the visible surfaces and draw them
-	for (int i = 0; i < numVisibleSurfaces; i++) {
-		int surfaceIndex = visibleSurfaces[i];
-		Surface *surface = &world->surfaces[surfaceIndex];
-		// If the lightmap is dynamic, rebuild it with the current style values
-		if (surface->lightmapDynamic && surface->lightmapFrame != world->lightStyleFrame) {
-			RebuildLightmap(world, surfaceIndex);
-			surface->lightmapFrame = world->lightStyleFrame;
-		}
-		// Get a pointer to the texture info so we know which base texture to bind
-		texinfo_t *textureInfo = world->map.getTextureInfo(surfaceIndex);
-		// Resolve animated textures to their current frame
-		int textureIndex = ResolveTextureAnimation(world, textureInfo->miptex);
-		Texture *texture = &world->textures[textureIndex];
-		if (texture->sky) {
-			continue;
-		}
-		// Bind the base texture to unit 0 and the surface's lightmap to unit 1
-		glActiveTextureFn(GL_TEXTURE0);
-		glBindTexture(GL_TEXTURE_2D, texture->objName);
-		glActiveTextureFn(GL_TEXTURE1);
-		glBindTexture(GL_TEXTURE_2D, surface->lightmapObjName);
-		// Draw the surface
-		DrawSurface(world, surfaceIndex);
+	RenderStats *stats = &world->stats;
+	unsigned long int now = SDL_GetTicks();
+	if (now - stats->lastReport < 1000UL || stats->frames == 0) {
+		return;
+	}
 
-		// If the texture has luma/fullbright pixels, draw a second pass
-		if (texture->hasLuma) {
-			// Disable multitexturing
-			glActiveTextureFn(GL_TEXTURE1);
-			glDisable(GL_TEXTURE_2D);
+	printf("[STATS] %d frames: %d of %d PVS leaves in view (%d culled, %d behind %d occluders), %d surfaces submitted in %d draw calls with %d texture and %d lightmap binds (%d unchained) of %d marked (%.1f%% duplicates), %d back-facing and %d outside the view rejected, %d lightmap bytes uploaded, %d GL state calls (%d redundant skipped); over all frames, visible sets %d hits %d misses, %d PVS decodes\n",
+			stats->frames, stats->viewLeaves / stats->frames, stats->pvsLeaves / stats->frames, stats->culledNodes / stats->frames,
+			stats->occludedNodes / stats->frames, stats->occluders / stats->frames,
+			stats->visibleSurfaces / stats->frames, stats->drawCalls / stats->frames,
+			stats->textureBinds / stats->frames, stats->lightmapBinds / stats->frames, stats->unchainedBinds / stats->frames, stats->markedSurfaces / stats->frames,
+			stats->markedSurfaces ? 100.0f * stats->duplicateSurfaces / stats->markedSurfaces : 0.0f,
+			stats->backfacingSurfaces / stats->frames, stats->outsideSurfaces / stats->frames,
+			stats->lightmapUploadBytes / stats->frames, stats->stateCalls / stats->frames, stats->redundantStateCalls / stats->frames,
+			stats->visibleSetHits, stats->visibleSetMisses, stats->pvsDecodes);
+
+	*stats = RenderStats();
+	stats->lastReport = now;
+}
 
-			// Enable alpha test
-			glEnable(GL_ALPHA_TEST);
-			glAlphaFunc(GL_GREATER, 0.0f);
+//
+// Name of a map inside the paks: "e1m1" and "e1m1.bsp" -> "maps/e1m1.bsp", while a
+// name with a directory is taken as is
+//
+void MapPakName(const char *map, char *name, size_t size)
+{
+	const char *extension = strrchr(map, '.');
+	if (strchr(map, '/')) {
+		snprintf(name, size, "%s", map);
+	} else if (extension && strcmp(extension, ".bsp") == 0) {
+		snprintf(name, size, "maps/%s", map);
+	} else {
+		snprintf(name, size, "maps/%s.bsp", map);
+	}
+}
 
-			// Bind luma texture to unit 0
-			glActiveTextureFn(GL_TEXTURE0);
-			glBindTexture(GL_TEXTURE_2D, texture->lumaObjName);
+//
+// Find a game file in the open paks, or failing that map the first loose file that
+// exists. A file found in a pak is a span of the pak mapping.
+//
+bool OpenGameFile(const char *name, const char *looseFilename, const char *altLooseFilename, RETRO_MappedFile *file)
+{
+	if (RETRO_FindPakFile(&paks, name, file)) {
+		return true;
+	}
+	if (RETRO_MapFile(looseFilename, file, RETRO.hugepages)) {
+		return true;
+	}
+	return altLooseFilename && RETRO_MapFile(altLooseFilename, file, RETRO.hugepages);
+}
 
-			// Draw the surface again
-			DrawSurface(world, surfaceIndex);
+//
+// Load a map, palette and colormap from the game directory's paks (pak0.pak, then
+// pak1.pak overriding it), falling back to loose files in the game directory
+//
+bool LoadMap(const char *map, RETRO_BSP *bsp)
+{
+	char pakFilename[1024];
+	for (int i = 0; i < 2; i++) {
+		snprintf(pakFilename, sizeof(pakFilename), "%s/pak%d.pak", GAME_DIRECTORY, i);
+		RETRO_OpenPak(&paks, pakFilename, RETRO.hugepages);
+	}
 
-			// Restore state
-			glDisable(GL_ALPHA_TEST);
-			glActiveTextureFn(GL_TEXTURE1);
-			glEnable(GL_TEXTURE_2D);
-			glActiveTextureFn(GL_TEXTURE0);
-		}
+	char mapName[PAK_NAME_LENGTH + 64];
+	char looseFilename[1024];
+	MapPakName(map, mapName, sizeof(mapName));
+	const char *separator = strrchr(mapName, '/');
+	snprintf(looseFilename, sizeof(looseFilename), "%s/%s", GAME_DIRECTORY, separator + 1);
+
+	// Only a map given as a path ("dir/e1m1" or "e1m1.bsp") is tried as a file of its
+	// own, before the game directory, so a stray "./start" cannot hide assets/start.bsp
+	const char *extension = strrchr(map, '.');
+	bool path = strchr(map, '/') || (extension && strcmp(extension, ".bsp") == 0);
+
+	RETRO_MappedFile bspFile;
+	RETRO_MappedFile paletteFile;
+	RETRO_MappedFile colormapFile;
+	if (!OpenGameFile(mapName, path ? map : looseFilename, path ? looseFilename : NULL, &bspFile)) {
+		printf("[ERROR] LoadMap() Unable to find map %s\n", mapName);
 	}
+	OpenGameFile("gfx/palette.lmp", GAME_DIRECTORY "/palette.lmp", NULL, &paletteFile);
+	OpenGameFile("gfx/colormap.lmp", GAME_DIRECTORY "/colormap.lmp", NULL, &colormapFile);
+	return RETRO_LoadBSP(bsp, bspFile, paletteFile, colormapFile);
 }
 
 //
-// Calculate which other leaves are visible from the specified leaf, fetch the associated surfaces and draw them
+// Read the next token of the entity lump: a brace or a quoted string. Returns a
+// pointer past the token, or NULL at the end of the lump.
 //
-void DrawVisibleSet(World *world, dleaf_t *pLeaf)
+const char *ParseEntityToken(const char *data, const char *end, char *token, size_t size)
 {
-	int numVisibleSurfaces = 0;
-	// Leaves are numbered 1..numLeaves; bit (i-1) of the PVS maps to leaf i.
-	int numLeaves = world->map.getNumLeaves();
+	while (data < end && *data && *data <= ' ') {
+		data++;
+	}
+	if (data >= end || !*data) {
+		return NULL;
+	}
 
-	if (pLeaf->visofs < 0) {
-		// No visibility information for this leaf: treat every leaf as potentially visible.
-		for (int i = 1; i <= numLeaves; i++) {
-			dleaf_t *visibleLeaf = world->map.getLeaf(i);
-			int firstSurface = visibleLeaf->firstmarksurface;
-			int lastSurface = firstSurface + visibleLeaf->nummarksurfaces;
-			for (int k = firstSurface; k < lastSurface; k++) {
-				world->visibleSurfaces[numVisibleSurfaces++] = world->map.getSurfaceList(k);
+	size_t length = 0;
+	if (*data == '"') {
+		data++;
+		while (data < end && *data && *data != '"') {
+			if (length + 1 < size) {
+				token[length++] = *data;
 			}
+			data++;
 		}
+		if (data < end && *data == '"') {
+			data++;
+		}
+	} else if (*data == '{' || *data == '}') {
+		token[length++] = *data++;
 	} else {
-		// Decompress the run-length encoded PVS. A zero byte means "skip the next
-		// (8 * following byte) leaves"; any other byte holds 8 visibility bits,
-		// least-significant bit first.
-		unsigned char *visibilityList = world->map.getVisibilityList(pLeaf->visofs);
-		for (int i = 1; i <= numLeaves; ) {
-			if (*visibilityList == 0) {
-				i += 8 * visibilityList[1];
-				visibilityList += 2;
-			} else {
-				for (int bit = 1; bit < 256 && i <= numLeaves; bit <<= 1, i++) {
-					if (*visibilityList & bit) {
-						// Fetch the leaf that is seen and copy its surfaces
-						dleaf_t *visibleLeaf = world->map.getLeaf(i);
-						int firstSurface = visibleLeaf->firstmarksurface;
-						int lastSurface = firstSurface + visibleLeaf->nummarksurfaces;
-						for (int k = firstSurface; k < lastSurface; k++) {
-							world->visibleSurfaces[numVisibleSurfaces++] = world->map.getSurfaceList(k);
-						}
-					}
-				}
-				visibilityList++;
+		while (data < end && *data > ' ' && *data != '"' && *data != '{' && *data != '}') {
+			if (length + 1 < size) {
+				token[length++] = *data;
+			}
+			data++;
+		}
+	}
+	token[length] = '\0';
+	return data;
+}
+
+//
+// Find the origin and facing of the map's info_player_start entity
+//
+bool FindPlayerStart(World *world, float origin[3], float *angle)
+{
+	const char *data = world->map.getEntities();
+	const char *end = data + world->map.entitiesLength;
+	char key[64];
+	char value[256];
+	float entityOrigin[3] = { 0.0f, 0.0f, 0.0f };
+	float entityAngle = 0.0f;
+	bool isPlayerStart = false;
+
+	while ((data = ParseEntityToken(data, end, key, sizeof(key)))) {
+		if (strcmp(key, "{") == 0) {
+			isPlayerStart = false;
+			entityOrigin[0] = entityOrigin[1] = entityOrigin[2] = 0.0f;
+			entityAngle = 0.0f;
+		} else if (strcmp(key, "}") == 0) {
+			if (isPlayerStart) {
+				origin[0] = entityOrigin[0];
+				origin[1] = entityOrigin[1];
+				origin[2] = entityOrigin[2];
+				*angle = entityAngle;
+				return true;
+			}
+		} else {
+			if (!(data = ParseEntityToken(data, end, value, sizeof(value)))) {
+				break;
+			}
+			if (strcmp(key, "classname") == 0) {
+				isPlayerStart = strcmp(value, "info_player_start") == 0;
+			} else if (strcmp(key, "origin") == 0) {
+				sscanf(value, "%f %f %f", &entityOrigin[0], &entityOrigin[1], &entityOrigin[2]);
+			} else if (strcmp(key, "angle") == 0) {
+				entityAngle = atof(value);
 			}
 		}
 	}
+	return false;
+}
+
+// A batch of textures or lightmaps cooked with RETRO_ParallelFor
+struct CookBatch
+{
+	World *world;
+	int first;		// Index of the batch's first texture or surface
+};
 
-	// Draw the copied surfaces
-	DrawSurfaces(world, world->visibleSurfaces, numVisibleSurfaces);
+static void ConvertTextureInBatch(void *data, int index)
+{
+	CookBatch *batch = (CookBatch *)data;
+	ConvertTexture(batch->world, batch->first + index);
+}
+
+static void CombineLightmapInBatch(void *data, int index)
+{
+	CookBatch *batch = (CookBatch *)data;
+	CombineLightmap(batch->world, batch->first + index);
 }
 
 //
-// Traverse the BSP tree to find the leaf containing the camera
+// Loader thread: load the map, then map the world cache or cook the world. The
+// textures and lightmaps are cooked in batches spread across the thread pool, and
+// each batch is counted as cooked as soon as it is written, so the main thread can
+// upload it while the rest are still being converted.
 //
-dleaf_t *FindCameraLeaf(World *world, RETRO_Camera *camera)
+int SDLCALL LoadWorld(void *data)
 {
-	dleaf_t *leaf = NULL;
+	World *world = (World *)data;
+	WorldLoader *loader = &world->loader;
+	CookedWorld *cooked = &world->cooked;
+
+	if (!LoadMap(RETRO.map, &world->map)) {
+		loader->error = "Unable to load BSP\n";
+		SDL_SetAtomicInt(&loader->stage, LOAD_FAILED);
+		return 0;
+	}
 
-	// Fetch the start node
-	dnode_t *node = world->map.getStartNode();
+	// A map built without vis would draw every leaf from everywhere
+	if (RETRO.buildvis && !RETRO_HasVis(&world->map)) {
+		BuildVis(world);
+	}
 
-	while (!leaf) {
-		short nextNodeId;
+	// Decompress every leaf's PVS up front when the map is small enough, so changing
+	// leaf costs nothing; otherwise the renderer decodes the camera leaf's PVS
+	if (RETRO.pvsbudget > 0) {
+		RETRO_BuildPVSMatrix(&world->pvs, &world->map, (size_t)RETRO.pvsbudget << 20);
+	}
 
-		// Get a pointer to the plane which intersects the node
-		dplane_t *plane = world->map.getPlane(node->planenum);
+	char cacheFilename[1024];
+	WorldCacheFilename(RETRO.map, ".cache", cacheFilename, sizeof(cacheFilename));
+	if (RETRO.usecache && LoadWorldCache(world, cacheFilename)) {
+		// Start reading the cached pixels in while the main thread uploads
+		RETRO_AdviseFile(&cooked->cache.file, 0, cooked->cache.file.length, MADV_WILLNEED);
+		SDL_SetAtomicInt(&loader->numCookedTextures, cooked->info.numTextures);
+		SDL_SetAtomicInt(&loader->numCookedSurfaces, cooked->info.numSurfaces);
+		SDL_SetAtomicInt(&loader->stage, LOAD_COOKED);
+		return 0;
+	}
 
-		// Calculate distance to the intersecting plane
-		float distance = DotProduct(plane->normal, camera->origin);
+	if (!PlanWorld(world)) {
+		loader->error = "Unable to cook the world\n";
+		SDL_SetAtomicInt(&loader->stage, LOAD_FAILED);
+		return 0;
+	}
+	SDL_SetAtomicInt(&loader->stage, LOAD_COOKING);
 
-		// If the camera is in front of the plane, traverse the right (front) node, otherwise traverse the left (back) node
-		if (distance > plane->dist) {
-			nextNodeId = node->children[0];
-		} else {
-			nextNodeId = node->children[1];
+	CookBatch batch = { world, 0 };
+	for (batch.first = 0; batch.first < cooked->info.numTextures; batch.first += COOK_TEXTURE_BATCH) {
+		if (SDL_GetAtomicInt(&loader->cancel)) {
+			return 0;
 		}
-
-		// If next node >= 0, traverse the node, otherwise use the inverse of the node as the index to the leaf (and we are done!)
-		if (nextNodeId >= 0) {
-			node = world->map.getNode(nextNodeId);
-		} else {
-			leaf = world->map.getLeaf(~nextNodeId);
+		int count = SDL_min(COOK_TEXTURE_BATCH, cooked->info.numTextures - batch.first);
+		RETRO_ParallelFor(&pool, count, ConvertTextureInBatch, &batch);
+		SDL_AddAtomicInt(&loader->numCookedTextures, count);
+	}
+	for (batch.first = 0; batch.first < cooked->info.numSurfaces; batch.first += COOK_SURFACE_BATCH) {
+		if (SDL_GetAtomicInt(&loader->cancel)) {
+			return 0;
 		}
+		int count = SDL_min(COOK_SURFACE_BATCH, cooked->info.numSurfaces - batch.first);
+		RETRO_ParallelFor(&pool, count, CombineLightmapInBatch, &batch);
+		SDL_AddAtomicInt(&loader->numCookedSurfaces, count);
+	}
+
+	if (RETRO.usecache && !WriteWorldCache(world, cacheFilename)) {
+		printf("[ERROR] LoadWorld() Unable to write world cache %s\n", cacheFilename);
+	}
+	SDL_SetAtomicInt(&loader->stage, LOAD_COOKED);
+	return 0;
+}
+
+//
+// Start loading the world on the loader thread
+//
+void StartWorldLoad(World *world)
+{
+	WorldLoader *loader = &world->loader;
+	SDL_SetAtomicInt(&loader->stage, LOAD_MAP);
+	SDL_SetAtomicInt(&loader->numCookedTextures, 0);
+	SDL_SetAtomicInt(&loader->numCookedSurfaces, 0);
+	SDL_SetAtomicInt(&loader->cancel, 0);
+	loader->thread = SDL_CreateThread(LoadWorld, "LoadWorld", world);
+	if (!loader->thread) {
+		RETRO_RageQuit("Unable to start the loader thread: %s\n", SDL_GetError());
+	}
+}
+
+//
+// Drive the world load from the main thread, once per frame. When the loader has
+// planned the world, set up its render state and move the camera to the player
+// start; then upload the textures and lightmaps the loader has finished, at most
+// UPLOAD_BUDGET bytes per frame so that big maps stream in without frame hitches.
+// Returns false while there is nothing to draw yet.
+//
+bool UpdateWorldLoad(World *world, RETRO_Camera *camera)
+{
+	WorldLoader *loader = &world->loader;
+	if (!loader->thread) {
+		return true;
+	}
+
+	int stage = SDL_GetAtomicInt(&loader->stage);
+	if (stage == LOAD_FAILED) {
+		SDL_WaitThread(loader->thread, NULL);
+		loader->thread = NULL;
+		RETRO_RageQuit(loader->error);
+	}
+	if (stage < LOAD_COOKING) {
+		return false;
+	}
+
+	if (!world->surfaces) {
+		CreateWorldObjects(world);
+		UpdateLightStyles(world, 0.0);
+
+		// Start at the map's player start, at eye height
+		float origin[3] = { 540.0f, 260.0f, 100.0f - VIEW_HEIGHT };
+		float angle = 90.0f;
+		FindPlayerStart(world, origin, &angle);
+		camera->SetPosition(origin[0], origin[1], origin[2] + VIEW_HEIGHT);
+		camera->SetOrientation(angle, 0.0f);
+		camera->Update();
+	}
+
+	// Upload whatever the loader has cooked, within this frame's budget
+	size_t uploaded = 0;
+	int numCookedTextures = SDL_GetAtomicInt(&loader->numCookedTextures);
+	while (uploaded < UPLOAD_BUDGET && loader->numUploadedTextures < numCookedTextures) {
+		uploaded += UploadTexture(world, loader->numUploadedTextures++);
+	}
+	int numCookedSurfaces = SDL_GetAtomicInt(&loader->numCookedSurfaces);
+	while (uploaded < UPLOAD_BUDGET && loader->numUploadedSurfaces < numCookedSurfaces) {
+		uploaded += UploadSurface(world, loader->numUploadedSurfaces++);
 	}
 
-	return leaf;
+	// Once everything is uploaded, the loader is done and the cooked pixels can go
+	if (stage == LOAD_COOKED && loader->numUploadedTextures == world->numTextures &&
+			loader->numUploadedSurfaces == world->cooked.info.numSurfaces) {
+		SDL_WaitThread(loader->thread, NULL);
+		loader->thread = NULL;
+		FreeCookedPixels(world);
+	}
+	return true;
 }
 
 void DEMO_Startup(void)
@@ -848,53 +3384,66 @@ void DEMO_Startup(void)
 	RETRO.fov = 75.0;
 	RETRO.znear = 1.0;
 	RETRO.zfar = 5000.0;
+	RETRO.map = "start";
 }
 
 void DEMO_Initialize(void)
 {
-	// Load the map (BSP, palette and colormap)
-	world.map = RETRO_LoadBSP("assets/start.bsp", "assets/palette.lmp", "assets/colormap.lmp");
-	if (!world.map.bsp) {
-		RETRO_RageQuit("Unable to load BSP\n");
-	}
-
 	// Lightmapping needs the multitexture entry points the retro lib resolves at startup
 	if (!glActiveTextureFn || !glMultiTexCoord2fFn) {
 		RETRO_RageQuit("Multitexturing is not supported\n");
 	}
 
-	// Build the world from the map
-	if (!UploadTextures(&world)) {
-		RETRO_RageQuit("Unable to initialize world textures\n");
-	}
-	if (!BuildSurfacePrimitives(&world)) {
-		RETRO_RageQuit("Unable to initialize world surfaces\n");
-	}
-	if (!BuildTextureAnimations(&world)) {
-		RETRO_RageQuit("Unable to initialize texture animations\n");
-	}
-
-	UpdateLightStyles(&world, 0.0);
+	// Load the map (BSP, palette and colormap) and cook the world in the background,
+	// with a worker per remaining core; DEMO_Render uploads the results as they come in
+	RETRO_StartThreadPool(&pool, SDL_GetNumLogicalCPUCores() - 1);
+	StartWorldLoad(&world);
 
 	// Configure the lightmap texture unit (1) to modulate the base texture on unit 0.
 	// GL_COMBINE with an RGB scale of 2 applies "overbright" lighting so lit surfaces are
 	// not too dark; the combine defaults already multiply this unit's lightmap texel by the
 	// incoming base colour from unit 0.
-	glActiveTextureFn(GL_TEXTURE1);
-	glEnable(GL_TEXTURE_2D);
+	RETROGL_ActiveTexture(GL_TEXTURE1);
+	RETROGL_Enable(GL_TEXTURE_2D);
 	glTexEnvi(GL_TEXTURE_ENV, GL_TEXTURE_ENV_MODE, GL_COMBINE);
 	glTexEnvf(GL_TEXTURE_ENV, GL_RGB_SCALE, 2.0f);
-	glActiveTextureFn(GL_TEXTURE0);
 
-	// Set the camera's starting position
-	camera.SetPosition(540.0f, 260.0f, 100.0f);
-	camera.SetOrientation(90.0f, 0.0f);
+	// Configure the luma texture unit (2), if there is one, to lay the fullbright pixels
+	// over the lit colour from unit 1. The luma alpha is 1 on fullbright pixels and 0
+	// elsewhere, so interpolating by it replaces exactly the pixels the old alpha-tested
+	// second pass drew over; adding the luma would brighten them twice, as the base
+	// texture already holds their colour.
+	GLint textureUnits = 0;
+	glGetIntegerv(GL_MAX_TEXTURE_UNITS, &textureUnits);
+	world.lumaUnit = textureUnits >= 3 && glClientActiveTextureFn;
+	if (world.lumaUnit) {
+		RETROGL_ActiveTexture(GL_TEXTURE2);
+		glTexEnvi(GL_TEXTURE_ENV, GL_TEXTURE_ENV_MODE, GL_COMBINE);
+		glTexEnvi(GL_TEXTURE_ENV, GL_COMBINE_RGB, GL_INTERPOLATE);
+		glTexEnvi(GL_TEXTURE_ENV, GL_SOURCE0_RGB, GL_TEXTURE);
+		glTexEnvi(GL_TEXTURE_ENV, GL_SOURCE1_RGB, GL_PREVIOUS);
+		glTexEnvi(GL_TEXTURE_ENV, GL_SOURCE2_RGB, GL_TEXTURE);
+		glTexEnvi(GL_TEXTURE_ENV, GL_OPERAND2_RGB, GL_SRC_ALPHA);
+		glTexEnvi(GL_TEXTURE_ENV, GL_COMBINE_ALPHA, GL_REPLACE);
+		glTexEnvi(GL_TEXTURE_ENV, GL_SOURCE0_ALPHA, GL_PREVIOUS);
+	}
+	RETROGL_ActiveTexture(GL_TEXTURE0);
+
+	// The camera moves to the map's player start once the map is loaded
 	camera.SetMovementSpeed(MOVEMENT_SPEED);
 	camera.SetFlycam(true);
 }
 
 void DEMO_Deinitialize(void)
 {
+	// Stop the loader before releasing anything it may still be writing
+	if (world.loader.thread) {
+		SDL_SetAtomicInt(&world.loader.cancel, 1);
+		SDL_WaitThread(world.loader.thread, NULL);
+		world.loader.thread = NULL;
+	}
+	StopVisPipeline(&world);
+	RETRO_StopThreadPool(&pool);
 	if (world.textures) {
 		for (int i = 0; i < world.numTextures; i++) {
 			Texture *texture = &world.textures[i];
@@ -907,15 +3456,81 @@ void DEMO_Deinitialize(void)
 		world.textures = NULL;
 	}
 	if (world.surfaces) {
-		for (int i = 0; i < world.map.getNumSurfaces(); i++) {
-			glDeleteTextures(1, &world.surfaces[i].lightmapObjName);
-		}
 		delete[] world.surfaces;
 		world.surfaces = NULL;
 	}
-	if (world.surfacePrimitives) { delete[] world.surfacePrimitives; world.surfacePrimitives = NULL; }
+	if (world.surfaceRecords) {
+		delete[] world.surfaceRecords;
+		world.surfaceRecords = NULL;
+	}
+	if (world.lightmaps) {
+		for (int i = 0; i < world.numLightmaps; i++) {
+			glDeleteTextures(1, &world.lightmaps[i].objName);
+			delete[] world.lightmaps[i].luxels;
+		}
+		delete[] world.lightmaps;
+		world.lightmaps = NULL;
+		world.numLightmaps = 0;
+	}
+	if (world.lightmapUploadBuffer) {
+		glDeleteBuffersFn(1, &world.lightmapUploadBuffer);
+		world.lightmapUploadBuffer = 0;
+	}
+	delete[] world.surfaceSpheres.x;
+	world.surfaceSpheres = SurfaceSpheres();
+	glDeleteTextures(1, &world.placeholderTexture);
+	delete[] world.chains.chains;
+	delete[] world.chains.surfaces;
+	delete[] world.chains.nextRange;
+	delete[] world.chains.textureChains;
+	delete[] world.chains.lightmapGroups;
+	delete[] world.chains.groupLightmaps;
+	delete[] world.chains.groupStarts;
+	world.chains = TextureChains();
+	world.vertexPositions = NULL;
+	world.vertexCoords = NULL;
+	if (world.vertexBuffer) {
+		glDeleteBuffersFn(1, &world.vertexBuffer);
+		glDeleteBuffersFn(1, &world.indexBuffer);
+		world.vertexBuffer = 0;
+		world.indexBuffer = 0;
+	}
+	delete[] world.batchCounts;
+	delete[] world.batchOffsets;
+	world.batchCounts = NULL;
+	world.batchOffsets = NULL;
 	if (world.visibleSurfaces) { delete[] world.visibleSurfaces; world.visibleSurfaces = NULL; }
+	for (int i = 0; i < 2; i++) {
+		delete[] world.frames[i].drawList.surfaces;
+		delete[] world.frames[i].drawList.ranges;
+		world.frames[i].drawList = DrawList();
+	}
+	RETRO_FreeOcclusionBuffer(&world.occlusion);
+	for (int i = 0; i < VISIBLE_SET_CACHE_SIZE; i++) {
+		free(world.visibleSets[i].decodedLeaves);
+		delete[] world.visibleSets[i].nodes;
+		world.visibleSets[i] = VisibleSet();
+	}
+	if (world.leafVisibleSets) { delete[] world.leafVisibleSets; world.leafVisibleSets = NULL; }
+	if (world.leafParents) { delete[] world.leafParents; world.leafParents = NULL; }
+	if (world.nodeParents) { delete[] world.nodeParents; world.nodeParents = NULL; }
+	if (world.textureRanges) { delete[] world.textureRanges; world.textureRanges = NULL; }
+	for (int i = 0; i < world.walk.numScratch; i++) {
+		delete[] world.walk.scratch[i].textureRanges;
+	}
+	delete[] world.walk.scratch;
+	delete[] world.walk.items;
+	delete[] world.walk.tasks;
+	delete[] world.walk.surfaces;
+	delete[] world.walk.ranges;
+	delete[] world.walk.nodeLeafCounts;
+	delete[] world.walk.nodeFaceCounts;
+	world.walk = ParallelWalk();
+	RETRO_FreePVSMatrix(&world.pvs);
+	if (world.surfaceVisFrame) { delete[] world.surfaceVisFrame; world.surfaceVisFrame = NULL; }
+	FreeCookedWorld(&world);
 	RETRO_FreeBSP(&world.map);
+	RETRO_ClosePaks(&paks);
 }
 
 void DEMO_Input(double deltatime)
@@ -970,13 +3585,11 @@ void DEMO_Input(double deltatime)
 
 void DEMO_Render(double deltatime)
 {
-	// Setup a viewing matrix and transformation (the framebuffer clear and the
-	// modelview reset are handled by the RETRO main loop before this is called)
-	gluLookAt(camera.origin[0], camera.origin[1], camera.origin[2],
-			camera.origin[0] + camera.forward[0],
-			camera.origin[1] + camera.forward[1],
-			camera.origin[2] + camera.forward[2],
-			camera.up[0], camera.up[1], camera.up[2]);
+	// Upload the next part of the world while it loads; until the map itself is in,
+	// there is nothing to draw
+	if (!UpdateWorldLoad(&world, &camera)) {
+		return;
+	}
 
 	// Advance the clock that drives texture animation
 	world.textureTime += deltatime;
@@ -984,13 +3597,22 @@ void DEMO_Render(double deltatime)
 	// Advance the clock that drives light style animation
 	UpdateLightStyles(&world, deltatime);
 
-	// Draw one continuous sky behind the world; BSP sky faces are skipped so they
-	// reveal this background instead of carrying their own texture projection.
-	DrawSkyBackground(&world, &camera);
-
-	// Find the leaf the camera is in
-	dleaf_t *leaf = FindCameraLeaf(&world, &camera);
+	// Find what the camera sees and draw it, or with --pipelinevis hand the camera to
+	// the vis thread and draw the frame it found while the last one was drawn
+	float aspect = (float)RETRO.width / (float)RETRO.height;
+	VisFrame *frame = &world.frames[0];
+	if (RETRO.pipelinevis) {
+		frame = ExchangeVisFrame(&world, &camera, aspect);
+	} else {
+		frame->camera = camera;
+		frame->aspect = aspect;
+		FindVisibleSurfaces(&world, frame, &frame->drawList);
+	}
+	if (frame) {
+		DrawFrame(&world, frame);
+	}
 
-	// Render the scene
-	DrawVisibleSet(&world, leaf);
+	if (RETRO.showstats) {
+		ReportRenderStats(&world);
+	}
 }